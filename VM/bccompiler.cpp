@@ -1,13 +1,304 @@
 #include "bccompiler.h"
+#include "parser.h"
+#include "verifier.h"
+
+#include <algorithm>
+#include <utility>
 
 using namespace std;
 
+namespace {
+
+// free variables of a lambda, in order of first occurrence
+class FreeVars: public ExprMapper {
+public:
+    static vector<string_view> of(const Lambda& lam) {
+        FreeVars fv;
+        lam.accept(fv);
+        return std::move(fv._free);
+    }
+
+private:
+    virtual void forVar(const Var& v) override {
+        for (const auto& scope: _scopes) {
+            if (find(scope.begin(), scope.end(), v.v_) != scope.end()) return;
+        }
+        if (find(_free.begin(), _free.end(), v.v_) == _free.end()) _free.emplace_back(v.v_);
+    }
+
+    virtual void forLet(const Let& let) override {
+        vector<string_view> names;
+        for (const auto& [k, v]: let.binds_) {
+            v->accept(*this);
+            names.emplace_back(k.v_);
+        }
+        _scopes.push_back(std::move(names));
+        let.body_->accept(*this);
+        _scopes.pop_back();
+    }
+
+    virtual void forLetRec(const LetRec& letrec) override {
+        vector<string_view> names;
+        for (const auto& kv: letrec.binds_) names.emplace_back(kv.first.v_);
+        _scopes.push_back(std::move(names));
+        forLetLike(letrec);
+        _scopes.pop_back();
+    }
+
+    virtual void forLambda(const Lambda& lam) override {
+        vector<string_view> params;
+        for (const auto& p: *lam.params_) params.emplace_back(p.v_);
+        _scopes.push_back(std::move(params));
+        lam.body_->accept(*this);
+        _scopes.pop_back();
+    }
+
+    vector<vector<string_view>>     _scopes;
+    vector<string_view>             _free;
+};
+
+// a binding needs a box iff it is both assigned and captured within its scope
+class BoxAnalysis: public ExprMapper {
+public:
+    struct Uses { bool assigned, captured; };
+
+    static Uses usesOf(string_view name, const Expr& scope) {
+        BoxAnalysis ba(name);
+        scope.accept(ba);
+        return {ba._assigned, ba._captured};
+    }
+
+    static bool needsBox(string_view name, const Expr& scope) {
+        auto uses = usesOf(name, scope);
+        return uses.assigned && uses.captured;
+    }
+
+private:
+    BoxAnalysis(string_view name): _name(name) {}
+
+    virtual void forVar(const Var& v) override {
+        if (v.v_ == _name && _lambdaDepth > 0) _captured = true;
+    }
+
+    virtual void forSetBang(const SetBang& setBang) override {
+        if (setBang.v_.v_ == _name) _assigned = true;
+        ExprMapper::forSetBang(setBang);
+    }
+
+    virtual void forLet(const Let& let) override {
+        bool shadowed = false;
+        for (const auto& [k, v]: let.binds_) {
+            v->accept(*this);
+            shadowed |= k.v_ == _name;
+        }
+        if (!shadowed) let.body_->accept(*this);
+    }
+
+    virtual void forLetRec(const LetRec& letrec) override {
+        for (const auto& kv: letrec.binds_) {
+            if (kv.first.v_ == _name) return;
+        }
+        forLetLike(letrec);
+    }
+
+    virtual void forLambda(const Lambda& lam) override {
+        for (const auto& p: *lam.params_) {
+            if (p.v_ == _name) return;
+        }
+        ++_lambdaDepth;
+        lam.body_->accept(*this);
+        --_lambdaDepth;
+    }
+
+    string_view     _name;
+    int             _lambdaDepth{0};
+    bool            _assigned{false}, _captured{false};
+};
+
+// ((letrec ((name (lambda (v...) body))) name) arg...), a named let, is a loop
+// if name is only ever called, with all args, in tail position of the body.
+// Loops nested in tail position keep it there, see ByteCodeCompiler::compileLoop
+class LoopAnalysis: public ExprMapper {
+public:
+    // answers of loopOf so far, an outer loop asks again for each loop it holds
+    using Memo = unordered_map<const Apply*, const Lambda*>;
+
+    // the lambda of the loop, nullptr if `app` is not one
+    static const Lambda* loopOf(const Apply& app, Memo& memo) {
+        if (auto it = memo.find(&app); it != memo.end()) return it->second;
+        return memo[&app] = analyse(app, memo);
+    }
+
+    static const string& nameOf(const Apply& loop) {
+        return static_cast<const LetRec&>(*loop.operator_).binds_.front().first.v_;
+    }
+
+private:
+    LoopAnalysis(string_view name, size_t arity, Memo& memo): _name(name), _arity(arity), _memo(memo) {}
+
+    static const Lambda* analyse(const Apply& app, Memo& memo) {
+        auto rec = dynamic_cast<const LetRec*>(app.operator_.get());
+        if (!rec || rec->binds_.size() != 1 || rec->body_->getType() != Expr::Type::Var) return nullptr;
+
+        const auto& [name, init] = rec->binds_.front();
+        if (static_cast<const Var&>(*rec->body_).v_ != name.v_ || init->getType() != Expr::Type::Lambda) return nullptr;
+        const auto& lam = static_cast<const Lambda&>(*init);
+        if (lam.arity() != app.operands_.size() || binds(*lam.params_, name.v_)) return nullptr;
+
+        LoopAnalysis la(name.v_, lam.arity(), memo);
+        la.visit(*lam.body_, true);
+        return la._ok? &lam: nullptr;
+    }
+
+    static bool binds(const Lambda::ParamsType& params, string_view name) {
+        return any_of(params.begin(), params.end(), [&](const Var& p) { return p.v_ == name; });
+    }
+
+    void visit(const Expr& expr, bool tail) {
+        const bool outer = std::exchange(_tail, tail);
+        expr.accept(*this);
+        _tail = outer;
+    }
+
+    virtual void forVar(const Var& v) override {
+        if (v.v_ == _name) _ok = false;
+    }
+
+    virtual void forSetBang(const SetBang& setBang) override {
+        if (setBang.v_.v_ == _name) _ok = false;
+        visit(*setBang.e_, false);
+    }
+
+    virtual void forDefine(const Define& def) override {
+        if (def.name_.v_ != _name) visit(*def.body_, false);
+    }
+
+    virtual void forBegin(const Begin& bgn) override {
+        for (const auto& e: bgn.es_) {
+            if (e->getType() == Expr::Type::Define && static_cast<const Define&>(*e).name_.v_ == _name) return;
+        }
+        for (size_t i = 0; i < bgn.es_.size(); ++i) {
+            visit(*bgn.es_[i], _tail && i + 1 == bgn.es_.size());
+        }
+    }
+
+    virtual void forIf(const If& if_) override {
+        visit(*if_.pred_, false);
+        visit(*if_.thn_, _tail);
+        visit(*if_.els_, _tail);
+    }
+
+    virtual void forCase(const Case& cas) override {
+        visit(*cas.key_, false);
+        for (const auto& cl: cas.clauses_) visit(*cl.second, _tail);
+        if (cas.else_) visit(*cas.else_, _tail);
+    }
+
+    virtual void forLet(const Let& let) override {
+        bool shadowed = false;
+        for (const auto& [k, v]: let.binds_) {
+            visit(*v, false);
+            shadowed |= k.v_ == _name;
+        }
+        if (!shadowed) visit(*let.body_, _tail);
+    }
+
+    virtual void forLetRec(const LetRec& letrec) override {
+        for (const auto& kv: letrec.binds_) {
+            if (kv.first.v_ == _name) return;
+        }
+        for (const auto& kv: letrec.binds_) visit(*kv.second, false);
+        visit(*letrec.body_, _tail);
+    }
+
+    virtual void forLambda(const Lambda& lam) override {
+        // calls from a closure are no jumps
+        if (!binds(*lam.params_, _name)) visit(*lam.body_, false);
+    }
+
+    virtual void forApply(const Apply& app) override {
+        for (const auto& arg: app.operands_) visit(*arg, false);
+
+        const auto& rator = *app.operator_;
+        if (rator.getType() == Expr::Type::Var && static_cast<const Var&>(rator).v_ == _name) {
+            if (!_tail || app.operands_.size() != _arity) _ok = false;
+        } else if (auto inner = loopOf(app, _memo)) {
+            if (nameOf(app) != _name && !binds(*inner->params_, _name)) visit(*inner->body_, _tail);
+        } else {
+            visit(rator, false);
+        }
+    }
+
+    string_view     _name;
+    size_t          _arity;
+    bool            _tail{true};
+    bool            _ok{true};
+    Memo&           _memo;
+};
+
+// quoted data is built once, at compile time
+Value::Ptr datumValue(const Parser::Datum& dat) {
+    using Parser::Datum;
+    switch (dat.type_) {
+        case Datum::Type::Number:   return make_shared<Number>(static_cast<const Parser::DatumNum&>(dat).value_);
+        case Datum::Type::Boolean:  return make_shared<Boolean>(static_cast<const Parser::DatumBool&>(dat).value_);
+        case Datum::Type::Symbol:   return make_shared<Symbol>(static_cast<const Parser::DatumSym&>(dat).value_);
+        case Datum::Type::Nil:      return Nil::getInstance();
+        case Datum::Type::Pair: {
+            const auto& pair = static_cast<const Parser::DatumPair&>(dat);
+            return make_shared<Cons>(datumValue(*pair.car_), datumValue(*pair.cdr_));
+        }
+    }
+    return nullptr;
+}
+
+} // namespace
+
+atomic<size_t> ByteCodeCompiler::s_compiledLambdas{0};
+
 Instr::Ptr ByteCodeCompiler::Compile(Expr& expr) {
+    return Compile(expr, Options{});
+}
+
+Instr::Ptr ByteCodeCompiler::Compile(Expr& expr, Options opts) {
     ByteCodeCompiler compiler(Instr::New<Halt>());
+    compiler._env = make_shared<Environment<VarLoc>>();
+    compiler._opts = std::move(opts);
+    if (!compiler._opts.pool) compiler._opts.pool = make_shared<ConstPool>();
+    if (!compiler._opts.globals) compiler._opts.globals = make_shared<GlobalTable>();
+    compiler._topLevel = true;
     expr.accept(compiler);
     return compiler._code;
 }
 
+optional<Instr::Op> ByteCodeCompiler::primOp(string_view op) {
+    using Op = Instr::Op;
+    return op == "+"?  Op::ADD:
+           op == "-"?  Op::SUB:
+           op == "*"?  Op::MUL:
+           op == "/"?  Op::DIV:
+           op == "%"?  Op::MOD:
+           op == "<"?  Op::LT:
+           op == "<="? Op::LE:
+           op == "=="? Op::EQ:
+           op == "="?  Op::EQ:
+           op == ">"?  Op::GT:
+           op == ">="? Op::GE:
+           op == "!="? Op::NEQ:
+           op == "cons"?  Op::CONS:
+           op == "car"?   Op::CAR:
+           op == "cdr"?   Op::CDR:
+           op == "null?"? Op::NULLP:
+           op == "pair?"? Op::PAIRP:
+           op == "eq?"?   Op::EQP:
+           op == "spawn"?         Op::SPAWN:
+           op == "yield"?         Op::YIELD:
+           op == "make-channel"?  Op::MAKECHAN:
+           op == "channel-send"?  Op::SEND:
+           op == "channel-recv"?  Op::RECV:
+           op == "call/cc" || op == "call-with-current-continuation"? optional(Op::CallCC): nullopt;
+}
+
 Instr::Ptr ByteCodeCompiler::compile(const Expr &expr, EnvironmentPtr& env, Instr::Ptr cont) {
     auto oldEnv     = _env;
     auto oldCont    = _cont;
@@ -21,31 +312,109 @@ Instr::Ptr ByteCodeCompiler::compile(const Expr &expr, EnvironmentPtr& env, Inst
     return _code;
 }
 
+Instr::Ptr ByteCodeCompiler::compileRef(const VarLoc& loc, Instr::Ptr cont, bool unbox) {
+    if (loc.boxed && unbox) {
+        cont = Instr::New<BoxOp>(Instr::Op::Unbox, std::move(cont));
+    }
+    return loc.kind == VarLoc::Kind::Local?
+        Instr::New<MemRef>(loc.index, std::move(cont)):
+        Instr::New<ClosureRef>(loc.index, std::move(cont));
+}
+
+Instr::Ptr ByteCodeCompiler::compileGlobal(Instr::Op op, const string& name, Instr::Ptr cont) {
+    return Instr::New<GlobalOp>(op, _opts.globals->intern(name), Symbol::intern(name), std::move(cont));
+}
+
+Instr::Ptr ByteCodeCompiler::compileSet(const VarLoc& loc, const Expr& expr, Instr::Ptr cont) {
+    if (!loc.boxed) {
+        // captured variables are either boxed or never assigned
+        return compile(expr, _env, Instr::New<MemSet>(loc.index, std::move(cont)));
+    }
+
+    ++_depth;
+    auto setc = compile(expr, _env,
+            Instr::New<BoxOp>(Instr::Op::SetBox, Instr::New<Pop>(std::move(cont))));
+    --_depth;
+    return compileRef(loc, Instr::New<Push>(std::move(setc)), false);
+}
+
 void ByteCodeCompiler::forNumber(const NumberE& num) {
-    _code = Instr::New<Imm>(num.value_, _cont); 
+    _code = Instr::New<Const>(_opts.pool, make_shared<Number>(num.value_), _cont);
 }
 
 void ByteCodeCompiler::forBoolean(const BooleanE& b) {
-    _code = Instr::New<Imm>(b.b_, _cont);
+    _code = Instr::New<Const>(_opts.pool, make_shared<Boolean>(b.b_), _cont);
 }
 
 void ByteCodeCompiler::forVar(const Var& var) {
-    _code = Instr::New<MemRef>(_env->find(var.v_), _cont);
+    if (auto loc = _env->lookup(var.v_)) {
+        _code = compileRef(*loc, _cont);
+    } else if (auto op = primOp(var.v_); op && !_opts.globals->lookup(var.v_)) {
+        // a primitive used as a value, wrapped in a closure of its (first two) operands
+        if (*op == Instr::Op::CallCC) {
+            auto body = Instr::New<Frame>(Instr::New<Ret>(1),
+                    Instr::New<MemRef>(-1, Instr::New<Call>(Instr::Op::CallCC, 0)));
+            _code = Instr::New<Closure>(std::move(body), 1, vector<CaptureSrc>{}, _cont);
+            return;
+        }
+        const int n = Instr::primArity(*op);
+        Instr::Ptr body = Instr::New<Prim>(*op, Instr::New<Pop>(n, Instr::New<Ret>(n)));
+        for (int i = -1; i >= -n; --i) {
+            body = Instr::New<MemRef>(i, Instr::New<Push>(std::move(body)));
+        }
+        _code = Instr::New<Closure>(std::move(body), n, vector<CaptureSrc>{}, _cont);
+    } else {
+        _code = compileGlobal(Instr::Op::GlobalRef, var.v_, _cont);
+    }
 }
 
-void ByteCodeCompiler::forQuote(const Quote&) {
-    // TODO
+void ByteCodeCompiler::forQuote(const Quote& quo) {
+    _code = Instr::New<Const>(_opts.pool, datumValue(*quo.datum_), _cont);
 }
 
-void ByteCodeCompiler::forDefine(const Define&) {
-    // TODO
+void ByteCodeCompiler::forDefine(const Define& def) {
+    if (_topLevel) {
+        _code = compile(*def.body_, _env, compileGlobal(Instr::Op::GlobalDef, def.name_.v_, _cont));
+    } else {
+        // local to the body it appears in
+        compileRecScope({{&def.name_.v_, def.body_.get()}});
+    }
 }
 
-void ByteCodeCompiler::forSetBang(const SetBang&) {
+void ByteCodeCompiler::forSetBang(const SetBang& setBang) {
+    if (auto loc = _env->lookup(setBang.v_.v_)) {
+        _code = compileSet(VarLoc(*loc), *setBang.e_, _cont);
+    } else {
+        _code = compile(*setBang.e_, _env, compileGlobal(Instr::Op::GlobalSet, setBang.v_.v_, _cont));
+    }
 }
 
-void ByteCodeCompiler::forBegin(const Begin&) {
+void ByteCodeCompiler::forBegin(const Begin& bgn) {
+    auto isDefine = [](const Expr::Ptr& e) { return e->getType() == Expr::Type::Define; };
+    if (!_topLevel && any_of(bgn.es_.begin(), bgn.es_.end(), isDefine)) {
+        // internal definitions, as in letrec*
+        vector<Step> steps;
+        for (const auto& e: bgn.es_) {
+            if (isDefine(e)) {
+                const auto& def = static_cast<const Define&>(*e);
+                steps.push_back({&def.name_.v_, def.body_.get()});
+            } else {
+                steps.push_back({nullptr, e.get()});
+            }
+        }
+        compileRecScope(steps);
+        return;
+    }
 
+    if (bgn.es_.empty()) {
+        _code = Instr::New<Const>(_opts.pool, Void::getInstance(), _cont);
+        return;
+    }
+    auto code = _cont;
+    for (auto rit = bgn.es_.rbegin(); rit != bgn.es_.rend(); ++rit) {
+        code = compile(**rit, _env, std::move(code));
+    }
+    _code = std::move(code);
 }
 
 void ByteCodeCompiler::forIf(const If& if_) {
@@ -54,66 +423,296 @@ void ByteCodeCompiler::forIf(const If& if_) {
     _code     = compile(*if_.pred_, _env, Instr::New<Branch>(std::move(thnc), std::move(elsc)));
 }
 
+// one target per clause, then the else clause. Pairs never match a key, they
+// are left out of the table
+void ByteCodeCompiler::forCase(const Case& cas) {
+    Switch::Keys keys;
+    vector<Instr::Ptr> targets;
+    for (const auto& [data, body]: cas.clauses_) {
+        for (const auto& dat: data) {
+            if (dat->type_ != Parser::Datum::Type::Pair) keys.emplace_back(datumValue(*dat), targets.size());
+        }
+        targets.push_back(compile(*body, _env, _cont));
+    }
+    targets.push_back(cas.else_? compile(*cas.else_, _env, _cont): Instr::New<Const>(_opts.pool, Void::getInstance(), _cont));
+    _code = compile(*cas.key_, _env, Instr::New<Switch>(std::move(keys), std::move(targets)));
+}
+
 void ByteCodeCompiler::forLet(const Let& let) {
     auto envEx = _env->extend(_env);
+    const bool topLevel = std::exchange(_topLevel, false);
 
+    const int base = _depth;
+    vector<bool> boxed;
     int i = 0;
     for (auto &[k, _]: let.binds_) {
-        envEx->bind(k.v_, _scopeLevel + i++);
+        boxed.push_back(BoxAnalysis::needsBox(k.v_, *let.body_));
+        envEx->bind(k.v_, VarLoc{VarLoc::Kind::Local, base + i, boxed.back()});
+        ++i;
     }
 
     const size_t nvar = let.binds_.size();
-    _scopeLevel += nvar;
+    _depth = base + nvar;
     auto bodyc = compile(*let.body_, envEx, Instr::New<Pop>(nvar, _cont));
-    _scopeLevel -= nvar;
 
     auto bindc = bodyc;
     i = let.binds_.size() - 1;
-    for (auto rit = let.binds_.rbegin(); rit != let.binds_.rend(); ++rit) {
+    for (auto rit = let.binds_.rbegin(); rit != let.binds_.rend(); ++rit, --i) {
         auto &[k, v] = *rit;
-        bindc = compile(*v, _env, Instr::New<Push>(bindc));
+        _depth = base + i;
+        bindc = Instr::New<Push>(bindc);
+        if (boxed[i]) bindc = Instr::New<BoxOp>(Instr::Op::MakeBox, bindc);
+        bindc = compile(*v, _env, bindc);
     }
+    _depth = base;
+    _topLevel = topLevel;
     _code = std::move(bindc);
 }
 
-void ByteCodeCompiler::forLetRec(const LetRec&) {}
+void ByteCodeCompiler::forLetRec(const LetRec& letrec) {
+    vector<Step> steps;
+    for (const auto& [k, v]: letrec.binds_) {
+        steps.push_back({&k.v_, v.get()});
+    }
+    steps.push_back({nullptr, letrec.body_.get()});
+    compileRecScope(steps);
+}
 
-void ByteCodeCompiler::forLambda(const Lambda& lam) {
+void ByteCodeCompiler::compileRecScope(const vector<Step>& steps) {
     auto envEx = _env->extend(_env);
+
+    // every slot is assigned once by its init. Closures created before that
+    // (the init itself included) must see the value through a box, later
+    // ones only if there are more assignments
+    const int base = _depth;
+    vector<bool> boxed;
+    for (size_t k = 0; k < steps.size(); ++k) {
+        const auto name = steps[k].name;
+        if (!name) continue;
+
+        bool early = false, assigned = false, captured = false;
+        for (size_t j = 0; j < steps.size(); ++j) {
+            auto uses = BoxAnalysis::usesOf(*name, *steps[j].expr);
+            early       |= j <= k && uses.captured;
+            assigned    |= uses.assigned;
+            captured    |= uses.captured;
+        }
+        boxed.push_back(early || (assigned && captured));
+        envEx->bind(*name, VarLoc{VarLoc::Kind::Local, base + static_cast<int>(boxed.size()) - 1, boxed.back()});
+    }
+
+    const size_t nvar = boxed.size();
+    auto oldEnv = std::exchange(_env, envEx);
+    const bool topLevel = std::exchange(_topLevel, false);
+    _depth = base + nvar;
+
+    Instr::Ptr code = Instr::New<Pop>(nvar, _cont);
+    for (auto rit = steps.rbegin(); rit != steps.rend(); ++rit) {
+        code = rit->name?
+            compileSet(VarLoc(envEx->find(*rit->name)), *rit->expr, std::move(code)):
+            compile(*rit->expr, _env, std::move(code));
+    }
+
+    // unassigned slots hold void
+    for (size_t i = nvar; i-- > 0; ) {
+        code = Instr::New<Push>(std::move(code));
+        if (boxed[i]) code = Instr::New<BoxOp>(Instr::Op::MakeBox, std::move(code));
+        code = Instr::New<Const>(_opts.pool, Void::getInstance(), std::move(code));
+    }
+
+    _env        = std::move(oldEnv);
+    _topLevel   = topLevel;
+    _depth      = base;
+    _code       = std::move(code);
+}
+
+void ByteCodeCompiler::forLambda(const Lambda& lam) {
+    // flat closure: free variables are copied into the closure when it is
+    // created, the body reaches them by index through ClosureRef
+    auto envLam = make_shared<Environment<VarLoc>>();
+    vector<CaptureSrc> caps;
+    for (auto fv: FreeVars::of(lam)) {
+        auto outer = _env->lookup(fv);
+        if (!outer) continue; // reported as undefined when referenced
+
+        caps.push_back(CaptureSrc{
+                outer->kind == VarLoc::Kind::Local? CaptureSrc::Kind::Local: CaptureSrc::Kind::Captured,
+                outer->index});
+        envLam->bind(fv, VarLoc{VarLoc::Kind::Captured, static_cast<int>(caps.size()) - 1, outer->boxed});
+    }
+
+    vector<int> boxedParams;
     int loc = -lam.arity();
     for (const auto& v: *lam.params_) {
-        envEx->bind(v.v_, loc++);
+        bool boxed = BoxAnalysis::needsBox(v.v_, *lam.body_);
+        if (boxed) boxedParams.push_back(loc);
+        envLam->bind(v.v_, VarLoc{VarLoc::Kind::Local, loc++, boxed});
+    }
+
+    Instr::Ptr code;
+    if (_opts.lazy) {
+        // the copy shares params and body with `lam`, keeping the names in envLam alive
+        // verified before the stub publishes it, the caller may be on the unchecked loop
+        code = Instr::New<Stub>([lam = Lambda(lam), envLam, boxedParams, opts = _opts, ncaps = caps.size()]() {
+            auto body = compileBody(lam, envLam, boxedParams, opts);
+            string err;
+            if (!Verifier::verifyBody(*body, static_cast<int>(lam.arity()), ncaps, &err)) {
+                throw runtime_error("bytecode verification failed: " + err);
+            }
+            return body;
+        });
+    } else {
+        code = compileBody(lam, envLam, boxedParams, _opts);
+    }
+    _code = Instr::New<Closure>(std::move(code), static_cast<int>(lam.arity()), std::move(caps), _cont);
+}
+
+Instr::Ptr ByteCodeCompiler::compileBody(const Lambda& lam, EnvironmentPtr env, const vector<int>& boxedParams,
+        const Options& opts) {
+    s_compiledLambdas.fetch_add(1, memory_order_relaxed);
+
+    ByteCodeCompiler compiler;
+    compiler._opts = opts;
+    auto bodyc = compiler.compile(*lam.body_, env, Instr::New<Ret>(lam.params_->size()));
+
+    for (auto off: boxedParams) {
+        bodyc = Instr::New<MemRef>(off, Instr::New<BoxOp>(Instr::Op::MakeBox, Instr::New<MemSet>(off, bodyc)));
     }
-    auto bodyc = compile(*lam.body_, envEx, Instr::New<Ret>(lam.params_->size()));
-    _code      = Instr::New<Closure>(bodyc, _cont);
+    return opts.finish? opts.finish(std::move(bodyc)): bodyc;
+}
+
+optional<Instr::Op> ByteCodeCompiler::primOf(const Expr& rator) {
+    if (rator.getType() != Expr::Type::Var) return nullopt;
+    const auto& name = static_cast<const Var&>(rator).v_;
+    // unless the name is bound to something else
+    if (_env->lookup(name) || _opts.globals->lookup(name)) return nullopt;
+    return primOp(name);
+}
+
+void ByteCodeCompiler::compileLoop(const Apply& app, const Lambda& lam) {
+    auto envEx = _env->extend(_env);
+    const bool topLevel = std::exchange(_topLevel, false);
+
+    const int base = _depth;
+    const int nvar = lam.arity();
+    LoopCtx loop{base, {}, nullptr, {}};
+    envEx->bind(LoopAnalysis::nameOf(app), VarLoc{VarLoc::Kind::Loop, static_cast<int>(_loops.size())});
+    for (int i = 0; i < nvar; ++i) {
+        const auto& v = (*lam.params_)[i].v_;
+        loop.boxed.push_back(BoxAnalysis::needsBox(v, *lam.body_));
+        envEx->bind(v, VarLoc{VarLoc::Kind::Local, base + i, loop.boxed.back()});
+    }
+
+    auto exit = Instr::New<Pop>(nvar, _cont);
+    loop.exit = exit.get();
+    _loops.push_back(&loop);
+    _depth = base + nvar;
+    auto head = Instr::New<Loop>(compile(*lam.body_, envEx, std::move(exit)));
+    _loops.pop_back();
+    for (auto jump: loop.jumps) jump->setLoop(static_cast<const Loop*>(head.get()));
+
+    // the initial values are bound as in let
+    Instr::Ptr code = std::move(head);
+    for (int i = nvar - 1; i >= 0; --i) {
+        _depth  = base + i;
+        code    = Instr::New<Push>(std::move(code));
+        if (loop.boxed[i]) code = Instr::New<BoxOp>(Instr::Op::MakeBox, std::move(code));
+        code    = compile(*app.operands_[i], _env, std::move(code));
+    }
+    _depth      = base;
+    _topLevel   = topLevel;
+    _code       = std::move(code);
+}
+
+void ByteCodeCompiler::compileJump(LoopCtx& loop, const Apply& app) {
+    // in tail position only the slots of lets inside the loop body are left
+    // between here and the exit of the loop, the jump pops them as well
+    int pop = app.operands_.size();
+    for (auto cont = _cont.get(); cont != loop.exit; ) {
+        if (cont->getOpCode() != Instr::Op::Pop) throw std::logic_error("internal error, loop call not in tail position");
+        pop     += static_cast<const Pop&>(*cont).getNum();
+        cont    = static_cast<const Pop&>(*cont).getNext().get();
+    }
+
+    const int base = _depth;
+    auto jump = Instr::New<Jump>(loop.slot, static_cast<int>(app.operands_.size()), pop);
+    loop.jumps.push_back(static_cast<Jump*>(jump.get()));
+
+    // a fresh box per iteration, as a call would make
+    Instr::Ptr code = std::move(jump);
+    for (int i = app.operands_.size() - 1; i >= 0; --i) {
+        _depth  = base + i;
+        code    = Instr::New<Push>(std::move(code));
+        if (loop.boxed[i]) code = Instr::New<BoxOp>(Instr::Op::MakeBox, std::move(code));
+        code    = compile(*app.operands_[i], _env, std::move(code));
+    }
+    _depth  = base;
+    _code   = std::move(code);
 }
 
 void ByteCodeCompiler::forApply(const Apply& app) {
-    // eval args from left to right, then eval operator at last 
-    auto compilePrim = [&](const auto& expr) -> Instr::Ptr {
-        if (expr->getType() != Expr::Type::Var) return nullptr;
-        const auto& var = static_cast<const Var&>(*expr);
-        auto cont       = Instr::New<Pop>(2, _cont); // the primitives are binary ops
-        const auto& op  = var.v_;
-        return op == "+"?  Instr::New<Prim>(Instr::Op::ADD, cont):
-               op == "-"?  Instr::New<Prim>(Instr::Op::SUB, cont):
-               op == "*"?  Instr::New<Prim>(Instr::Op::MUL, cont):
-               op == "/"?  Instr::New<Prim>(Instr::Op::DIV, cont):
-               op == "%"?  Instr::New<Prim>(Instr::Op::MOD, cont):
-               op == "<"?  Instr::New<Prim>(Instr::Op::LT,  cont):
-               op == "<="? Instr::New<Prim>(Instr::Op::LE,  cont):
-               op == "=="? Instr::New<Prim>(Instr::Op::EQ,  cont):
-               op == ">"?  Instr::New<Prim>(Instr::Op::GT,  cont):
-               op == ">="? Instr::New<Prim>(Instr::Op::GE,  cont):
-               op == "!="? Instr::New<Prim>(Instr::Op::NEQ, cont): nullptr;
-    };
-
-    auto primInstr  = compilePrim(app.operator_);
-    auto nxt        = primInstr? primInstr: compile(*app.operator_, _env, Instr::New<Call>());
-    for (auto rit = app.operands_.rbegin(); rit != app.operands_.rend(); ++rit) {
+    using Op = Instr::Op;
+    const int base  = _depth;
+    const int nargs = app.operands_.size();
+
+    if (auto lam = LoopAnalysis::loopOf(app, _loopOf)) {
+        compileLoop(app, *lam);
+        return;
+    }
+    if (app.operator_->getType() == Expr::Type::Var) {
+        auto loc = _env->lookup(static_cast<const Var&>(*app.operator_).v_);
+        if (loc && loc->kind == VarLoc::Kind::Loop) {
+            compileJump(*_loops[loc->index], app);
+            return;
+        }
+    }
+
+    if (auto op = primOf(*app.operator_); op == Op::CallCC) {
+        // nothing pushed, the continuation of the frame becomes the argument
+        if (nargs != 1) {
+            throw std::length_error(fmt::format("{} expect 1 args, but got {}", static_cast<const Var&>(*app.operator_).v_, nargs));
+        }
+        _code = Instr::New<Frame>(_cont, compile(*app.operands_[0], _env, Instr::New<Call>(Op::CallCC, 0)));
+        return;
+    } else if (op) {
+        // inline, the arithmetic ones fold more operands from the left
+        const int arity     = Instr::primArity(*op);
+        const bool variadic = *op == Op::ADD || *op == Op::SUB || *op == Op::MUL || *op == Op::DIV;
+        if (variadic? nargs < arity: nargs != arity) {
+            throw std::length_error(fmt::format("{} expect {} args, but got {}",
+                        static_cast<const Var&>(*app.operator_).v_, arity, nargs));
+        }
+
+        if (arity == 0) {
+            _code = Instr::New<Prim>(*op, _cont);
+            return;
+        }
+        Instr::Ptr nxt = _cont;
+        for (int i = nargs - 1; i >= arity - 1; --i) {
+            nxt     = Instr::New<Prim>(*op, Instr::New<Pop>(arity, std::move(nxt)));
+            _depth  = base + arity - 1;
+            nxt     = compile(*app.operands_[i], _env, Instr::New<Push>(std::move(nxt)));
+            if (i > arity - 1) nxt = Instr::New<Push>(std::move(nxt)); // the result so far
+        }
+        for (int i = arity - 2; i >= 0; --i) {
+            _depth  = base + i;
+            nxt     = compile(*app.operands_[i], _env, Instr::New<Push>(std::move(nxt)));
+        }
+        _depth  = base;
+        _code   = std::move(nxt);
+        return;
+    }
+
+    // eval args from left to right, then eval operator at last
+    _depth      = base + nargs;
+    auto nxt    = compile(*app.operator_, _env, Instr::New<Call>(nargs));
+    int i = nargs - 1;
+    for (auto rit = app.operands_.rbegin(); rit != app.operands_.rend(); ++rit, --i) {
+        _depth = base + i;
         nxt = compile(**rit, _env, Instr::New<Push>(std::move(nxt)));
     }
+    _depth = base;
 
-    if (!primInstr) _code = Instr::New<Frame>(_cont, std::move(nxt));
+    _code = Instr::New<Frame>(_cont, std::move(nxt));
 }
 
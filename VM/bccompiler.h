@@ -3,11 +3,37 @@
 #include "ast.h"
 #include "bytecode.h"
 #include "environment.h"
+#include "globals.h"
+
+#include <atomic>
+#include <functional>
+#include <optional>
+#include <unordered_map>
 
 class ByteCodeCompiler: VisitorE {
 public:
+    struct Options {
+        bool lazy{true}; // lambda bodies are compiled on their first call
+        std::function<Instr::Ptr(Instr::Ptr)> finish; // run on every compiled body, e.g. the optimizer
+        ConstPool::Ptr pool; // shared by every expression of a program, a new one if null
+        GlobalTable::Ptr globals; // likewise, keeps definitions across Compile calls
+    };
+
+    // where a variable lives, seen from the frame being compiled
+    struct VarLoc {
+        enum class Kind { Local, Captured, Loop } kind;
+        int     index; // Local: offset from bp, Captured: slot of the running closure, Loop: see _loops
+        bool    boxed{false}; // assigned and captured, the slot holds a VM::Box
+    };
+
     ByteCodeCompiler(Instr::Ptr cont = Instr::New<Halt>()): _cont(std::move(cont)) {}
     static Instr::Ptr Compile(Expr& expr);
+    static Instr::Ptr Compile(Expr& expr, Options opts);
+
+    static std::optional<Instr::Op> primOp(std::string_view name);
+
+    // lambda bodies compiled so far, lazily or not
+    static size_t compiledLambdas() { return s_compiledLambdas.load(std::memory_order_relaxed); }
 private:
     virtual void forNumber(const NumberE&) override;
     virtual void forBoolean(const BooleanE&) override;
@@ -21,14 +47,43 @@ private:
 	virtual void forLetRec(const LetRec&) override;
     virtual void forLambda(const Lambda&) override;
     virtual void forApply(const Apply&) override;
+    virtual void forCase(const Case&) override;
+
+    using EnvironmentPtr = Environment<VarLoc>::Ptr;
 
-    using EnvironmentPtr = Environment<int>::Ptr;
-    
     Instr::Ptr compile(const Expr& expr, EnvironmentPtr& env, Instr::Ptr cont);
+    Instr::Ptr compileRef(const VarLoc& loc, Instr::Ptr cont, bool unbox = true);
+    Instr::Ptr compileGlobal(Instr::Op op, const std::string& name, Instr::Ptr cont);
+    Instr::Ptr compileSet(const VarLoc& loc, const Expr& expr, Instr::Ptr cont);
+    std::optional<Instr::Op> primOf(const Expr& rator);
+
+    // a letrec* scope: `name` is bound in every step, nullptr for an expression
+    // that only runs for its effect. The last step gives the result
+    struct Step { const std::string* name; const Expr* expr; };
+    void compileRecScope(const std::vector<Step>& steps);
+    static Instr::Ptr compileBody(const Lambda& lam, EnvironmentPtr env, const std::vector<int>& boxedParams,
+            const Options& opts);
+
+    // a named let whose name is only called in tail position: the variables
+    // live in let slots, the calls update them in place and jump back
+    struct LoopCtx {
+        int                 slot; // of the first variable
+        std::vector<bool>   boxed;
+        const Instr*        exit; // the continuation of the whole loop
+        std::vector<Jump*>  jumps; // back edges, pointed at the loop once it is built
+    };
+    void compileLoop(const Apply& app, const Lambda& lam);
+    void compileJump(LoopCtx& loop, const Apply& app);
 
     Instr::Ptr              _code;
     Instr::Ptr              _cont;
     EnvironmentPtr          _env;
-    size_t                  _scopeLevel{0};
+    int                     _depth{0}; // stack slots above bp in use at the current point
+    bool                    _topLevel{false}; // not inside a let or lambda, define makes globals
+    std::vector<LoopCtx*>   _loops; // enclosing loops of the body being compiled
+    std::unordered_map<const Apply*, const Lambda*> _loopOf; // see LoopAnalysis::loopOf
+    Options                 _opts;
+
+    static std::atomic<size_t> s_compiledLambdas;
 };
 
@@ -16,24 +16,35 @@ void InstrDumper::dump(Instr& instr) {
     }
 }
 
+void InstrDumper::writeConst(const Value& val) {
+    switch (val.getType()) {
+        case Value::Type::Number:   _os << static_cast<const Number&>(val).value_; break;
+        case Value::Type::Boolean:  _os << (static_cast<const Boolean&>(val).value_? "#t": "#f"); break;
+        case Value::Type::Symbol:   _os << *static_cast<const Symbol&>(val).ptr_; break;
+        case Value::Type::Nil:      _os << "()"; break;
+        case Value::Type::Cons: {
+            const auto& cons = static_cast<const Cons&>(val);
+            _os << "(";
+            writeConst(*cons.car_);
+            _os << " . ";
+            writeConst(*cons.cdr_);
+            _os << ")";
+            break;
+        }
+        default:                    _os << typeStr(val.getType());
+    }
+}
+
 void InstrDumper::forHalt(const Halt& instr) {
     dumpInstrAddr(&instr);
     _os << "halt" << endl;
     _next = nullptr;
 }
 
-void InstrDumper::forImm(const Imm& instr) {
+void InstrDumper::forConst(const Const& instr) {
     dumpInstrAddr(&instr);
-    _os << "imm " ;
-    const auto& val = *instr.getVal();
-    auto vty        = val.getType();
-    if (vty == Value::Type::Number) {
-        _os << static_cast<const Number&>(val).value_;
-    } else if (vty == Value::Type::Boolean) {
-        _os << static_cast<const Boolean&>(val).value_;
-    } else {
-        _os << "n/a";
-    }
+    _os << "const #" << instr.getIndex() << " ";
+    writeConst(*instr.getVal());
     _os << endl;
 
     _next = instr.getNext().get();
@@ -52,8 +63,9 @@ void InstrDumper::forMemRef(const MemRef& instr) {
 }
 
 void InstrDumper::forMemSet(const MemSet& instr) {
-    //dumpInstrAddr(&instr);
-    //_os << "mset" << 
+    dumpInstrAddr(&instr);
+    _os << "mset " << instr.getOffSet() << endl;
+    _next = instr.getNext().get();
 }
 
 void InstrDumper::forBranch(const Branch& instr) {
@@ -80,7 +92,11 @@ void InstrDumper::forPop(const Pop& instr) {
 
 void InstrDumper::forClosure(const Closure& instr) {
     dumpInstrAddr(&instr);
-    _os << "closure " << instr.getCode().get() << endl;
+    _os << "closure/" << instr.getArity() << " " << instr.getCode().get();
+    for (const auto& cap: instr.getCaptures()) {
+        _os << (cap.kind == CaptureSrc::Kind::Local? " m": " c") << cap.index;
+    }
+    _os << endl;
     _worklist.push(instr.getCode().get());
     _next = instr.getNext().get();
 }
@@ -94,7 +110,8 @@ void InstrDumper::forFrame(const Frame& instr) {
 
 void InstrDumper::forCall(const Call& instr) {
     dumpInstrAddr(&instr);
-    _os << "call" << endl;
+    if (instr.getOpCode() == Instr::Op::CallCC) _os << "callcc" << endl;
+    else _os << "call " << instr.getArgc() << endl;
     _next = nullptr;
 }
 
@@ -103,3 +120,60 @@ void InstrDumper::forRet(const Ret& instr) {
     _os << "ret " << instr.getPop() << endl;
     _next = nullptr;
 }
+
+void InstrDumper::forClosureRef(const ClosureRef& instr) {
+    dumpInstrAddr(&instr);
+    _os << "cref " << instr.getIndex() << endl;
+    _next = instr.getNext().get();
+}
+
+void InstrDumper::forStub(const Stub& instr) {
+    dumpInstrAddr(&instr);
+    if (instr.isCompiled()) {
+        _os << "stub " << instr.getBody().get() << endl;
+        _worklist.push(instr.getBody().get());
+    } else {
+        _os << "stub (not compiled)" << endl;
+    }
+    _next = nullptr;
+}
+
+void InstrDumper::forBoxOp(const BoxOp& instr) {
+    dumpInstrAddr(&instr);
+    _os << Instr::to_string(instr.getOpCode()) << endl;
+    _next = instr.getNext().get();
+}
+
+void InstrDumper::forGlobalOp(const GlobalOp& instr) {
+    dumpInstrAddr(&instr);
+    _os << Instr::to_string(instr.getOpCode()) << " " << instr.getName() << " #" << instr.getIndex() << endl;
+    _next = instr.getNext().get();
+}
+
+void InstrDumper::forLoop(const Loop& instr) {
+    dumpInstrAddr(&instr);
+    _os << "loop" << endl;
+    _next = instr.getNext().get();
+}
+
+void InstrDumper::forJump(const Jump& instr) {
+    dumpInstrAddr(&instr);
+    _os << "jump " << instr.getLoop() << " m" << instr.getSlot() << "/" << instr.getArgc();
+    if (instr.getPop() > instr.getArgc()) _os << " pop " << instr.getPop();
+    _os << endl;
+    _next = nullptr;
+}
+
+void InstrDumper::forSwitch(const Switch& instr) {
+    dumpInstrAddr(&instr);
+    const auto& targets = instr.getTargets();
+    _os << "switch";
+    for (const auto& [key, target]: instr.getKeys()) {
+        _os << " ";
+        writeConst(*key);
+        _os << ":" << targets[target].get();
+    }
+    _os << " else:" << targets.back().get() << endl;
+    _next = targets.front().get();
+    for (size_t i = 1; i < targets.size(); ++i) _worklist.push(targets[i].get());
+}
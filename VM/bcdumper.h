@@ -1,20 +1,24 @@
 #pragma once
 
 #include "bytecode.h"
+#include "profile.h"
 #include "value.h"
 
+#include "fmt/format.h"
+
 #include <ostream>
 #include <queue>
 
 
 class InstrDumper: public InstrVisitor {
 public:
-    InstrDumper(std::ostream& os): _os(os) {}
+    // with a profile, every instruction is prefixed by its execution count
+    InstrDumper(std::ostream& os, const OpProfile* profile = nullptr): _os(os), _profile(profile) {}
 
     void dump(Instr& instr);
 protected:
     virtual void forHalt(const Halt&) override;
-    virtual void forImm(const Imm&) override;
+    virtual void forConst(const Const&) override;
     virtual void forPrim(const Prim&) override;
     virtual void forMemRef(const MemRef&) override;
     virtual void forMemSet(const MemSet&) override;
@@ -25,14 +29,25 @@ protected:
     virtual void forFrame(const Frame&) override;
     virtual void forCall(const Call&) override;
     virtual void forRet(const Ret&) override;
+    virtual void forClosureRef(const ClosureRef&) override;
+    virtual void forBoxOp(const BoxOp&) override;
+    virtual void forStub(const Stub&) override;
+    virtual void forGlobalOp(const GlobalOp&) override;
+    virtual void forLoop(const Loop&) override;
+    virtual void forJump(const Jump&) override;
+    virtual void forSwitch(const Switch&) override;
 
 private:
     void dumpInstrAddr(const Instr* instr) {
+        if (_profile) _os << fmt::format("{:>12}  ", _profile->countOf(instr));
         _os << instr << ":\t";
     }
 
+    void writeConst(const Value& val);
+
 
     std::ostream&                   _os;
+    const OpProfile*                _profile;
     std::queue<Instr*>              _worklist;
     Instr*                          _next;
     //std::unordered_set<Instr*>      _mark;
@@ -0,0 +1,511 @@
+#include "bcfile.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace ByteCode {
+
+using namespace std;
+
+uint64_t hashSource(string_view src, uint64_t seed) {
+    // FNV-1a, salted with the format version so old images never match
+    uint64_t h = (0xcbf29ce484222325ull ^ Version) + seed * 0x9e3779b97f4a7c15ull;
+    for (unsigned char c: src) {
+        h ^= c;
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+bool ImageWriter::write(const string& path, const Entries& entries, uint64_t srcHash, string_view src) {
+    ImageWriter w;
+    vector<uint32_t> entryIdx;
+    for (const auto& e: entries) {
+        entryIdx.push_back(w.emit(e.get()));
+    }
+
+    auto align8 = [](uint32_t n) { return (n + 7) & ~7u; };
+
+    FileHeader hdr{};
+    memcpy(hdr.magic, Magic, sizeof(Magic));
+    hdr.version     = Version;
+    hdr.sourceHash  = srcHash;
+    hdr.nentries    = entryIdx.size();
+    hdr.entryOff    = sizeof(FileHeader);
+    hdr.ninstrs     = w._instrs.size();
+    hdr.instrOff    = align8(hdr.entryOff + hdr.nentries * sizeof(uint32_t));
+    hdr.nconsts     = w._consts.size();
+    hdr.constOff    = hdr.instrOff + hdr.ninstrs * sizeof(InstrRecord);
+    hdr.nsyms       = w._syms.size();
+    hdr.symOff      = hdr.constOff + hdr.nconsts * sizeof(ConstRecord);
+    hdr.strSize     = w._strs.size();
+    hdr.strOff      = hdr.symOff + hdr.nsyms * sizeof(SymRecord);
+    hdr.ncaps       = w._caps.size();
+    hdr.capOff      = align8(hdr.strOff + hdr.strSize);
+    hdr.srcSize     = src.size();
+    hdr.srcOff      = hdr.capOff + hdr.ncaps * sizeof(CaptureRecord);
+    if (hdr.srcSize != src.size()) return false; // past 4GB
+
+    // write to a temporary and rename, readers never see a partial image
+    auto tmp = path + ".tmp" + to_string(getpid());
+    {
+        ofstream ofs(tmp, ios::binary | ios::trunc);
+        if (!ofs) return false;
+
+        const char zeros[8] = {};
+        ofs.write(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+        ofs.write(reinterpret_cast<const char*>(entryIdx.data()), entryIdx.size() * sizeof(uint32_t));
+        ofs.write(zeros, hdr.instrOff - (hdr.entryOff + hdr.nentries * sizeof(uint32_t)));
+        ofs.write(reinterpret_cast<const char*>(w._instrs.data()), w._instrs.size() * sizeof(InstrRecord));
+        ofs.write(reinterpret_cast<const char*>(w._consts.data()), w._consts.size() * sizeof(ConstRecord));
+        ofs.write(reinterpret_cast<const char*>(w._syms.data()), w._syms.size() * sizeof(SymRecord));
+        ofs.write(w._strs.data(), w._strs.size());
+        ofs.write(zeros, hdr.capOff - (hdr.strOff + hdr.strSize));
+        ofs.write(reinterpret_cast<const char*>(w._caps.data()), w._caps.size() * sizeof(CaptureRecord));
+        ofs.write(src.data(), src.size());
+        if (!ofs) {
+            unlink(tmp.c_str());
+            return false;
+        }
+    }
+    return rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+int32_t ImageWriter::emit(const Instr* root) {
+    // iterative post order: successors get their index before the instruction
+    // referring to them, so the loader never has to patch a forward reference
+    vector<pair<const Instr*, bool>> stack{{root, false}};
+    while (!stack.empty()) {
+        auto& [instr, expanded] = stack.back();
+        if (_index.count(instr)) {
+            stack.pop_back();
+            continue;
+        }
+        if (!expanded) {
+            expanded = true;
+            auto cur = instr;
+            // images hold whole programs, bodies not called yet are compiled now
+            if (cur->getOpCode() == Instr::Op::Stub) static_cast<const Stub&>(*cur).getBody();
+            // the loop of a jump is below it on the stack, not a successor to write first
+            if (cur->getOpCode() == Instr::Op::Jump) continue;
+            for (auto succ: successorsOf(*cur)) {
+                if (!_index.count(succ)) stack.emplace_back(succ, false);
+            }
+        } else {
+            auto cur = instr;
+            stack.pop_back();
+            _rec = InstrRecord{};
+            _rec.op = static_cast<uint8_t>(Instr::generic(cur->getOpCode()));
+            const_cast<Instr*>(cur)->accept(*this);
+            _index.emplace(cur, _instrs.size());
+            _instrs.push_back(_rec);
+        }
+    }
+    for (auto [rec, loop]: _jumps) {
+        _instrs[rec].a = _index.at(loop);
+    }
+    _jumps.clear();
+    return _index.at(root);
+}
+
+int32_t ImageWriter::constIndex(const Value& val) {
+    ConstRecord rec{};
+    switch (val.getType()) {
+        case Value::Type::Number: {
+            rec.tag     = ConstRecord::Number;
+            rec.value   = static_cast<const Number&>(val).value_;
+            break;
+        }
+        case Value::Type::Boolean: {
+            rec.tag     = ConstRecord::Boolean;
+            rec.value   = static_cast<const Boolean&>(val).value_;
+            break;
+        }
+        case Value::Type::Symbol: {
+            rec.tag     = ConstRecord::Symbol;
+            rec.value   = symIndex(*static_cast<const Symbol&>(val).ptr_);
+            break;
+        }
+        case Value::Type::Void: {
+            rec.tag     = ConstRecord::Void;
+            break;
+        }
+        case Value::Type::Nil: {
+            rec.tag     = ConstRecord::Nil;
+            break;
+        }
+        case Value::Type::Cons: {
+            // parts first, equal structure then ends up with equal records
+            const auto& cons = static_cast<const Cons&>(val);
+            int64_t car = constIndex(*cons.car_);
+            int64_t cdr = constIndex(*cons.cdr_);
+            rec.tag     = ConstRecord::Pair;
+            rec.value   = car | cdr << 32;
+            break;
+        }
+        default:
+            throw runtime_error(fmt::format("can not serialize a {} constant", typeStr(val.getType())));
+    }
+
+    auto [it, added] = _constIndex.emplace(make_pair(rec.tag, rec.value), _consts.size());
+    if (added) _consts.push_back(rec);
+    return it->second;
+}
+
+uint32_t ImageWriter::symIndex(const string& sym) {
+    auto it = _symIndex.find(sym);
+    if (it != _symIndex.end()) return it->second;
+
+    _syms.push_back(SymRecord{static_cast<uint32_t>(_strs.size()), static_cast<uint32_t>(sym.size())});
+    _strs += sym;
+    _symIndex.emplace(sym, _syms.size() - 1);
+    return _syms.size() - 1;
+}
+
+void ImageWriter::forHalt(const Halt&) {}
+
+void ImageWriter::forConst(const Const& instr) {
+    _rec.a = constIndex(*instr.getVal());
+    _rec.b = _index.at(instr.getNext().get());
+}
+
+void ImageWriter::forPrim(const Prim& instr) {
+    _rec.a = _index.at(instr.getNext().get());
+}
+
+void ImageWriter::forMemRef(const MemRef& instr) {
+    _rec.a = instr.getOffSet();
+    _rec.b = _index.at(instr.getNext().get());
+}
+
+void ImageWriter::forMemSet(const MemSet& instr) {
+    _rec.a = instr.getOffSet();
+    _rec.b = _index.at(instr.getNext().get());
+}
+
+void ImageWriter::forBranch(const Branch& instr) {
+    _rec.a = _index.at(instr.getTrue().get());
+    _rec.b = _index.at(instr.getFalse().get());
+}
+
+void ImageWriter::forPush(const Push& instr) {
+    _rec.a = _index.at(instr.getNext().get());
+}
+
+void ImageWriter::forPop(const Pop& instr) {
+    _rec.a = instr.getNum();
+    _rec.b = _index.at(instr.getNext().get());
+}
+
+void ImageWriter::forClosure(const Closure& instr) {
+    _rec.a = _index.at(instr.getCode().get());
+    _rec.b = _index.at(instr.getNext().get());
+    _rec.c = _caps.size();
+
+    const auto& caps = instr.getCaptures();
+    _caps.push_back(CaptureRecord{0, {}, instr.getArity()});
+    _caps.push_back(CaptureRecord{0, {}, static_cast<int32_t>(caps.size())});
+    for (const auto& cap: caps) {
+        _caps.push_back(CaptureRecord{static_cast<uint8_t>(cap.kind), {}, cap.index});
+    }
+}
+
+void ImageWriter::forFrame(const Frame& instr) {
+    _rec.a = _index.at(instr.getRet().get());
+    _rec.b = _index.at(instr.getNext().get());
+}
+
+void ImageWriter::forCall(const Call& instr) {
+    _rec.a = instr.getArgc();
+}
+
+void ImageWriter::forRet(const Ret& instr) {
+    _rec.a = instr.getPop();
+}
+
+void ImageWriter::forClosureRef(const ClosureRef& instr) {
+    _rec.a = instr.getIndex();
+    _rec.b = _index.at(instr.getNext().get());
+}
+
+void ImageWriter::forBoxOp(const BoxOp& instr) {
+    _rec.a = _index.at(instr.getNext().get());
+}
+
+void ImageWriter::forStub(const Stub& instr) {
+    _rec.a = _index.at(instr.getBody().get());
+}
+
+void ImageWriter::forLoop(const Loop& instr) {
+    _rec.a = _index.at(instr.getNext().get());
+}
+
+void ImageWriter::forJump(const Jump& instr) {
+    _jumps.emplace_back(_instrs.size(), instr.getLoop());
+    // both share c, 16 bits each
+    if (instr.getArgc() < 0 || instr.getArgc() > 0xffff || instr.getPop() < 0 || instr.getPop() > 0xffff) {
+        throw runtime_error(fmt::format("can not serialize a jump of {} args popping {}", instr.getArgc(), instr.getPop()));
+    }
+    _rec.b = instr.getSlot();
+    _rec.c = instr.getArgc() | instr.getPop() << 16;
+}
+
+void ImageWriter::forSwitch(const Switch& instr) {
+    _rec.a = _caps.size();
+    _rec.b = instr.getTargets().size();
+    _rec.c = instr.getKeys().size();
+    for (const auto& t: instr.getTargets()) _caps.push_back(CaptureRecord{0, {}, _index.at(t.get())});
+    for (const auto& [key, target]: instr.getKeys()) {
+        _caps.push_back(CaptureRecord{0, {}, constIndex(*key)});
+        _caps.push_back(CaptureRecord{0, {}, static_cast<int32_t>(target)});
+    }
+}
+
+// by name, the slot is numbered again when loading
+void ImageWriter::forGlobalOp(const GlobalOp& instr) {
+    _rec.a = symIndex(instr.getName());
+    _rec.b = _index.at(instr.getNext().get());
+}
+
+
+namespace {
+
+class MappedFile {
+public:
+    explicit MappedFile(const string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                _data = static_cast<const char*>(p);
+                _size = st.st_size;
+            }
+        }
+        close(fd);
+    }
+    ~MappedFile() { if (_data) munmap(const_cast<char*>(_data), _size); }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return _data; }
+    size_t size() const { return _size; }
+
+private:
+    const char*     _data{nullptr};
+    size_t          _size{0};
+};
+
+} // namespace
+
+optional<Entries> ImageLoader::load(const string& path, uint64_t expectHash, GlobalTable::Ptr globals,
+        string_view expectSrc) {
+    MappedFile file(path);
+    if (!file.data() || file.size() < sizeof(FileHeader)) return nullopt;
+
+    const auto& hdr = *reinterpret_cast<const FileHeader*>(file.data());
+    if (memcmp(hdr.magic, Magic, sizeof(Magic)) != 0 || hdr.version != Version) return nullopt;
+    if (expectHash && hdr.sourceHash != expectHash) return nullopt;
+
+    auto inFile = [&](uint64_t off, uint64_t n, size_t elemSize) {
+        return off % alignof(uint32_t) == 0 && off + n * elemSize <= file.size();
+    };
+    if (!inFile(hdr.entryOff, hdr.nentries, sizeof(uint32_t)) ||
+        !inFile(hdr.instrOff, hdr.ninstrs, sizeof(InstrRecord)) ||
+        !inFile(hdr.constOff, hdr.nconsts, sizeof(ConstRecord)) ||
+        !inFile(hdr.symOff, hdr.nsyms, sizeof(SymRecord)) ||
+        !inFile(hdr.capOff, hdr.ncaps, sizeof(CaptureRecord)) ||
+        hdr.strOff + uint64_t(hdr.strSize) > file.size() ||
+        hdr.srcOff + uint64_t(hdr.srcSize) > file.size()) {
+        return nullopt;
+    }
+    // another source with the same hash
+    if (expectHash && string_view(file.data() + hdr.srcOff, hdr.srcSize) != expectSrc) return nullopt;
+
+    auto entries    = reinterpret_cast<const uint32_t*>(file.data() + hdr.entryOff);
+    auto instrs     = reinterpret_cast<const InstrRecord*>(file.data() + hdr.instrOff);
+    auto consts     = reinterpret_cast<const ConstRecord*>(file.data() + hdr.constOff);
+    auto syms       = reinterpret_cast<const SymRecord*>(file.data() + hdr.symOff);
+    auto strs       = file.data() + hdr.strOff;
+    auto caps       = reinterpret_cast<const CaptureRecord*>(file.data() + hdr.capOff);
+
+    auto symAt = [&](int64_t idx) -> optional<string> {
+        if (idx < 0 || idx >= hdr.nsyms) return nullopt;
+        const auto& s = syms[idx];
+        if (uint64_t(s.offset) + s.len > hdr.strSize) return nullopt;
+        return string(strs + s.offset, s.len);
+    };
+
+    if (!globals) globals = make_shared<GlobalTable>();
+    auto pool = make_shared<ConstPool>();
+    vector<Value::Ptr> constVals;
+    constVals.reserve(hdr.nconsts);
+    for (uint32_t i = 0; i < hdr.nconsts; ++i) {
+        const auto& c = consts[i];
+        switch (c.tag) {
+            case ConstRecord::Nil:      constVals.push_back(Nil::getInstance()); break;
+            case ConstRecord::Pair: {
+                const auto car = c.value & 0xffffffff, cdr = c.value >> 32;
+                if (car >= i || cdr >= i) return nullopt;
+                constVals.push_back(make_shared<Cons>(constVals[car], constVals[cdr]));
+                break;
+            }
+            case ConstRecord::Number:   constVals.push_back(make_shared<Number>(c.value)); break;
+            case ConstRecord::Boolean:  constVals.push_back(make_shared<Boolean>(c.value != 0)); break;
+            case ConstRecord::Void:     constVals.push_back(Void::getInstance()); break;
+            case ConstRecord::Symbol: {
+                auto sym = symAt(c.value);
+                if (!sym) return nullopt;
+                constVals.push_back(make_shared<Symbol>(*sym));
+                break;
+            }
+            default: return nullopt;
+        }
+    }
+
+    // successors always precede their users, any other reference is corrupt.
+    // Jumps are the exception, they get their loop once it is built
+    vector<Instr::Ptr> nodes(hdr.ninstrs);
+    vector<pair<Jump*, int32_t>> jumps;
+    for (uint32_t i = 0; i < hdr.ninstrs; ++i) {
+        const auto& r = instrs[i];
+        auto ref = [&](int32_t idx) -> Instr::Ptr {
+            if (idx < 0 || uint32_t(idx) >= i) throw out_of_range("bad instruction reference");
+            return nodes[idx];
+        };
+
+        using Op = Instr::Op;
+        try {
+            switch (auto op = static_cast<Op>(r.op)) {
+                case Op::Halt:      nodes[i] = Instr::New<Halt>(); break;
+                case Op::Const: {
+                    if (r.a < 0 || uint32_t(r.a) >= hdr.nconsts) return nullopt;
+                    nodes[i] = Instr::New<Const>(pool, constVals[r.a], ref(r.b));
+                    break;
+                }
+                case Op::Ref:       nodes[i] = Instr::New<MemRef>(r.a, ref(r.b)); break;
+                case Op::Set:       nodes[i] = Instr::New<MemSet>(r.a, ref(r.b)); break;
+                case Op::Branch:    nodes[i] = Instr::New<Branch>(ref(r.a), ref(r.b)); break;
+                case Op::Push:      nodes[i] = Instr::New<Push>(ref(r.a)); break;
+                case Op::Pop:       nodes[i] = Instr::New<Pop>(size_t(r.a), ref(r.b)); break;
+                case Op::Closure: {
+                    if (r.c < 0 || uint64_t(r.c) + 1 >= hdr.ncaps) return nullopt;
+                    const auto arity = caps[r.c].index, ncap = caps[r.c + 1].index;
+                    if (arity < 0 || ncap < 0 || r.c + 1 + uint64_t(ncap) >= hdr.ncaps) return nullopt;
+                    vector<CaptureSrc> srcs;
+                    for (int32_t k = 0; k < ncap; ++k) {
+                        const auto& cap = caps[r.c + 2 + k];
+                        if (cap.kind > uint8_t(CaptureSrc::Kind::Captured)) return nullopt;
+                        srcs.push_back(CaptureSrc{static_cast<CaptureSrc::Kind>(cap.kind), cap.index});
+                    }
+                    nodes[i] = Instr::New<Closure>(ref(r.a), arity, std::move(srcs), ref(r.b));
+                    break;
+                }
+                case Op::ClosureRef:nodes[i] = Instr::New<ClosureRef>(r.a, ref(r.b)); break;
+                case Op::Stub:      nodes[i] = ref(r.a); break; // loaded bodies are compiled already
+                case Op::MakeBox:
+                case Op::Unbox:
+                case Op::SetBox:    nodes[i] = Instr::New<BoxOp>(op, ref(r.a)); break;
+                case Op::Frame:     nodes[i] = Instr::New<Frame>(ref(r.a), ref(r.b)); break;
+                case Op::Call:
+                case Op::CallCC:    nodes[i] = Instr::New<Call>(op, r.a); break;
+                case Op::Ret:       nodes[i] = Instr::New<Ret>(r.a); break;
+                case Op::Loop:      nodes[i] = Instr::New<Loop>(ref(r.a)); break;
+                case Op::Jump: {
+                    nodes[i] = Instr::New<Jump>(r.b, r.c & 0xffff, uint32_t(r.c) >> 16);
+                    jumps.emplace_back(static_cast<Jump*>(nodes[i].get()), r.a);
+                    break;
+                }
+                case Op::Switch: {
+                    if (r.a < 0 || r.b < 1 || r.c < 0 || uint64_t(r.a) + r.b + 2 * uint64_t(r.c) > hdr.ncaps) return nullopt;
+                    vector<Instr::Ptr> targets;
+                    for (int32_t k = 0; k < r.b; ++k) targets.push_back(ref(caps[r.a + k].index));
+                    Switch::Keys keys;
+                    for (int32_t k = 0; k < r.c; ++k) {
+                        const auto key = caps[r.a + r.b + 2 * k].index, target = caps[r.a + r.b + 2 * k + 1].index;
+                        if (key < 0 || uint32_t(key) >= hdr.nconsts || target < 0) return nullopt;
+                        keys.emplace_back(constVals[key], uint32_t(target));
+                    }
+                    nodes[i] = Instr::New<Switch>(std::move(keys), std::move(targets));
+                    break;
+                }
+                case Op::GlobalRef:
+                case Op::GlobalSet:
+                case Op::GlobalDef: {
+                    auto name = symAt(r.a);
+                    if (!name) return nullopt;
+                    nodes[i] = Instr::New<GlobalOp>(op, globals->intern(*name), Symbol::intern(*name), ref(r.b));
+                    break;
+                }
+                default: {
+                    if (op < Op::ADD || op > Op::RECV) return nullopt;
+                    nodes[i] = Instr::New<Prim>(op, ref(r.a));
+                }
+            }
+        } catch (out_of_range&) {
+            return nullopt;
+        } catch (invalid_argument&) { // a switch table that does not fit its targets
+            return nullopt;
+        }
+    }
+
+    for (auto [jump, idx]: jumps) {
+        if (idx < 0 || uint32_t(idx) >= hdr.ninstrs || nodes[idx]->getOpCode() != Instr::Op::Loop) return nullopt;
+        jump->setLoop(static_cast<const Loop*>(nodes[idx].get()));
+    }
+
+    Entries result;
+    for (uint32_t i = 0; i < hdr.nentries; ++i) {
+        if (entries[i] >= hdr.ninstrs) return nullopt;
+        result.push_back(nodes[entries[i]]);
+    }
+    return result;
+}
+
+
+ImageCache::ImageCache(uint64_t variant): _variant(variant) {
+    if (auto dir = getenv("SCHEMER_CACHE_DIR")) {
+        _dir = dir;
+    } else if (auto xdg = getenv("XDG_CACHE_HOME")) {
+        _dir = string(xdg) + "/schemer";
+    } else if (auto home = getenv("HOME")) {
+        _dir = string(home) + "/.cache/schemer";
+    }
+}
+
+string ImageCache::pathFor(uint64_t hash) const {
+    return fmt::format("{}/{:016x}.scbc", _dir, hash);
+}
+
+optional<Entries> ImageCache::lookup(string_view src, GlobalTable::Ptr globals) const {
+    if (_dir.empty()) return nullopt;
+    auto h = hashSource(src, _variant);
+    return ImageLoader::load(pathFor(h), h, std::move(globals), src);
+}
+
+void ImageCache::store(string_view src, const Entries& entries) const {
+    if (_dir.empty()) return;
+
+    // best effort, a cache that can't be written just stays cold
+    string dir;
+    for (size_t pos = 0; pos != string::npos; ) {
+        pos = _dir.find('/', pos + 1);
+        dir = _dir.substr(0, pos);
+        mkdir(dir.c_str(), 0755);
+    }
+    auto h = hashSource(src, _variant);
+    try {
+        ImageWriter::write(pathFor(h), entries, h, src);
+    } catch (runtime_error&) { // a program the format can not hold
+    }
+}
+
+} // namespace ByteCode
@@ -0,0 +1,158 @@
+#pragma once
+
+#include "bytecode.h"
+#include "globals.h"
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// .scbc: on-disk image of a compiled program
+//
+//  Header | entries | instrs | consts | syms | string blob | captures | source
+//
+// every reference inside the image is an index (never a pointer), so an
+// image can be mapped at any address. Instructions are written successors
+// first, a loader builds the whole graph in a single forward pass. The one
+// exception are loop jumps, whose loop comes after them and is patched in.
+//
+// The records are not run in place: VirtualMachine runs a graph of Instr
+// objects, so loading allocates one node per record (and per constant) and
+// numbers the globals again. A cache hit skips parsing and compiling, not
+// this pass (about 0.5us per record).
+//
+// Cached images keep the source they were compiled from, a lookup compares
+// it in full: the hash only names the file.
+namespace ByteCode {
+
+constexpr char      Magic[4]    = {'S', 'C', 'B', 'C'};
+constexpr uint16_t  Version     = 10;
+
+struct FileHeader {
+    char        magic[4];
+    uint16_t    version;
+    uint16_t    flags;
+    uint64_t    sourceHash;
+    uint32_t    nentries,   entryOff;
+    uint32_t    ninstrs,    instrOff;
+    uint32_t    nconsts,    constOff;
+    uint32_t    nsyms,      symOff;
+    uint32_t    strSize,    strOff;
+    uint32_t    ncaps,      capOff;
+    uint32_t    srcSize,    srcOff; // no source if srcSize is 0
+};
+
+struct InstrRecord {
+    uint8_t     op;
+    uint8_t     pad[3];
+    int32_t     a, b, c;
+};
+
+struct ConstRecord {
+    enum Tag: uint8_t { Number, Boolean, Symbol, Void, Nil, Pair };
+    uint8_t     tag;
+    uint8_t     pad[7];
+    int64_t     value; // symbol: index into the symbol table, pair: car | cdr << 32 (both earlier records)
+};
+
+struct SymRecord {
+    uint32_t    offset, len;
+};
+
+// closure c operand: index of a record holding the arity, then one with the
+// number of captures, then the captures. Switch tables live here as well: a
+// is the index of the first target, b targets (the default last) are followed
+// by c pairs of records holding a key constant and the index of its target
+struct CaptureRecord {
+    uint8_t     kind;
+    uint8_t     pad[3];
+    int32_t     index;
+};
+
+static_assert(sizeof(FileHeader)  == 72);
+static_assert(sizeof(InstrRecord) == 16);
+static_assert(sizeof(ConstRecord) == 16);
+
+// the top level expressions of a script, compiled in order
+using Entries = std::vector<Instr::Ptr>;
+
+uint64_t hashSource(std::string_view src, uint64_t seed = 0);
+
+class ImageWriter: public InstrVisitor {
+public:
+    // returns false if the file can not be written. `src` is kept in the
+    // image when given, see ImageLoader::load
+    static bool write(const std::string& path, const Entries& entries, uint64_t srcHash = 0,
+            std::string_view src = {});
+
+private:
+    virtual void forHalt(const Halt&) override;
+    virtual void forConst(const Const&) override;
+    virtual void forPrim(const Prim&) override;
+    virtual void forMemRef(const MemRef&) override;
+    virtual void forMemSet(const MemSet&) override;
+    virtual void forBranch(const Branch&) override;
+    virtual void forPush(const Push&) override;
+    virtual void forPop(const Pop&) override;
+    virtual void forClosure(const Closure&) override;
+    virtual void forFrame(const Frame&) override;
+    virtual void forCall(const Call&) override;
+    virtual void forRet(const Ret&) override;
+    virtual void forClosureRef(const ClosureRef&) override;
+    virtual void forBoxOp(const BoxOp&) override;
+    virtual void forStub(const Stub&) override;
+    virtual void forGlobalOp(const GlobalOp&) override;
+    virtual void forLoop(const Loop&) override;
+    virtual void forJump(const Jump&) override;
+    virtual void forSwitch(const Switch&) override;
+
+    int32_t emit(const Instr* instr);
+    int32_t constIndex(const Value& val);
+    uint32_t symIndex(const std::string& sym);
+
+    std::vector<InstrRecord>                    _instrs;
+    std::vector<ConstRecord>                    _consts;
+    std::vector<SymRecord>                      _syms;
+    std::string                                 _strs;
+    std::vector<CaptureRecord>                  _caps;
+    std::unordered_map<const Instr*, int32_t>   _index;
+    std::vector<std::pair<int32_t, const Loop*>> _jumps; // records waiting for the index of their loop
+    std::unordered_map<std::string, uint32_t>   _symIndex;
+    struct ConstKeyHash {
+        size_t operator()(const std::pair<uint8_t, int64_t>& k) const { return std::hash<int64_t>()(k.second) * 31 + k.first; }
+    };
+    std::unordered_map<std::pair<uint8_t, int64_t>, int32_t, ConstKeyHash> _constIndex; // records by tag and value
+    InstrRecord                                 _rec;
+};
+
+class ImageLoader {
+public:
+    // mmap the image and rebuild the instruction graph, nullopt if the file
+    // is missing, truncated or of another format version. With an
+    // `expectHash` the image must also hold exactly `expectSrc`. Global
+    // variables are numbered in `globals`, a new table if null
+    static std::optional<Entries> load(const std::string& path, uint64_t expectHash = 0,
+            GlobalTable::Ptr globals = nullptr, std::string_view expectSrc = {});
+};
+
+// compiled images keyed by the content hash of the source, stored under
+// $SCHEMER_CACHE_DIR (default: $XDG_CACHE_HOME/schemer or ~/.cache/schemer).
+// `variant` separates images of the same source built with other options
+class ImageCache {
+public:
+    explicit ImageCache(uint64_t variant = 0);
+
+    std::optional<Entries> lookup(std::string_view src, GlobalTable::Ptr globals = nullptr) const;
+    void store(std::string_view src, const Entries& entries) const;
+
+private:
+    std::string pathFor(uint64_t hash) const;
+
+    std::string     _dir;
+    uint64_t        _variant;
+};
+
+} // namespace ByteCode
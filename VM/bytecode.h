@@ -1,8 +1,16 @@
 #pragma once
 
+#include <atomic>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <unordered_map>
 #include <vector>
 #include <memory>
 #include "value.h"
+#include "constpool.h"
 
 class InstrVisitor;
 class Instr {
@@ -10,7 +18,7 @@ public:
     using Ptr = std::shared_ptr<Instr>;
     enum class Op{
         Halt,
-        Imm,
+        Const,
         Ref,
         Set,
         Branch,
@@ -20,6 +28,18 @@ public:
         Frame,
         Call,
         Ret,
+        ClosureRef,
+        MakeBox,
+        Unbox,
+        SetBox,
+        Stub,
+        GlobalRef,
+        GlobalSet,
+        GlobalDef,
+        CallCC,
+        Loop,
+        Jump,
+        Switch,
         ADD,
         SUB,
         MUL,
@@ -30,7 +50,38 @@ public:
         EQ,
         GT,
         GE,
-        NEQ
+        NEQ,
+        CONS,
+        CAR,
+        CDR,
+        NULLP,
+        PAIRP,
+        EQP,
+        // green threads, see VirtualMachine::forPrim. They may switch to
+        // another thread
+        SPAWN,
+        YIELD,
+        MAKECHAN,
+        SEND,
+        RECV,
+        // quickened forms, rewritten in place by the VM once both operands
+        // were seen to be fixnums. They also consume the `pop 2` following
+        // the primitive, the *_BRANCH forms the branch after that as well
+        ADD_FIX,
+        SUB_FIX,
+        MUL_FIX,
+        LT_FIX,
+        LE_FIX,
+        EQ_FIX,
+        GT_FIX,
+        GE_FIX,
+        NEQ_FIX,
+        LT_FIX_BRANCH,
+        LE_FIX_BRANCH,
+        EQ_FIX_BRANCH,
+        GT_FIX_BRANCH,
+        GE_FIX_BRANCH,
+        NEQ_FIX_BRANCH
     };
 
     Instr(Op op):_op(op) {}
@@ -44,12 +95,61 @@ public:
 
     virtual void accept(InstrVisitor&) = 0;
 
-    auto getOpCode() const { return _op; }
+    auto getOpCode() const { return _op.load(std::memory_order_relaxed); }
+
+    // quickening swaps the opcode of a running instruction. Isolates on other
+    // threads may race on it, either form of the instruction is correct
+    void rewrite(Op op) const { _op.store(op, std::memory_order_relaxed); }
+
+    static bool isQuickened(Op op) { return op >= Op::ADD_FIX; }
+
+    // stack slots a primitive reads, the `pop` after it drops as many
+    static int primArity(Op op) {
+        switch (op) {
+            case Op::YIELD: case Op::MAKECHAN:  return 0;
+            case Op::CAR: case Op::CDR: case Op::NULLP: case Op::PAIRP:
+            case Op::SPAWN: case Op::RECV:      return 1;
+            default:                            return 2;
+        }
+    }
+    static bool isThreadOp(Op op) { return op >= Op::SPAWN && op <= Op::RECV; }
+
+    static Op generic(Op op) {
+        switch (op) {
+            case Op::ADD_FIX:                           return Op::ADD;
+            case Op::SUB_FIX:                           return Op::SUB;
+            case Op::MUL_FIX:                           return Op::MUL;
+            case Op::LT_FIX:  case Op::LT_FIX_BRANCH:   return Op::LT;
+            case Op::LE_FIX:  case Op::LE_FIX_BRANCH:   return Op::LE;
+            case Op::EQ_FIX:  case Op::EQ_FIX_BRANCH:   return Op::EQ;
+            case Op::GT_FIX:  case Op::GT_FIX_BRANCH:   return Op::GT;
+            case Op::GE_FIX:  case Op::GE_FIX_BRANCH:   return Op::GE;
+            case Op::NEQ_FIX: case Op::NEQ_FIX_BRANCH:  return Op::NEQ;
+            default:                                    return op;
+        }
+    }
+
+    // the quickened form of a primitive followed by `pop 2` (and a branch
+    // with `branch`), `op` itself if it has none
+    static Op fixnumForm(Op op, bool branch) {
+        switch (op) {
+            case Op::ADD: return Op::ADD_FIX;
+            case Op::SUB: return Op::SUB_FIX;
+            case Op::MUL: return Op::MUL_FIX;
+            case Op::LT:  return branch? Op::LT_FIX_BRANCH:  Op::LT_FIX;
+            case Op::LE:  return branch? Op::LE_FIX_BRANCH:  Op::LE_FIX;
+            case Op::EQ:  return branch? Op::EQ_FIX_BRANCH:  Op::EQ_FIX;
+            case Op::GT:  return branch? Op::GT_FIX_BRANCH:  Op::GT_FIX;
+            case Op::GE:  return branch? Op::GE_FIX_BRANCH:  Op::GE_FIX;
+            case Op::NEQ: return branch? Op::NEQ_FIX_BRANCH: Op::NEQ_FIX;
+            default:      return op;
+        }
+    }
 
     static std::string_view to_string(Op op) {
         switch (op) {
             case Op::Halt:      return "halt";
-            case Op::Imm:       return "imm";
+            case Op::Const:     return "const";
             case Op::Ref:       return "mread";
             case Op::Set:       return "mset";
             case Op::Branch:    return "branch";
@@ -59,6 +159,18 @@ public:
             case Op::Frame:     return "frame";
             case Op::Call:       return "jmp";
             case Op::Ret:       return "ret";
+            case Op::ClosureRef:return "cref";
+            case Op::MakeBox:   return "box";
+            case Op::Unbox:     return "unbox";
+            case Op::SetBox:    return "setbox";
+            case Op::Stub:      return "stub";
+            case Op::GlobalRef: return "gref";
+            case Op::GlobalSet: return "gset";
+            case Op::GlobalDef: return "gdef";
+            case Op::CallCC:    return "callcc";
+            case Op::Loop:      return "loop";
+            case Op::Jump:      return "jump";
+            case Op::Switch:    return "switch";
             case Op::ADD:       return "add";
             case Op::SUB:       return "sub";
             case Op::MUL:       return "mul";
@@ -70,11 +182,37 @@ public:
             case Op::GT:        return "gt";
             case Op::GE:        return "ge";
             case Op::NEQ:       return "neq";
+            case Op::CONS:      return "cons";
+            case Op::CAR:       return "car";
+            case Op::CDR:       return "cdr";
+            case Op::NULLP:     return "null?";
+            case Op::PAIRP:     return "pair?";
+            case Op::EQP:       return "eq?";
+            case Op::SPAWN:     return "spawn";
+            case Op::YIELD:     return "yield";
+            case Op::MAKECHAN:  return "chan";
+            case Op::SEND:      return "send";
+            case Op::RECV:      return "recv";
+            case Op::ADD_FIX:   return "add.fix";
+            case Op::SUB_FIX:   return "sub.fix";
+            case Op::MUL_FIX:   return "mul.fix";
+            case Op::LT_FIX:    return "lt.fix";
+            case Op::LE_FIX:    return "le.fix";
+            case Op::EQ_FIX:    return "eq.fix";
+            case Op::GT_FIX:    return "gt.fix";
+            case Op::GE_FIX:    return "ge.fix";
+            case Op::NEQ_FIX:   return "neq.fix";
+            case Op::LT_FIX_BRANCH:  return "lt.fix.branch";
+            case Op::LE_FIX_BRANCH:  return "le.fix.branch";
+            case Op::EQ_FIX_BRANCH:  return "eq.fix.branch";
+            case Op::GT_FIX_BRANCH:  return "gt.fix.branch";
+            case Op::GE_FIX_BRANCH:  return "ge.fix.branch";
+            case Op::NEQ_FIX_BRANCH: return "neq.fix.branch";
             default:            return "unkown-instr";
         }
     }
 private:
-    Op _op;
+    mutable std::atomic<Op> _op;
 };
 
 class Halt: public Instr {
@@ -85,21 +223,28 @@ public:
 private:
 };
 
-class Imm: public Instr {
+// loads entry `index` of the program's constant pool, the value is cached
+// here so loading never touches the pool
+class Const: public Instr {
 public:
-    Imm(Number::Type v, Ptr nxt):
-        Instr(Op::Imm), _value(std::make_shared<Number>(v)), _next(std::move(nxt)) {}
-    Imm(bool v, Ptr nxt): 
-        Instr(Op::Imm), _value(std::make_shared<Boolean>(v)), _next(std::move(nxt)) {}
-    virtual ~Imm()=default;
-
-    const auto getVal() const { return _value; }
+    Const(ConstPool::Ptr pool, uint32_t index, Ptr nxt):
+        Instr(Op::Const), _pool(std::move(pool)), _index(index), _value(_pool->at(index)), _next(std::move(nxt)) {}
+    Const(ConstPool::Ptr pool, const Value::Ptr& v, Ptr nxt):
+        Const(pool, pool->intern(v), std::move(nxt)) {}
+    virtual ~Const()=default;
+
+    const auto& getVal() const { return _value; }
+    uint32_t getIndex() const { return _index; }
+    const auto& getPool() const { return _pool; }
     const auto& getNext() const { return _next; }
+    auto& getNext() { return _next; }
 
     virtual void accept(InstrVisitor&) override;
 private:
 
-    Value::Ptr  _value;
+    ConstPool::Ptr      _pool;
+    uint32_t            _index;
+    Value::Ptr          _value;
     Ptr                 _next;
 };
 
@@ -109,11 +254,24 @@ public:
     virtual ~Prim()=default;
 
     const auto& getNext() const { return _next; }
+    auto& getNext() { return _next; }
+
+    // times the quickened form hit a non fixnum operand
+    int getDeopts() const { return _deopts.load(std::memory_order_relaxed); }
+    void deopt() const {
+        rewrite(generic(getOpCode()));
+        _deopts.fetch_add(1, std::memory_order_relaxed);
+        _genericRuns = 0;
+    }
+    // runs of the generic form since the last deopt
+    int countGenericRun() const { return ++_genericRuns; }
 
     virtual void accept(InstrVisitor&) override;
 private:
 
     Ptr                 _next;
+    mutable std::atomic<int> _deopts{0};
+    mutable int         _genericRuns{0}; // only by a VM that may rewrite the code, see VirtualMachine::shareCode
 };
 
 class MemRef: public Instr {
@@ -122,6 +280,7 @@ public:
     virtual ~MemRef()=default;
 
     const auto& getNext() const { return _next; }
+    auto& getNext() { return _next; }
     int getOffSet() const { return _offset; }
     virtual void accept(InstrVisitor&) override;
 
@@ -133,11 +292,12 @@ private:
 
 class MemSet: public Instr {
 public:
-    MemSet(int offset, Ptr nxt): Instr(Op::Set), _next(std::move(nxt)) {}
+    MemSet(int offset, Ptr nxt): Instr(Op::Set), _offset(offset), _next(std::move(nxt)) {}
     virtual ~MemSet()=default;
 
     int getOffSet() const { return _offset; }
     const auto& getNext() const { return _next; }
+    auto& getNext() { return _next; }
     virtual void accept(InstrVisitor&) override;
 private:
 
@@ -152,6 +312,8 @@ public:
 
     const auto& getTrue() const { return _true; }
     const auto& getFalse() const { return _false; }
+    auto& getTrue() { return _true; }
+    auto& getFalse() { return _false; }
 
     virtual void accept(InstrVisitor&) override;
 private:
@@ -167,6 +329,7 @@ public:
     virtual ~Push()=default;
 
     const auto& getNext() const { return _next; }
+    auto& getNext() { return _next; }
     virtual void accept(InstrVisitor&) override;
 private:
 
@@ -182,6 +345,7 @@ public:
     size_t getNum() const { return _n; }
 
     const auto& getNext() const { return _next; }
+    auto& getNext() { return _next; }
     virtual void accept(InstrVisitor&) override;
 private:
 
@@ -189,28 +353,126 @@ private:
     Ptr                 _next;
 };
 
+// where a closure being created copies a free variable from
+struct CaptureSrc {
+    enum class Kind: uint8_t { Local, Captured };
+    Kind    kind;
+    int     index; // Local: offset from bp, Captured: slot in the current closure
+};
+
 class Closure: public Instr {
 public:
-    Closure(Ptr code, Ptr nxt): Instr(Op::Closure), _code(std::move(code)), _next(std::move(nxt)) {}
+    Closure(Ptr code, int arity, std::vector<CaptureSrc> caps, Ptr nxt):
+        Instr(Op::Closure), _code(std::move(code)), _arity(arity), _captures(std::move(caps)), _next(std::move(nxt)) {}
     virtual ~Closure()=default;
 
     const auto& getCode() const { return _code; }
+    auto& getCode() { return _code; }
+    int getArity() const { return _arity; }
+    const auto& getCaptures() const { return _captures; }
+    const auto& getNext() const { return _next; }
+    auto& getNext() { return _next; }
+
+    virtual void accept(InstrVisitor&) override;
+private:
+
+    Ptr                     _code;
+    int                     _arity;
+    std::vector<CaptureSrc> _captures;
+    Ptr                     _next;
+};
+
+// acc = captured[index] of the running closure
+class ClosureRef: public Instr {
+public:
+    ClosureRef(int idx, Ptr nxt): Instr(Op::ClosureRef), _index(idx), _next(std::move(nxt)) {}
+    virtual ~ClosureRef()=default;
+
+    int getIndex() const { return _index; }
     const auto& getNext() const { return _next; }
+    auto& getNext() { return _next; }
+    virtual void accept(InstrVisitor&) override;
+
+private:
+
+    int                 _index;
+    Ptr                 _next;
+};
+
+// MakeBox: acc = box(acc), Unbox: acc = *acc, SetBox: *stack.top = acc
+class BoxOp: public Instr {
+public:
+    BoxOp(Op op, Ptr nxt): Instr(op), _next(std::move(nxt)) {}
+    virtual ~BoxOp()=default;
+
+    const auto& getNext() const { return _next; }
+    auto& getNext() { return _next; }
+    virtual void accept(InstrVisitor&) override;
+
+private:
+
+    Ptr                 _next;
+};
 
+// GlobalRef: acc = globals[index], GlobalSet/GlobalDef: globals[index] = acc.
+// Only GlobalDef may write a global not defined yet
+class GlobalOp: public Instr {
+public:
+    GlobalOp(Op op, uint32_t index, const std::string* name, Ptr nxt):
+        Instr(op), _index(index), _name(name), _next(std::move(nxt)) {}
+    virtual ~GlobalOp()=default;
+
+    uint32_t getIndex() const { return _index; }
+    const std::string& getName() const { return *_name; }
+    const auto& getNext() const { return _next; }
+    auto& getNext() { return _next; }
     virtual void accept(InstrVisitor&) override;
+
 private:
 
-    Ptr                 _code;
+    uint32_t            _index;
+    const std::string*  _name; // interned, see Symbol::intern
     Ptr                 _next;
 };
 
+// entry of a lambda whose body is compiled on the first call, see
+// ByteCodeCompiler::forLambda. Afterwards it forwards to the body
+class Stub: public Instr {
+public:
+    using Compile = std::function<Ptr()>;
+
+    Stub(Compile compile): Instr(Op::Stub), _compile(std::move(compile)) {}
+    virtual ~Stub()=default;
+
+    // compiles the body on the first use, isolates may race here
+    const Ptr& getBody() const {
+        std::call_once(_once, [this] {
+            _body = _compile();
+            _compile = nullptr; // drops the AST
+            _compiled.store(true, std::memory_order_release);
+        });
+        return _body;
+    }
+    bool isCompiled() const { return _compiled.load(std::memory_order_acquire); }
+
+    virtual void accept(InstrVisitor&) override;
+
+private:
+    mutable Compile             _compile;
+    mutable Ptr                 _body;
+    mutable std::once_flag      _once;
+    mutable std::atomic<bool>   _compiled{false};
+};
+
 class Frame: public Instr {
 public:
     Frame(Ptr ret, Ptr nxt): Instr(Op::Frame), _return(std::move(ret)), _next(std::move(nxt)) {}
     virtual ~Frame()=default;
 
     const auto& getNext() const { return _next; }
+    auto& getNext() { return _next; }
     const auto& getRet() const  { return _return; }
+    auto& getRet() { return _return; }
 
     virtual void accept(InstrVisitor&) override;
 private:
@@ -218,13 +480,20 @@ private:
     Ptr                 _return;
 };
 
+// Call: calls the closure in acc with the `argc` values pushed since the frame.
+// CallCC: nothing pushed, the continuation of the frame is passed instead
 class Call: public Instr {
 public:
-    Call(): Instr(Op::Call) {}
+    Call(int argc): Instr(Op::Call), _argc(argc) {}
+    Call(Op op, int argc): Instr(op), _argc(argc) {}
     virtual ~Call()=default;
 
+    int getArgc() const { return _argc; }
+
     virtual void accept(InstrVisitor&) override;
 private:
+
+    int                 _argc;
 };
 
 class Ret: public Instr {
@@ -240,10 +509,128 @@ private:
     int                 _popn;
 };
 
+// head of a loop compiled from a named let, see ByteCodeCompiler::compileLoop
+class Loop: public Instr {
+public:
+    Loop(Ptr body): Instr(Op::Loop), _next(std::move(body)) {}
+    virtual ~Loop()=default;
+
+    const auto& getNext() const { return _next; }
+    auto& getNext() { return _next; }
+
+    virtual void accept(InstrVisitor&) override;
+private:
+
+    Ptr                 _next;
+};
+
+// back edge of a loop: moves the top `argc` values into the slots from `slot`
+// on, pops `pop` values and continues at the loop body. The loop encloses the
+// jump and owns it, so the jump only points back at it
+class Jump: public Instr {
+public:
+    Jump(int slot, int argc, int pop, const Loop* loop = nullptr):
+        Instr(Op::Jump), _slot(slot), _argc(argc), _pop(pop), _loop(loop) {}
+    virtual ~Jump()=default;
+
+    int getSlot() const { return _slot; }
+    int getArgc() const { return _argc; }
+    int getPop() const { return _pop; }
+    const Loop* getLoop() const { return _loop; }
+    void setLoop(const Loop* loop) { _loop = loop; } // the loop is built after its body
+
+    virtual void accept(InstrVisitor&) override;
+private:
+
+    int                 _slot;
+    int                 _argc;
+    int                 _pop;
+    const Loop*         _loop;
+};
+
+// case dispatch on acc. Keys are compared as by eqv?: numbers, booleans,
+// interned symbols and nil. Keys of a dense fixnum range index a table,
+// others are hashed. The last target is taken when no key matches, a key
+// may share its target with others
+class Switch: public Instr {
+public:
+    using Keys = std::vector<std::pair<Value::Ptr, uint32_t>>; // key, index of its target
+
+    Switch(Keys keys, std::vector<Ptr> targets): Instr(Op::Switch), _keys(std::move(keys)), _targets(std::move(targets)) {
+        if (_targets.empty()) throw std::invalid_argument("switch without a default target");
+        const auto dflt = uint32_t(_targets.size() - 1);
+        bool fixnums = true;
+        auto lo = std::numeric_limits<Number::Type>::max(), hi = std::numeric_limits<Number::Type>::min();
+        for (const auto& [key, target]: _keys) {
+            if (!key || !keyOf(*key) || target >= dflt) throw std::invalid_argument("bad switch key");
+            if (key->type_ != Value::Type::Number) { fixnums = false; continue; }
+            const auto n = static_cast<const Number&>(*key).value_;
+            lo = std::min(lo, n);
+            hi = std::max(hi, n);
+        }
+        // at least half of the table used
+        if (fixnums && !_keys.empty() && uint64_t(hi) - uint64_t(lo) < 2 * _keys.size()) {
+            _lo = lo;
+            _dense.assign(size_t(hi - lo) + 1, dflt);
+            for (auto it = _keys.rbegin(); it != _keys.rend(); ++it) { // the first of duplicate keys wins
+                _dense[static_cast<const Number&>(*it->first).value_ - lo] = it->second;
+            }
+        } else {
+            for (const auto& [key, target]: _keys) _hashed.emplace(*keyOf(*key), target);
+        }
+    }
+    virtual ~Switch()=default;
+
+    // index of the target for `v`
+    uint32_t select(const Value& v) const {
+        const auto dflt = uint32_t(_targets.size() - 1);
+        if (!_dense.empty()) {
+            if (v.type_ != Value::Type::Number) return dflt;
+            const auto i = uint64_t(static_cast<const Number&>(v).value_) - uint64_t(_lo);
+            return i < _dense.size()? _dense[i]: dflt;
+        }
+        const auto key = keyOf(v);
+        if (!key) return dflt;
+        const auto it = _hashed.find(*key);
+        return it == _hashed.end()? dflt: it->second;
+    }
+
+    const Keys& getKeys() const { return _keys; }
+    const auto& getTargets() const { return _targets; }
+    auto& getTargets() { return _targets; }
+
+    virtual void accept(InstrVisitor&) override;
+private:
+    struct Key {
+        Value::Type type;
+        uint64_t    bits;
+        bool operator==(const Key& k) const { return type == k.type && bits == k.bits; }
+    };
+    struct KeyHash {
+        size_t operator()(const Key& k) const { return std::hash<uint64_t>()(k.bits) ^ size_t(k.type); }
+    };
+    // nullopt for values only eqv? to themselves
+    static std::optional<Key> keyOf(const Value& v) {
+        switch (v.type_) {
+            case Value::Type::Number:   return Key{v.type_, uint64_t(static_cast<const Number&>(v).value_)};
+            case Value::Type::Boolean:  return Key{v.type_, static_cast<const Boolean&>(v).value_};
+            case Value::Type::Symbol:   return Key{v.type_, uint64_t(reinterpret_cast<uintptr_t>(static_cast<const Symbol&>(v).ptr_))};
+            case Value::Type::Nil:      return Key{v.type_, 0};
+            default:                    return std::nullopt;
+        }
+    }
+
+    Keys                                    _keys;
+    std::vector<Ptr>                        _targets;
+    Number::Type                            _lo{0};
+    std::vector<uint32_t>                   _dense; // by key - _lo
+    std::unordered_map<Key, uint32_t, KeyHash> _hashed;
+};
+
 class InstrVisitor {
 public:
     virtual void forHalt(const Halt&) = 0;
-    virtual void forImm(const Imm&) = 0;
+    virtual void forConst(const Const&) = 0;
     virtual void forPrim(const Prim&) = 0;
     virtual void forMemRef(const MemRef&) = 0;
     virtual void forMemSet(const MemSet&) = 0;
@@ -254,12 +641,20 @@ public:
     virtual void forFrame(const Frame&) = 0;
     virtual void forCall(const Call&) = 0;
     virtual void forRet(const Ret&) = 0;
+    virtual void forClosureRef(const ClosureRef&) = 0;
+    virtual void forBoxOp(const BoxOp&) = 0;
+    virtual void forStub(const Stub&) = 0;
+    virtual void forGlobalOp(const GlobalOp&) = 0;
+    virtual void forLoop(const Loop&) = 0;
+    virtual void forJump(const Jump&) = 0;
+    virtual void forSwitch(const Switch&) = 0;
 };
 
 inline void Halt::accept(InstrVisitor& v) { v.forHalt(*this); }
-inline void Imm::accept(InstrVisitor& v) { v.forImm(*this); }
+inline void Const::accept(InstrVisitor& v) { v.forConst(*this); }
 inline void Prim::accept(InstrVisitor& v) { v.forPrim(*this); }
 inline void MemRef::accept(InstrVisitor& v) { v.forMemRef(*this); }
+inline void MemSet::accept(InstrVisitor& v) { v.forMemSet(*this); }
 inline void Branch::accept(InstrVisitor& v) { v.forBranch(*this); }
 inline void Push::accept(InstrVisitor& v) { v.forPush(*this); }
 inline void Pop::accept(InstrVisitor& v) { v.forPop(*this); }
@@ -267,4 +662,104 @@ inline void Closure::accept(InstrVisitor& v) { v.forClosure(*this); }
 inline void Frame::accept(InstrVisitor& v) { v.forFrame(*this); }
 inline void Call::accept(InstrVisitor& v) { v.forCall(*this); }
 inline void Ret::accept(InstrVisitor& v) { v.forRet(*this); }
-
+inline void ClosureRef::accept(InstrVisitor& v) { v.forClosureRef(*this); }
+inline void Stub::accept(InstrVisitor& v) { v.forStub(*this); }
+inline void BoxOp::accept(InstrVisitor& v) { v.forBoxOp(*this); }
+inline void GlobalOp::accept(InstrVisitor& v) { v.forGlobalOp(*this); }
+inline void Loop::accept(InstrVisitor& v) { v.forLoop(*this); }
+inline void Jump::accept(InstrVisitor& v) { v.forJump(*this); }
+inline void Switch::accept(InstrVisitor& v) { v.forSwitch(*this); }
+
+
+// instructions control may continue at after `instr` (closure bodies included)
+inline std::vector<Instr*> successorsOf(const Instr& instr) {
+    using Op = Instr::Op;
+    switch (instr.getOpCode()) {
+        case Op::Const:     return {static_cast<const Const&>(instr).getNext().get()};
+        case Op::Ref:       return {static_cast<const MemRef&>(instr).getNext().get()};
+        case Op::Set:       return {static_cast<const MemSet&>(instr).getNext().get()};
+        case Op::Push:      return {static_cast<const Push&>(instr).getNext().get()};
+        case Op::Pop:       return {static_cast<const Pop&>(instr).getNext().get()};
+        case Op::ClosureRef:return {static_cast<const ClosureRef&>(instr).getNext().get()};
+        case Op::MakeBox:
+        case Op::Unbox:
+        case Op::SetBox:    return {static_cast<const BoxOp&>(instr).getNext().get()};
+        case Op::GlobalRef:
+        case Op::GlobalSet:
+        case Op::GlobalDef: return {static_cast<const GlobalOp&>(instr).getNext().get()};
+        case Op::Loop:      return {static_cast<const Loop&>(instr).getNext().get()};
+        case Op::Jump:      return {const_cast<Loop*>(static_cast<const Jump&>(instr).getLoop())};
+        case Op::Branch: {
+            const auto& br = static_cast<const Branch&>(instr);
+            return {br.getTrue().get(), br.getFalse().get()};
+        }
+        case Op::Switch: {
+            std::vector<Instr*> succs;
+            for (const auto& t: static_cast<const Switch&>(instr).getTargets()) succs.push_back(t.get());
+            return succs;
+        }
+        case Op::Closure: {
+            const auto& clo = static_cast<const Closure&>(instr);
+            return {clo.getCode().get(), clo.getNext().get()};
+        }
+        case Op::Frame: {
+            const auto& frm = static_cast<const Frame&>(instr);
+            return {frm.getRet().get(), frm.getNext().get()};
+        }
+        case Op::Halt:
+        case Op::Call:
+        case Op::CallCC:
+        case Op::Ret:       return {};
+        case Op::Stub: {
+            // bodies not compiled yet are not part of the program so far
+            const auto& stub = static_cast<const Stub&>(instr);
+            if (stub.isCompiled()) return {stub.getBody().get()};
+            return {};
+        }
+        default:            return {static_cast<const Prim&>(instr).getNext().get()};
+    }
+}
+
+// the same successors, as slots passes can rewrite in place
+inline std::vector<Instr::Ptr*> successorSlots(Instr& instr) {
+    using Op = Instr::Op;
+    switch (instr.getOpCode()) {
+        case Op::Const:     return {&static_cast<Const&>(instr).getNext()};
+        case Op::Ref:       return {&static_cast<MemRef&>(instr).getNext()};
+        case Op::Set:       return {&static_cast<MemSet&>(instr).getNext()};
+        case Op::Push:      return {&static_cast<Push&>(instr).getNext()};
+        case Op::Pop:       return {&static_cast<Pop&>(instr).getNext()};
+        case Op::ClosureRef:return {&static_cast<ClosureRef&>(instr).getNext()};
+        case Op::MakeBox:
+        case Op::Unbox:
+        case Op::SetBox:    return {&static_cast<BoxOp&>(instr).getNext()};
+        case Op::GlobalRef:
+        case Op::GlobalSet:
+        case Op::GlobalDef: return {&static_cast<GlobalOp&>(instr).getNext()};
+        case Op::Loop:      return {&static_cast<Loop&>(instr).getNext()};
+        case Op::Branch: {
+            auto& br = static_cast<Branch&>(instr);
+            return {&br.getTrue(), &br.getFalse()};
+        }
+        case Op::Switch: {
+            std::vector<Instr::Ptr*> slots;
+            for (auto& t: static_cast<Switch&>(instr).getTargets()) slots.push_back(&t);
+            return slots;
+        }
+        case Op::Closure: {
+            auto& clo = static_cast<Closure&>(instr);
+            return {&clo.getCode(), &clo.getNext()};
+        }
+        case Op::Frame: {
+            auto& frm = static_cast<Frame&>(instr);
+            return {&frm.getRet(), &frm.getNext()};
+        }
+        case Op::Halt:
+        case Op::Call:
+        case Op::CallCC:
+        case Op::Ret:
+        case Op::Jump:      // the loop is reached through its own slot
+        case Op::Stub:      return {}; // a compiled body was already finished on its own
+        default:            return {&static_cast<Prim&>(instr).getNext()};
+    }
+}
@@ -0,0 +1,61 @@
+#include "constpool.h"
+
+#include <stdexcept>
+
+using namespace std;
+
+namespace {
+
+// equal keys for structurally equal constants
+void keyOf(const Value& val, string& key) {
+    switch (val.getType()) {
+        case Value::Type::Number: {
+            key += 'n';
+            key += to_string(static_cast<const Number&>(val).value_);
+            break;
+        }
+        case Value::Type::Boolean: {
+            key += static_cast<const Boolean&>(val).value_? "#t": "#f";
+            break;
+        }
+        case Value::Type::Symbol: {
+            const auto& sym = *static_cast<const Symbol&>(val).ptr_;
+            key += 's';
+            key += to_string(sym.size());
+            key += ':';
+            key += sym;
+            break;
+        }
+        case Value::Type::Nil: {
+            key += "()";
+            break;
+        }
+        case Value::Type::Void: {
+            key += 'v';
+            break;
+        }
+        case Value::Type::Cons: {
+            const auto& cons = static_cast<const Cons&>(val);
+            key += '(';
+            keyOf(*cons.car_, key);
+            key += '.';
+            keyOf(*cons.cdr_, key);
+            key += ')';
+            break;
+        }
+        default:
+            throw runtime_error(string("a ") + typeStr(val.getType()) + " can not be a constant");
+    }
+}
+
+} // namespace
+
+uint32_t ConstPool::intern(const Value::Ptr& val) {
+    string key;
+    keyOf(*val, key);
+
+    lock_guard<mutex> lock(_mtx);
+    auto [it, added] = _index.emplace(std::move(key), _values.size());
+    if (added) _values.push_back(val);
+    return it->second;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "value.h"
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// constants of a program: immediates and quoted data, built once at compile
+// time and referenced by index. Equal constants are stored once. The pool
+// only grows (lazily compiled lambdas add to it while the program runs),
+// Const instructions keep the value itself so running code never locks it
+class ConstPool {
+public:
+    using Ptr = std::shared_ptr<ConstPool>;
+
+    // index of a constant equal to `val`, which is added if there is none
+    uint32_t intern(const Value::Ptr& val);
+
+    Value::Ptr at(uint32_t index) const {
+        std::lock_guard<std::mutex> lock(_mtx);
+        return _values.at(index);
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(_mtx);
+        return _values.size();
+    }
+
+private:
+    mutable std::mutex                          _mtx;
+    std::vector<Value::Ptr>                     _values;
+    std::unordered_map<std::string, uint32_t>   _index; // structural key of every constant
+};
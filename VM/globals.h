@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// slots of the global variables of a program, numbered in order of first
+// use. Only the numbering is shared, every VirtualMachine keeps its own
+// values under these indices. Lazily compiled lambdas add names while the
+// program runs, possibly on several isolates
+class GlobalTable {
+public:
+    using Ptr = std::shared_ptr<GlobalTable>;
+
+    uint32_t intern(std::string_view name) {
+        std::lock_guard<std::mutex> lock(_mtx);
+        return _slots.emplace(name, _slots.size()).first->second;
+    }
+
+    std::optional<uint32_t> lookup(std::string_view name) const {
+        std::lock_guard<std::mutex> lock(_mtx);
+        auto it = _slots.find(std::string(name));
+        if (it == _slots.end()) return std::nullopt;
+        return it->second;
+    }
+
+private:
+    mutable std::mutex                          _mtx;
+    std::unordered_map<std::string, uint32_t>   _slots;
+};
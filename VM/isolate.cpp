@@ -0,0 +1,52 @@
+#include "isolate.h"
+#include "machine.h"
+#include "optimizer.h"
+#include "verifier.h"
+
+#include <algorithm>
+#include <atomic>
+
+using namespace std;
+
+vector<IsolatePool::Result> IsolatePool::evaluate(const vector<Program>& programs) const {
+    vector<Result> results(programs.size());
+    atomic<size_t> next{0};
+
+    // quickened before any isolate runs it, none writes to the shared code
+    for (const auto& program: programs) {
+        for (const auto& entry: program) Optimizer::quickenAll(entry);
+    }
+
+    // programs are handed out one at a time, short and long ones balance out
+    auto worker = [&]() {
+        auto vm = make_unique<VirtualMachine>();
+        vm->shareCode();
+        for (size_t i; (i = next.fetch_add(1, memory_order_relaxed)) < programs.size(); ) {
+            try {
+                vector<Verifier::Verified> verified;
+                for (const auto& entry: programs[i]) {
+                    string err;
+                    auto code = Verifier::verify(entry, &err);
+                    if (!code) throw runtime_error("bytecode verification failed: " + err);
+                    verified.push_back(std::move(*code));
+                }
+                Value::Ptr val;
+                for (const auto& code: verified) {
+                    val = vm->execute(code);
+                }
+                results[i].value = std::move(val);
+            } catch (std::exception& e) {
+                results[i].error = e.what();
+                vm = make_unique<VirtualMachine>(); // the failed program may have left frames behind
+                vm->shareCode();
+            }
+        }
+    };
+
+    const auto n = min<size_t>(_threads, programs.size());
+    vector<thread> pool;
+    for (size_t t = 1; t < n; ++t) pool.emplace_back(worker);
+    worker();
+    for (auto& th: pool) th.join();
+    return results;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "bytecode.h"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+// Runs independent programs on VirtualMachine isolates, one per thread.
+// The compiled programs are shared read-only, each isolate has its own
+// stack, registers and values. Programs may be passed more than once.
+class IsolatePool {
+public:
+    // the top level expressions of a program, run in order
+    using Program = std::vector<Instr::Ptr>;
+
+    struct Result {
+        Value::Ptr  value; // of the last expression, nullptr on error
+        std::string error;
+    };
+
+    explicit IsolatePool(unsigned threads = std::thread::hardware_concurrency()):
+        _threads(threads? threads: 1) {}
+
+    // results in the order of `programs`
+    std::vector<Result> evaluate(const std::vector<Program>& programs) const;
+
+private:
+    unsigned    _threads;
+};
@@ -1,17 +1,96 @@
 #include "machine.h"
 
+std::atomic<size_t> VirtualMachine::s_quickened{0};
+std::atomic<size_t> VirtualMachine::s_deopts{0};
 
 void VirtualMachine::forHalt(const Halt& instr) {
     // halt
     _ip = nullptr;
+    if (_tid == MainThread) {
+        if (_ready.empty()) return;
+        // the spawned threads run to completion (or block) first
+        _halted = std::make_unique<GreenThread>();
+        swapContext(*_halted);
+    }
+    schedule();
 }
 
-void VirtualMachine::forImm(const Imm& instr) {
-    _acc    = instr.getVal();
+void VirtualMachine::forConst(const Const& instr) {
+    _acc    = constant(instr);
     _ip     = instr.getNext().get();
 }
 
+// a deep copy owned by one VM
+static Value::Ptr cloneConst(const Value& val) {
+    switch (val.getType()) {
+        case Value::Type::Number:   return std::make_shared<Number>(static_cast<const Number&>(val).value_);
+        case Value::Type::Boolean:  return std::make_shared<Boolean>(static_cast<const Boolean&>(val).value_);
+        case Value::Type::Symbol:   return std::make_shared<Symbol>(*static_cast<const Symbol&>(val).ptr_);
+        case Value::Type::Nil:      return Nil::make();
+        case Value::Type::Void:     return Void::make();
+        case Value::Type::Cons: {
+            const auto& cons = static_cast<const Cons&>(val);
+            return std::make_shared<Cons>(cloneConst(*cons.car_), cloneConst(*cons.cdr_));
+        }
+        default:
+            throw std::runtime_error(fmt::format("a {} can not be a constant", typeStr(val.getType())));
+    }
+}
+
+const Value::Ptr& VirtualMachine::constant(const Const& instr) {
+    if (!_localPool || _localPool->pool != instr.getPool()) {
+        auto& local = _localPools[instr.getPool().get()];
+        local.pool  = instr.getPool();
+        _localPool  = &local;
+    }
+    auto& values = _localPool->values;
+    if (instr.getIndex() >= values.size()) values.resize(instr.getIndex() + 1);
+    auto& val = values[instr.getIndex()];
+    if (!val) val = cloneConst(*instr.getVal());
+    return val;
+}
+
 void VirtualMachine::forPrim(const Prim& instr) {
+    if (Instr::isQuickened(instr.getOpCode()) && forQuickPrim(instr)) return;
+    if (Instr::isThreadOp(instr.getOpCode())) return forThreadOp(instr);
+
+    // still quickened when the guard failed in shared code, see shareCode
+    applyPrim(Instr::generic(instr.getOpCode()));
+    _ip = instr.getNext().get();
+    quicken(instr);
+}
+
+// numbers and booleans by value, symbols by name, anything else by identity
+static bool isEq(const Value& v1, const Value& v2) {
+    if (v1.getType() != v2.getType()) return false;
+    switch (v1.getType()) {
+        case Value::Type::Number:   return static_cast<const Number&>(v1).value_ == static_cast<const Number&>(v2).value_;
+        case Value::Type::Boolean:  return static_cast<const Boolean&>(v1).value_ == static_cast<const Boolean&>(v2).value_;
+        case Value::Type::Symbol:   return static_cast<const Symbol&>(v1).ptr_ == static_cast<const Symbol&>(v2).ptr_;
+        case Value::Type::Nil:
+        case Value::Type::Void:     return true; // every VM has its own, see cloneConst
+        default:                    return &v1 == &v2;
+    }
+}
+
+void VirtualMachine::applyPrim(Instr::Op op) {
+    auto pair = [](const Value::Ptr& v) -> const Cons& {
+        if (v->getType() != Value::Type::Cons) {
+            throw std::runtime_error(fmt::format("expect a {}, but got {}", typeStr(Value::Type::Cons), typeStr(v->getType())));
+        }
+        return static_cast<const Cons&>(*v);
+    };
+
+    switch (op) {
+        case Instr::Op::CONS:   _acc = std::make_shared<Cons>(*(_stack.rbegin() + 1), _stack.back()); return;
+        case Instr::Op::CAR:    _acc = pair(_stack.back()).car_; return;
+        case Instr::Op::CDR:    _acc = pair(_stack.back()).cdr_; return;
+        case Instr::Op::NULLP:  _acc = _stack.back()->getType() == Value::Type::Nil? _true: _false; return;
+        case Instr::Op::PAIRP:  _acc = _stack.back()->getType() == Value::Type::Cons? _true: _false; return;
+        case Instr::Op::EQP:    _acc = isEq(**(_stack.rbegin() + 1), *_stack.back())? _true: _false; return;
+        default:                break;
+    }
+
     const auto& var1 = **(_stack.rbegin() + 1), &var2 = *_stack.back();
     if (var1.getType() != Value::Type::Number || var2.getType() != Value::Type::Number) {
         throw std::invalid_argument("expect numbers");
@@ -19,7 +98,7 @@ void VirtualMachine::forPrim(const Prim& instr) {
 
     const auto num1 = static_cast<const Number&>(var1).value_;
     const auto num2 = static_cast<const Number&>(var2).value_;
-    switch(instr.getOpCode()) {
+    switch(op) {
         case Instr::Op::ADD: {
             _acc = std::make_shared<Number>(num1 + num2); break;
         }
@@ -36,28 +115,98 @@ void VirtualMachine::forPrim(const Prim& instr) {
             _acc = std::make_shared<Number>(num1 % num2); break;
         }
         case Instr::Op::LT: {
-            _acc = std::make_shared<Boolean>(num1 < num2); break;
+            _acc = num1 < num2? _true: _false; break;
         }
         case Instr::Op::LE: {
-            _acc = std::make_shared<Boolean>(num1 <= num2); break;
+            _acc = num1 <= num2? _true: _false; break;
         }
         case Instr::Op::EQ: {
-            _acc = std::make_shared<Boolean>(num1 == num2); break;
+            _acc = num1 == num2? _true: _false; break;
         }
         case Instr::Op::GT: {
-            _acc = std::make_shared<Boolean>(num1 > num2); break;
+            _acc = num1 > num2? _true: _false; break;
         }
         case Instr::Op::GE: {
-            _acc = std::make_shared<Boolean>(num1 >= num2); break;
+            _acc = num1 >= num2? _true: _false; break;
         }
         case Instr::Op::NEQ: {
-            _acc = std::make_shared<Boolean>(num1 != num2); break;
+            _acc = num1 != num2? _true: _false; break;
         }
         default:{
-            throw std::runtime_error(fmt::format("internal error, unexpected primitive operator {}",  static_cast<int>(instr.getOpCode())));
+            throw std::runtime_error(fmt::format("internal error, unexpected primitive operator {}",  static_cast<int>(op)));
         }
     }
-    _ip = instr.getNext().get();
+}
+
+void VirtualMachine::quicken(const Prim& instr) {
+    using Op = Instr::Op;
+    constexpr int maxDeopts = 4; // give up on sites that keep seeing other types
+    // a deopted site stays generic for a while, it must not flip back to
+    // the quickened form on the very run that reverted it
+    constexpr int requickenAfter = 64;
+
+    const auto op = instr.getOpCode();
+    if (_sharedCode || instr.getDeopts() >= maxDeopts) return;
+    if (instr.getDeopts() > 0 && instr.countGenericRun() <= requickenAfter) return;
+
+    const auto& nxt = *instr.getNext();
+    if (nxt.getOpCode() != Op::Pop || static_cast<const Pop&>(nxt).getNum() != 2) return;
+
+    const bool branch = static_cast<const Pop&>(nxt).getNext()->getOpCode() == Op::Branch;
+    const auto quick = Instr::fixnumForm(op, branch);
+    if (quick != op) {
+        instr.rewrite(quick);
+        s_quickened.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+bool VirtualMachine::forQuickPrim(const Prim& instr) {
+    using Op = Instr::Op;
+
+    auto& var1 = **(_stack.rbegin() + 1), &var2 = *_stack.back();
+    if (var1.getType() != Value::Type::Number || var2.getType() != Value::Type::Number) {
+        if (!_sharedCode) {
+            instr.deopt();
+            s_deopts.fetch_add(1, std::memory_order_relaxed);
+        }
+        return false;
+    }
+
+    const auto num1 = static_cast<const Number&>(var1).value_;
+    const auto num2 = static_cast<const Number&>(var2).value_;
+    const auto& pop = static_cast<const Pop&>(*instr.getNext());
+
+    auto setBool = [&](bool b) { _acc = b? _true: _false; _ip = pop.getNext().get(); };
+    auto branch  = [&](bool b) {
+        // still leave the predicate in acc, a following branch may test it again
+        _acc = b? _true: _false;
+        const auto& br = static_cast<const Branch&>(*pop.getNext());
+        _ip  = b? br.getTrue().get(): br.getFalse().get();
+    };
+
+    switch (instr.getOpCode()) {
+        case Op::ADD_FIX: _acc = std::make_shared<Number>(num1 + num2); _ip = pop.getNext().get(); break;
+        case Op::SUB_FIX: _acc = std::make_shared<Number>(num1 - num2); _ip = pop.getNext().get(); break;
+        case Op::MUL_FIX: _acc = std::make_shared<Number>(num1 * num2); _ip = pop.getNext().get(); break;
+        case Op::LT_FIX:  setBool(num1 <  num2); break;
+        case Op::LE_FIX:  setBool(num1 <= num2); break;
+        case Op::EQ_FIX:  setBool(num1 == num2); break;
+        case Op::GT_FIX:  setBool(num1 >  num2); break;
+        case Op::GE_FIX:  setBool(num1 >= num2); break;
+        case Op::NEQ_FIX: setBool(num1 != num2); break;
+        case Op::LT_FIX_BRANCH:  branch(num1 <  num2); break;
+        case Op::LE_FIX_BRANCH:  branch(num1 <= num2); break;
+        case Op::EQ_FIX_BRANCH:  branch(num1 == num2); break;
+        case Op::GT_FIX_BRANCH:  branch(num1 >  num2); break;
+        case Op::GE_FIX_BRANCH:  branch(num1 >= num2); break;
+        case Op::NEQ_FIX_BRANCH: branch(num1 != num2); break;
+        default:{
+            throw std::runtime_error(fmt::format("internal error, unexpected quickened operator {}",  static_cast<int>(instr.getOpCode())));
+        }
+    }
+    // the folded `pop 2`
+    _stack.resize(_stack.size() - 2);
+    return true;
 }
 
 void VirtualMachine::forMemRef(const MemRef& instr) {
@@ -66,7 +215,9 @@ void VirtualMachine::forMemRef(const MemRef& instr) {
 }
 
 void VirtualMachine::forMemSet(const MemSet& instr) {
-    // TODO
+    _stack[instr.getOffSet() + _bp] = std::move(_acc);
+    _acc = _void;
+    _ip  = instr.getNext().get();
 }
 
 void VirtualMachine::forBranch(const Branch& instr) {
@@ -93,31 +244,433 @@ void VirtualMachine::forPop(const Pop& instr) {
 }
 
 void VirtualMachine::forClosure(const Closure& instr) {
-    _acc    = std::make_shared<VM::Closure>(instr.getCode());
+    const auto& caps = instr.getCaptures();
+    std::vector<Value::Ptr> captured;
+    captured.reserve(caps.size());
+    for (const auto& cap: caps) {
+        captured.push_back(cap.kind == CaptureSrc::Kind::Local?
+                _stack[cap.index + _bp]: _clo->_captured[cap.index]);
+    }
+    _acc    = std::make_shared<VM::Closure>(instr.getCode(), instr.getArity(), std::move(captured));
     _ip     = instr.getNext().get();
 }
 
+void VirtualMachine::forClosureRef(const ClosureRef& instr) {
+    _acc    = _clo->_captured[instr.getIndex()];
+    _ip     = instr.getNext().get();
+}
+
+void VirtualMachine::forBoxOp(const BoxOp& instr) {
+    switch (instr.getOpCode()) {
+        case Instr::Op::MakeBox: {
+            _acc = std::make_shared<VM::Box>(std::move(_acc));
+            break;
+        }
+        case Instr::Op::Unbox: {
+            if (_acc->getType() != Value::Type::Box) throw std::runtime_error("VM error: expect a box");
+            _acc = static_cast<VM::Box&>(*_acc)._value;
+            break;
+        }
+        case Instr::Op::SetBox: {
+            if (_stack.back()->getType() != Value::Type::Box) throw std::runtime_error("VM error: expect a box");
+            static_cast<VM::Box&>(*_stack.back())._value = std::move(_acc);
+            _acc = _void;
+            break;
+        }
+        default:{
+            throw std::runtime_error(fmt::format("internal error, unexpected box operator {}",  static_cast<int>(instr.getOpCode())));
+        }
+    }
+    _ip = instr.getNext().get();
+}
+
+void VirtualMachine::forStub(const Stub& instr) {
+    const auto& body = instr.getBody();
+    _ip = body.get();
+    // later calls of the running closure skip the stub
+    if (_clo && _clo->_code.get() == &instr) _clo->_code = body;
+}
+
+void VirtualMachine::forGlobalOp(const GlobalOp& instr) {
+    const auto idx = instr.getIndex();
+    switch (instr.getOpCode()) {
+        case Instr::Op::GlobalRef: {
+            if (idx >= _globals.size() || !_globals[idx]) {
+                throw std::runtime_error(fmt::format("`{}` undefined", instr.getName()));
+            }
+            _acc = _globals[idx];
+            break;
+        }
+        case Instr::Op::GlobalSet: {
+            if (idx >= _globals.size() || !_globals[idx]) {
+                throw std::runtime_error(fmt::format("`{}` undefined", instr.getName()));
+            }
+            _globals[idx] = std::move(_acc);
+            _acc = _void;
+            break;
+        }
+        case Instr::Op::GlobalDef: {
+            if (idx >= _globals.size()) _globals.resize(idx + 1);
+            _globals[idx] = std::move(_acc);
+            _acc = _void;
+            break;
+        }
+        default:{
+            throw std::runtime_error(fmt::format("internal error, unexpected global operator {}",  static_cast<int>(instr.getOpCode())));
+        }
+    }
+    _ip = instr.getNext().get();
+}
+
+void VirtualMachine::forLoop(const Loop& instr) {
+    _ip = instr.getNext().get();
+}
+
+void VirtualMachine::forSwitch(const Switch& instr) {
+    _ip = instr.getTargets()[instr.select(*_acc)].get();
+}
+
+void VirtualMachine::forJump(const Jump& instr) {
+    jumpBack(instr);
+    tick();
+}
+
+void VirtualMachine::jumpBack(const Jump& instr) {
+    // the new values of the loop variables replace the old ones in place
+    const auto from = _stack.size() - instr.getArgc();
+    const auto to   = _bp + instr.getSlot();
+    for (int i = 0; i < instr.getArgc(); ++i) {
+        _stack[to + i] = std::move(_stack[from + i]);
+    }
+    _stack.resize(_stack.size() - instr.getPop());
+    _ip = instr.getLoop()->getNext().get();
+}
+
 void VirtualMachine::forFrame(const Frame& instr) {
     _bps.push_back(_bp);
     _returnAddr.push_back(instr.getRet().get());
+    _closures.push_back(_clo);
 
     _ip = instr.getNext().get();
 }
 
 void VirtualMachine::forCall(const Call& instr) {
-    if (_acc->getType() != Value::Type::Closure) 
+    int argc = instr.getArgc();
+    if (instr.getOpCode() == Instr::Op::CallCC) {
+        captureContinuation();
+        argc = 1;
+    }
+    if (callClosure(argc)) tick();
+}
+
+bool VirtualMachine::callClosure(int argc) {
+    if (_acc->getType() != Value::Type::Closure) {
+        if (_acc->getType() == Value::Type::Continuation) {
+            resumeContinuation(argc);
+            return false;
+        }
         throw std::runtime_error("VM error: expect a closure");
+    }
 
-    auto& clo   = static_cast<VM::Closure&>(*_acc);
+    // the callee's ret pops its own arity, a mismatch would unbalance the stack
+    const auto arity = static_cast<const VM::Closure&>(*_acc)._arity;
+    if (arity != argc) {
+        throw std::length_error(fmt::format("procedure expect {} args, but got {}", arity, argc));
+    }
+    _clo = std::static_pointer_cast<VM::Closure>(_acc);
     _bp = _stack.size();
-    _ip = clo._code.get();
+    _ip = _clo->_code.get();
+    return true;
 }
 
 void VirtualMachine::forRet(const Ret& instr) {
-    auto n = instr.getPop();
+    popFrame(instr.getPop());
+}
+
+void VirtualMachine::popFrame(int n) {
     _stack.resize(_stack.size() - n);
+    if (_bps.empty()) underflow();
     _bp = _bps.back();
     _bps.pop_back();
     _ip = _returnAddr.back();
     _returnAddr.pop_back();
+    _clo = std::move(_closures.back());
+    _closures.pop_back();
+}
+
+void VirtualMachine::checkStructure(const Instr& instr) const {
+    using Op = Instr::Op;
+    auto fail = [&](std::string_view what) {
+        throw std::runtime_error(fmt::format("VM error: {} in {}", what, Instr::to_string(instr.getOpCode())));
+    };
+    auto slot = [&](int off) {
+        if (off + _bp < 0 || size_t(off + _bp) >= _stack.size()) fail("slot outside the stack");
+    };
+    auto need = [&](size_t n) {
+        if (_stack.size() < n + _bp) fail("stack underflow");
+    };
+    auto captured = [&](int idx) {
+        if (!_clo || idx < 0 || size_t(idx) >= _clo->_captured.size()) fail("capture out of range");
+    };
+    auto next = [&](const Instr::Ptr& nxt, Op op) { return nxt && nxt->getOpCode() == op; };
+
+    switch (const auto op = instr.getOpCode()) {
+        case Op::Ref:           slot(static_cast<const MemRef&>(instr).getOffSet()); break;
+        case Op::Set:           slot(static_cast<const MemSet&>(instr).getOffSet()); break;
+        case Op::Pop:           need(static_cast<const Pop&>(instr).getNum()); break;
+        case Op::SetBox:        need(1); break;
+        case Op::ClosureRef:    captured(static_cast<const ClosureRef&>(instr).getIndex()); break;
+        case Op::Closure: {
+            for (const auto& cap: static_cast<const Closure&>(instr).getCaptures()) {
+                if (cap.kind == CaptureSrc::Kind::Local) slot(cap.index);
+                else captured(cap.index);
+            }
+            break;
+        }
+        case Op::Jump: {
+            const auto& jmp = static_cast<const Jump&>(instr);
+            need(jmp.getPop());
+            if (jmp.getPop() < jmp.getArgc() || !jmp.getLoop()) fail("malformed jump");
+            if (jmp.getArgc() > 0) {
+                slot(jmp.getSlot());
+                if (size_t(_bp + jmp.getSlot() + jmp.getArgc()) > _stack.size() - jmp.getPop()) fail("loop slot popped");
+            }
+            break;
+        }
+        case Op::Ret: {
+            const auto n = static_cast<const Ret&>(instr).getPop();
+            if (_bps.empty() && !_below.segment) fail("return without a frame");
+            if (_stack.size() != size_t(_bp) || _bp < n || (!_bps.empty() && _bp < n + _bps.back())) fail("unbalanced frame");
+            break;
+        }
+        default: {
+            if (op < Op::ADD) break;
+            need(Instr::primArity(Instr::generic(op)));
+            if (!Instr::isQuickened(op)) break;
+            const auto& pop = static_cast<const Prim&>(instr).getNext();
+            if (!next(pop, Op::Pop) || static_cast<const Pop&>(*pop).getNum() != 2) fail("quickened primitive without its pop");
+            if (op >= Op::LT_FIX_BRANCH && !next(static_cast<const Pop&>(*pop).getNext(), Op::Branch)) {
+                fail("quickened primitive without its branch");
+            }
+        }
+    }
+}
+
+void VirtualMachine::captureContinuation() {
+    auto seg        = std::make_shared<VM::StackSegment>();
+    seg->stack      = std::move(_stack);
+    seg->bps        = std::move(_bps);
+    seg->returnAddr = std::move(_returnAddr);
+    seg->closures   = std::move(_closures);
+    seg->base       = _base;
+    seg->frameBase  = _frameBase;
+    seg->below      = std::move(_below);
+    seg->entry      = _entry;
+
+    _base       += seg->stack.size();
+    _frameBase  += seg->bps.size();
+    _below      = VM::StackView{std::move(seg), _base, _frameBase};
+    _stack.clear();
+    _bps.clear();
+    _returnAddr.clear();
+    _closures.clear();
+    _stack.push_back(std::make_shared<VM::Continuation>(_below));
+}
+
+void VirtualMachine::resumeContinuation(int argc) {
+    if (argc != 1) throw std::length_error(fmt::format("continuation expect 1 args, but got {}", argc));
+
+    auto view = static_cast<const VM::Continuation&>(*_acc)._view;
+    _acc = std::move(_stack.back());
+    // the running stacks are dropped, unless an other continuation sealed them
+    _stack.clear();
+    _bps.clear();
+    _returnAddr.clear();
+    _closures.clear();
+    _base       = view.stackTop;
+    _frameBase  = view.frames;
+    _entry      = view.segment->entry;
+    _below      = std::move(view);
+    popFrame(0);
+}
+
+// the segment of `view` holding absolute stack position `i`, or frame `i`
+static const VM::StackSegment& holding(const VM::StackView& view, size_t i, bool frame) {
+    const auto* seg = view.segment.get();
+    while (i < (frame? seg->frameBase: seg->base)) seg = seg->below.segment.get();
+    return *seg;
+}
+
+void VirtualMachine::underflow() {
+    while (_bps.empty()) {
+        // skip the segments the view no longer reaches into
+        while (_below.segment && _below.stackTop <= _below.segment->base && _below.frames <= _below.segment->frameBase) {
+            auto next = _below.segment->below.segment;
+            _below.segment = std::move(next);
+        }
+        if (!_below.segment) throw std::runtime_error("VM error: return without a frame");
+
+        auto& seg = *_below.segment;
+        if (_below.segment.use_count() == 1 && _below.stackTop >= seg.base && _below.frames > seg.frameBase) {
+            // nothing can resume the segment any more, it becomes the running stacks again
+            auto own = std::move(_below.segment);
+            own->stack.resize(_below.stackTop - own->base);
+            own->bps.resize(_below.frames - own->frameBase);
+            own->returnAddr.resize(own->bps.size());
+            own->closures.resize(own->bps.size());
+            std::move(_stack.begin(), _stack.end(), std::back_inserter(own->stack));
+
+            _stack      = std::move(own->stack);
+            _bps        = std::move(own->bps);
+            _returnAddr = std::move(own->returnAddr);
+            _closures   = std::move(own->closures);
+            _base       = own->base;
+            _frameBase  = own->frameBase;
+            _below      = std::move(own->below);
+            continue;
+        }
+
+        // shared: copy the top frame, and the values of the activation it returns to
+        const auto  f       = _below.frames - 1;
+        const auto& fseg    = holding(_below, f, true);
+        const auto  bp      = fseg.base + fseg.bps[f - fseg.frameBase];
+        const auto& clo     = fseg.closures[f - fseg.frameBase];
+        const auto  from    = bp - (clo? clo->_arity: bp); // top level frames own everything below
+
+        if (from < _base) {
+            std::vector<Value::Ptr> vals;
+            vals.reserve(_base - from + _stack.size());
+            for (size_t i = from; i < _base; ) {
+                const auto& vseg = holding(_below, i, false);
+                const auto  end  = std::min(_base, vseg.base + vseg.stack.size());
+                vals.insert(vals.end(), vseg.stack.begin() + (i - vseg.base), vseg.stack.begin() + (end - vseg.base));
+                i = end;
+            }
+            std::move(_stack.begin(), _stack.end(), std::back_inserter(vals));
+            _stack          = std::move(vals);
+            _base           = from;
+            _below.stackTop = from;
+        }
+        _bps.push_back(bp - _base);
+        _returnAddr.push_back(fseg.returnAddr[f - fseg.frameBase]);
+        _closures.push_back(clo);
+        _frameBase      = f;
+        _below.frames   = f;
+    }
 }
+
+// a spawned thread calls its thunk, then halts
+static Instr& spawnEntry() {
+    static const Instr::Ptr entry = Instr::New<Frame>(Instr::New<Halt>(), Instr::New<Call>(0));
+    return *entry;
+}
+
+void VirtualMachine::forThreadOp(const Prim& instr) {
+    using Op = Instr::Op;
+    auto channel = [](const Value::Ptr& v) -> VM::Channel& {
+        if (v->getType() != Value::Type::Channel) {
+            throw std::runtime_error(fmt::format("expect a {}, but got {}", typeStr(Value::Type::Channel), typeStr(v->getType())));
+        }
+        return static_cast<VM::Channel&>(*v);
+    };
+
+    // a thread switched away from resumes here
+    _ip = instr.getNext().get();
+    switch (instr.getOpCode()) {
+        case Op::SPAWN: {
+            const auto& thunk = _stack.back();
+            if (thunk->getType() != Value::Type::Closure || static_cast<const VM::Closure&>(*thunk)._arity != 0) {
+                throw std::invalid_argument("spawn expect a procedure of no args");
+            }
+            auto t  = std::make_unique<GreenThread>();
+            t->id   = ++_lastTid;
+            t->ip   = &spawnEntry();
+            t->acc  = thunk;
+            _ready.push_back(std::move(t));
+            _acc = _void;
+            break;
+        }
+        case Op::YIELD: {
+            _acc = _void;
+            if (!_ready.empty()) preempt();
+            break;
+        }
+        case Op::MAKECHAN: {
+            _acc = std::make_shared<VM::Channel>();
+            break;
+        }
+        case Op::SEND: {
+            auto& ch = channel(*(_stack.rbegin() + 1));
+            _acc = _void;
+            // straight to the oldest receiver, unless reset() dropped it
+            while (!ch._receivers.empty()) {
+                auto it = _blocked.find(ch._receivers.front());
+                ch._receivers.pop_front();
+                if (it == _blocked.end()) continue;
+                it->second->acc = _stack.back();
+                _ready.push_back(std::move(it->second));
+                _blocked.erase(it);
+                return;
+            }
+            ch._items.push_back(_stack.back());
+            break;
+        }
+        case Op::RECV: {
+            auto& ch = channel(_stack.back());
+            if (!ch._items.empty()) {
+                _acc = std::move(ch._items.front());
+                ch._items.pop_front();
+                break;
+            }
+            // parked until a send hands over the value in acc
+            ch._receivers.push_back(_tid);
+            auto self = std::make_unique<GreenThread>();
+            swapContext(*self);
+            _blocked.emplace(self->id, std::move(self));
+            schedule();
+            break;
+        }
+        default:{
+            throw std::runtime_error(fmt::format("internal error, unexpected thread operator {}",  static_cast<int>(instr.getOpCode())));
+        }
+    }
+}
+
+void VirtualMachine::preempt() {
+    auto next = std::move(_ready.front());
+    _ready.pop_front();
+    swapContext(*next);
+    _ready.push_back(std::move(next));
+    _budget = SliceBudget;
+}
+
+void VirtualMachine::schedule() {
+    ThreadPtr next;
+    if (!_ready.empty()) {
+        next = std::move(_ready.front());
+        _ready.pop_front();
+    } else if (_halted) {
+        next = std::move(_halted);
+    } else {
+        throw std::runtime_error("deadlock: every thread is blocked");
+    }
+    swapContext(*next); // `next` keeps the finished or parked context, dropped here
+    _budget = SliceBudget;
+}
+
+void VirtualMachine::swapContext(GreenThread& t) {
+    std::swap(_tid, t.id);
+    std::swap(_stack, t.stack);
+    std::swap(_bps, t.bps);
+    std::swap(_returnAddr, t.returnAddr);
+    std::swap(_closures, t.closures);
+    std::swap(_bp, t.bp);
+    std::swap(_ip, t.ip);
+    std::swap(_acc, t.acc);
+    std::swap(_clo, t.clo);
+    std::swap(_base, t.base);
+    std::swap(_frameBase, t.frameBase);
+    std::swap(_below, t.below);
+    std::swap(_entry, t.entry);
+}
+
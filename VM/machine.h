@@ -1,7 +1,29 @@
 #pragma once
 
 #include "bytecode.h"
+#include "profile.h"
+#include "verifier.h"
 
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+
+// the bottom of the VM stacks, sealed when call/cc captured a continuation
+// above it and shared with the continuation from then on. Returns into it
+// bring their frame back into the running stacks, see
+// VirtualMachine::underflow
+struct VM::StackSegment {
+    std::vector<Value::Ptr>                     stack;
+    std::vector<int>                            bps; // relative to `base`
+    std::vector<Instr*>                         returnAddr;
+    std::vector<std::shared_ptr<VM::Closure>>   closures;
+    size_t                                      base{0}; // absolute position of stack[0]
+    size_t                                      frameBase{0}; // and of bps[0]
+    StackView                                   below;
+    Instr::Ptr                                  entry; // top level code the frames may return into
+};
 
 class VirtualMachine: public InstrVisitor {
 public:
@@ -13,17 +35,54 @@ public:
 
     const Value* getResult() const { return _acc.get(); }
 
-    Value::Ptr execute(Instr&  instr) {
-        _ip = &instr;
-        while (_ip) {
-            _ip->accept(*this);
-        }
-        return _acc;
+    // the code this VM runs is run by other isolates at the same time: it is
+    // never rewritten (quickened) while running, see Optimizer::quickenAll
+    void shareCode() { _sharedCode = true; }
+
+    // drop the frames and green threads an error left behind, globals are kept
+    void reset() {
+        _stack.clear();
+        _bps.clear();
+        _returnAddr.clear();
+        _closures.clear();
+        _bp     = 0;
+        _clo    = nullptr;
+        _base   = 0;
+        _frameBase = 0;
+        _below  = {};
+        _entry  = nullptr;
+        _tid    = MainThread;
+        _ready.clear();
+        _blocked.clear();
+        _halted = nullptr;
     }
 
+    // unverified code, every instruction is checked against the invariants
+    // Verifier proves before it runs. Continuations captured by `instr` only
+    // stay valid as long as the caller keeps it alive
+    Value::Ptr execute(Instr&  instr) { return run<true>(instr); }
+    // verified code skips the structural checks, only the dynamic type checks
+    // (closure to call, boolean to branch on, operands of primitives) stay
+    Value::Ptr execute(const Verifier::Verified& code) {
+        _entry = code.getEntry();
+        return run<false>(code.entry());
+    }
+
+#ifdef SCHEMER_PROFILE_OPS
+    static constexpr bool CanProfile = true;
+#else
+    static constexpr bool CanProfile = false;
+#endif
+    // prims rewritten to their fixnum forms and reverted, by all VMs
+    static size_t quickenedPrims() { return s_quickened.load(std::memory_order_relaxed); }
+    static size_t deoptedPrims() { return s_deopts.load(std::memory_order_relaxed); }
+
+    // count executed instructions into `profile`, only when CanProfile
+    void setProfile(OpProfile* profile) { _profile = profile; }
+
 private:
     virtual void forHalt(const Halt&) override;
-    virtual void forImm(const Imm&) override;
+    virtual void forConst(const Const&) override;
     virtual void forPrim(const Prim&) override;
     virtual void forMemRef(const MemRef&) override;
     virtual void forMemSet(const MemSet&) override;
@@ -34,14 +93,132 @@ private:
     virtual void forFrame(const Frame&) override;
     virtual void forCall(const Call&) override;
     virtual void forRet(const Ret&) override;
+    virtual void forClosureRef(const ClosureRef&) override;
+    virtual void forBoxOp(const BoxOp&) override;
+    virtual void forStub(const Stub&) override;
+    virtual void forGlobalOp(const GlobalOp&) override;
+    virtual void forLoop(const Loop&) override;
+    virtual void forJump(const Jump&) override;
+    virtual void forSwitch(const Switch&) override;
+
+    template<bool Checked>
+    Value::Ptr run(Instr& instr) {
+        _ip      = &instr;
+#ifdef SCHEMER_PROFILE_OPS
+        if (_profile) {
+            while (_ip) {
+                const auto& cur = *_ip;
+                const auto op   = cur.getOpCode();
+                const auto t0   = OpProfile::now();
+                if constexpr (Checked) checkStructure(cur);
+                _ip->accept(*this);
+                _profile->record(cur, op, OpProfile::now() - t0);
+            }
+            _profile->breakSequence();
+            return _acc;
+        }
+#endif
+        while (_ip) {
+            if constexpr (Checked) checkStructure(*_ip);
+            _ip->accept(*this);
+        }
+        return _acc;
+    }
+    void checkStructure(const Instr&) const; // throws if `instr` would break the stack or a frame
+
+    // Const: the value from this VM's own copy of the program's pool. The
+    // pooled values are shared by every isolate, copying them into acc would
+    // bump counts on cache lines all threads write to
+    const Value::Ptr& constant(const Const&);
+    bool forQuickPrim(const Prim&); // false if the guard failed and instr was reverted
+    void quicken(const Prim&);
+    void applyPrim(Instr::Op op); // acc = op applied to the top two stack slots
+    bool callClosure(int argc); // enter the closure in acc, false if it was a continuation and got resumed
+    void popFrame(int n); // drop n args and return to the caller
+    void jumpBack(const Jump&); // a loop's next iteration, without the budget tick
+
+    // call/cc: capturing seals the running stacks into a StackSegment, O(1).
+    // A return below the seal takes the segment back whole if nothing else
+    // holds it (one-shot and escaping continuations), else copies just the
+    // frame returned to and the values of its activation
+    void captureContinuation(); // passes the continuation as the only arg
+    void resumeContinuation(int argc);
+    void underflow(); // the frame to return to is below `_base`
+
+    // Green threads: spawn/yield/channel primitives, all on the OS thread of
+    // this VM. The running thread lives in the registers and stacks below,
+    // the others are parked as a GreenThread. A thread runs until it blocks,
+    // yields, halts or has made `SliceBudget` calls and loop jumps: these are
+    // the only backward edges of the instruction graph
+    struct GreenThread {
+        uint64_t                                id;
+        std::vector<Value::Ptr>                 stack;
+        std::vector<int>                        bps;
+        std::vector<Instr*>                     returnAddr;
+        std::vector<std::shared_ptr<VM::Closure>> closures;
+        int                                     bp{0};
+        size_t                                  base{0}, frameBase{0};
+        VM::StackView                           below;
+        Instr::Ptr                              entry;
+        Instr*                                  ip{nullptr};
+        Value::Ptr                              acc;
+        std::shared_ptr<VM::Closure>            clo;
+    };
+    using ThreadPtr = std::unique_ptr<GreenThread>;
+    static constexpr uint64_t MainThread  = 0; // the one that entered execute
+    static constexpr int      SliceBudget = 1000;
+
+    void forThreadOp(const Prim&);
+    // counts a call or jump, true if the slice is used up and another thread runs now
+    bool tick() {
+        if (_ready.empty() || --_budget > 0) return false;
+        preempt();
+        return true;
+    }
+    void preempt(); // the running thread goes to the back of the ready queue
+    void swapContext(GreenThread& t);
+    void schedule(); // the running thread was parked or finished, continue another
+    using ClosurePtr = std::shared_ptr<VM::Closure>;
 
     std::vector<Value::Ptr>             _stack; // evalution stack
-    std::vector<int>                    _bps; // statck base pointers of call frames
+    std::vector<int>                    _bps; // statck base pointers of call frames, relative to _stack
     std::vector<Instr*>                 _returnAddr; 
+    std::vector<ClosurePtr>             _closures; // running closures of call frames
+    std::vector<Value::Ptr>             _globals; // by GlobalTable index, nullptr until defined
+    struct LocalPool {
+        ConstPool::Ptr                  pool; // keeps the key alive
+        std::vector<Value::Ptr>         values; // by pool index, copied on first use
+    };
+    std::unordered_map<const ConstPool*, LocalPool> _localPools;
+    LocalPool*                          _localPool{nullptr}; // of the last Const run
+    // owned by this VM like its copies of the constants, acc = _void never
+    // touches a count other isolates write to
+    const Value::Ptr                    _void{Void::make()};
+    const Value::Ptr                    _true{std::make_shared<Boolean>(true)};
+    const Value::Ptr                    _false{std::make_shared<Boolean>(false)};
 
     //registers
     int                                 _bp; // stack base pointer
     //int                                 _sp; // stack top pointer
     Instr*                              _ip; // instruction pointer
     Value::Ptr                          _acc; //accumulator
+    ClosurePtr                          _clo; // running closure, holds the captured values
+
+    size_t                              _base{0}; // absolute position of _stack[0]
+    size_t                              _frameBase{0}; // and of _bps[0]
+    VM::StackView                       _below; // sealed stacks under the running ones
+    Instr::Ptr                          _entry; // top level code running, kept alive by continuations
+
+    uint64_t                            _tid{MainThread}; // running green thread
+    uint64_t                            _lastTid{MainThread};
+    int                                 _budget{SliceBudget}; // calls and jumps left in the slice
+    std::deque<ThreadPtr>               _ready; // runnable, besides the running one
+    std::unordered_map<uint64_t, ThreadPtr> _blocked; // in recv, see VM::Channel::_receivers
+    ThreadPtr                           _halted; // the main thread, done while others still run
+
+    OpProfile*                          _profile{nullptr};
+    bool                                _sharedCode{false};
+
+    static std::atomic<size_t>          s_quickened;
+    static std::atomic<size_t>          s_deopts;
 };
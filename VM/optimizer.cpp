@@ -0,0 +1,194 @@
+#include "optimizer.h"
+
+#include <optional>
+#include <unordered_set>
+
+using namespace std;
+
+using Op = Instr::Op;
+
+Optimizer::Optimizer(int level): _level(level) {
+    if (level >= 1) {
+        _passes = {
+            {"fold-constants",      foldConstants},
+            {"fold-branches",       foldBranches},
+            {"thread-jumps",        threadJumps},
+            {"cancel-push-pop",     cancelPushPop},
+            {"drop-dead-writes",    dropDeadWrites},
+        };
+    }
+}
+
+Instr::Ptr Optimizer::run(Instr::Ptr entry) const {
+    // folding exposes new branches on constants and vice versa, iterate
+    // the pipeline until it settles
+    for (bool changed = !_passes.empty(); changed; ) {
+        changed = false;
+        for (const auto& [_, pass]: _passes) {
+            changed |= runPass(pass, entry);
+        }
+    }
+    return entry;
+}
+
+bool Optimizer::runPass(Pass pass, Instr::Ptr& entry) const {
+    bool changed = false;
+    unordered_set<Instr*> visited;
+    vector<Instr::Ptr*> worklist{&entry};
+    while (!worklist.empty()) {
+        auto slot = worklist.back();
+        worklist.pop_back();
+
+        while (pass(*slot)) changed = true;
+
+        if (!visited.insert(slot->get()).second) continue;
+        for (auto succ: successorSlots(**slot)) {
+            worklist.push_back(succ);
+        }
+    }
+    return changed;
+}
+
+static bool isPrim(Op op) { return op >= Op::ADD && op <= Op::NEQ; }
+
+Instr::Ptr Optimizer::quickenAll(Instr::Ptr entry) {
+    unordered_set<const Instr*> visited;
+    vector<const Instr*> worklist{entry.get()};
+    while (!worklist.empty()) {
+        auto instr = worklist.back();
+        worklist.pop_back();
+        if (!visited.insert(instr).second) continue;
+
+        const auto op = instr->getOpCode();
+        if (isPrim(op)) {
+            const auto& nxt = *static_cast<const Prim&>(*instr).getNext();
+            if (nxt.getOpCode() == Op::Pop && static_cast<const Pop&>(nxt).getNum() == 2) {
+                instr->rewrite(Instr::fixnumForm(op, static_cast<const Pop&>(nxt).getNext()->getOpCode() == Op::Branch));
+            }
+        }
+        for (auto succ: successorsOf(*instr)) worklist.push_back(succ);
+    }
+    return entry;
+}
+
+static const Value* constValue(const Instr& instr) {
+    return instr.getOpCode() == Op::Const? static_cast<const Const&>(instr).getVal().get(): nullptr;
+}
+
+// same result as VirtualMachine::forPrim, nullopt if that would throw or overflow
+static optional<Value::Ptr> evalPrim(Op op, const Value& v1, const Value& v2) {
+    if (v1.getType() != Value::Type::Number || v2.getType() != Value::Type::Number) return nullopt;
+
+    const auto a = static_cast<const Number&>(v1).value_;
+    const auto b = static_cast<const Number&>(v2).value_;
+    Number::Type r;
+    switch (op) {
+        case Op::ADD: if (__builtin_add_overflow(a, b, &r)) return nullopt; break;
+        case Op::SUB: if (__builtin_sub_overflow(a, b, &r)) return nullopt; break;
+        case Op::MUL: if (__builtin_mul_overflow(a, b, &r)) return nullopt; break;
+        case Op::DIV: if (b == 0 || b == -1) return nullopt; r = a / b; break;
+        case Op::MOD: if (b == 0 || b == -1) return nullopt; r = a % b; break;
+        case Op::LT:  return make_shared<Boolean>(a < b);
+        case Op::LE:  return make_shared<Boolean>(a <= b);
+        case Op::EQ:  return make_shared<Boolean>(a == b);
+        case Op::GT:  return make_shared<Boolean>(a > b);
+        case Op::GE:  return make_shared<Boolean>(a >= b);
+        case Op::NEQ: return make_shared<Boolean>(a != b);
+        default:      return nullopt;
+    }
+    return make_shared<Number>(r);
+}
+
+bool Optimizer::foldConstants(Instr::Ptr& slot) {
+    const Instr* it = slot.get();
+    auto a = constValue(*it);
+    if (!a) return false;
+    auto pool = static_cast<const Const&>(*it).getPool();
+
+    it = static_cast<const Const&>(*it).getNext().get();
+    if (it->getOpCode() != Op::Push) return false;
+    it = static_cast<const Push&>(*it).getNext().get();
+
+    auto b = constValue(*it);
+    if (!b) return false;
+    it = static_cast<const Const&>(*it).getNext().get();
+    if (it->getOpCode() != Op::Push) return false;
+    it = static_cast<const Push&>(*it).getNext().get();
+
+    if (!isPrim(it->getOpCode())) return false;
+    auto op = it->getOpCode();
+    it = static_cast<const Prim&>(*it).getNext().get();
+    if (it->getOpCode() != Op::Pop || static_cast<const Pop&>(*it).getNum() != 2) return false;
+
+    auto res = evalPrim(op, *a, *b);
+    if (!res) return false;
+    slot = Instr::New<Const>(std::move(pool), *res, static_cast<const Pop&>(*it).getNext());
+    return true;
+}
+
+bool Optimizer::foldBranches(Instr::Ptr& slot) {
+    auto val = constValue(*slot);
+    if (!val || val->getType() != Value::Type::Boolean) return false;
+
+    auto& next = static_cast<Const&>(*slot).getNext();
+    if (next->getOpCode() != Op::Branch) return false;
+
+    // valid for every predecessor of the const, so patch it in place
+    auto& br = static_cast<Branch&>(*next);
+    next = static_cast<const Boolean&>(*val).value_? br.getTrue(): br.getFalse();
+    return true;
+}
+
+bool Optimizer::threadJumps(Instr::Ptr& slot) {
+    if (slot->getOpCode() != Op::Branch) return false;
+
+    bool changed = false;
+    auto& br = static_cast<Branch&>(*slot);
+    for (auto arm: {&br.getTrue(), &br.getFalse()}) {
+        while ((*arm)->getOpCode() == Op::Branch && arm->get() != slot.get()) {
+            auto& inner = static_cast<Branch&>(**arm);
+            *arm = arm == &br.getTrue()? inner.getTrue(): inner.getFalse();
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+bool Optimizer::cancelPushPop(Instr::Ptr& slot) {
+    if (slot->getOpCode() != Op::Push) return false;
+
+    // instructions between push and pop only set acc, clone them so that
+    // other paths through the shared pop are left alone
+    vector<const Const*> between;
+    const Instr* it = static_cast<const Push&>(*slot).getNext().get();
+    while (it->getOpCode() == Op::Const) {
+        between.push_back(static_cast<const Const*>(it));
+        it = between.back()->getNext().get();
+    }
+    if (it->getOpCode() != Op::Pop) return false;
+
+    const auto& pop = static_cast<const Pop&>(*it);
+    Instr::Ptr code = pop.getNum() > 1? Instr::New<Pop>(pop.getNum() - 1, pop.getNext()): pop.getNext();
+    for (auto rit = between.rbegin(); rit != between.rend(); ++rit) {
+        code = Instr::New<Const>((*rit)->getPool(), (*rit)->getIndex(), std::move(code));
+    }
+    slot = std::move(code);
+    return true;
+}
+
+bool Optimizer::dropDeadWrites(Instr::Ptr& slot) {
+    auto writesAcc = [](const Instr& instr) {
+        auto op = instr.getOpCode();
+        return op == Op::Const || op == Op::Ref || op == Op::Closure || op == Op::ClosureRef;
+    };
+    if (!writesAcc(*slot)) return false;
+
+    const auto& next = *successorsOf(*slot).back();
+    if (!writesAcc(next)) return false;
+
+    slot = slot->getOpCode() == Op::Const?        static_cast<Const&>(*slot).getNext():
+           slot->getOpCode() == Op::Ref?        static_cast<MemRef&>(*slot).getNext():
+           slot->getOpCode() == Op::ClosureRef? static_cast<ClosureRef&>(*slot).getNext():
+                                                static_cast<Closure&>(*slot).getNext();
+    return true;
+}
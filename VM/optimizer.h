@@ -0,0 +1,41 @@
+#pragma once
+
+#include "bytecode.h"
+
+#include <string_view>
+#include <vector>
+
+// peephole passes over a compiled instruction graph. Every pass looks at the
+// instruction held in one slot and rewrites that slot (or the instruction
+// itself, when the rewrite is valid for all of its predecessors).
+class Optimizer {
+public:
+    using Pass = bool(*)(Instr::Ptr& slot); // true if the slot was rewritten
+
+    explicit Optimizer(int level = 1);
+
+    Instr::Ptr run(Instr::Ptr entry) const;
+    int getLevel() const { return _level; }
+
+    // const a; push; const b; push; <op>; pop 2   =>   const (a <op> b)
+    static bool foldConstants(Instr::Ptr& slot);
+    // const #t/#f; branch t f   =>   const #t/#f; t or f, the other arm is dropped
+    static bool foldBranches(Instr::Ptr& slot);
+    // branch (branch t2 f2) f   =>   branch t2 f, the predicate is still in acc
+    static bool threadJumps(Instr::Ptr& slot);
+    // push; pop n   =>   pop n-1, also across instructions only writing acc
+    static bool cancelPushPop(Instr::Ptr& slot);
+    // const/mref/closure immediately overwritten by another acc write
+    static bool dropDeadWrites(Instr::Ptr& slot);
+
+    // every arithmetic and comparison in its fixnum form up front, for code
+    // run by isolates which don't quicken it while it runs (see
+    // VirtualMachine::shareCode). The guards still fall back on other values
+    static Instr::Ptr quickenAll(Instr::Ptr entry);
+
+private:
+    bool runPass(Pass pass, Instr::Ptr& entry) const;
+
+    int                                             _level;
+    std::vector<std::pair<std::string_view, Pass>>  _passes;
+};
@@ -0,0 +1,140 @@
+#include "profile.h"
+
+#include "fmt/format.h"
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+using namespace std;
+
+using Op = Instr::Op;
+
+OpProfile::Class OpProfile::classOf(Op op) {
+    switch (op) {
+        case Op::Const:
+        case Op::Ref:
+        case Op::ClosureRef:
+        case Op::GlobalRef:
+        case Op::CAR:
+        case Op::CDR:           return Class::Load;
+        case Op::Set:
+        case Op::GlobalSet:
+        case Op::GlobalDef:     return Class::Store;
+        case Op::Push:
+        case Op::Pop:           return Class::Stack;
+        case Op::Halt:
+        case Op::Branch:
+        case Op::Frame:
+        case Op::Call:
+        case Op::CallCC:
+        case Op::Ret:
+        case Op::Stub:
+        case Op::Loop:
+        case Op::Jump:
+        case Op::Switch:
+        case Op::SPAWN:
+        case Op::YIELD:
+        case Op::SEND:
+        case Op::RECV:          return Class::Control;
+        case Op::Closure:
+        case Op::MakeBox:
+        case Op::CONS:
+        case Op::MAKECHAN:      return Class::Alloc;
+        case Op::Unbox:
+        case Op::SetBox:        return Class::Box;
+        default:                return Class::Arith;
+    }
+}
+
+string_view OpProfile::to_string(Class cls) {
+    switch (cls) {
+        case Class::Load:       return "load";
+        case Class::Store:      return "store";
+        case Class::Stack:      return "stack";
+        case Class::Arith:      return "arith";
+        case Class::Control:    return "control";
+        case Class::Alloc:      return "alloc";
+        case Class::Box:        return "box";
+        default:                return "?";
+    }
+}
+
+uint64_t OpProfile::now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+namespace {
+
+// indices of the `top` largest counts, largest first
+template<typename Counts>
+vector<size_t> hottest(const Counts& counts, size_t top) {
+    vector<size_t> idx;
+    for (size_t i = 0; i < counts.size(); ++i) {
+        if (counts[i]) idx.push_back(i);
+    }
+    auto n = min(top, idx.size());
+    partial_sort(idx.begin(), idx.begin() + n, idx.end(),
+            [&](size_t a, size_t b) { return counts[a] > counts[b]; });
+    idx.resize(n);
+    return idx;
+}
+
+string_view opName(size_t op) { return Instr::to_string(static_cast<Op>(op)); }
+
+} // namespace
+
+void OpProfile::report(ostream& os, size_t top) const {
+    uint64_t total = 0;
+    for (auto n: _ops) total += n;
+    if (!total) return;
+    auto share = [&](uint64_t n) { return 100.0 * n / total; };
+
+    os << fmt::format("== opcodes ({} executed) ==\n", total);
+    for (auto op: hottest(_ops, NumOps)) {
+        os << fmt::format("{:>14} {:6.2f}%  {}\n", _ops[op], share(_ops[op]), opName(op));
+    }
+
+    os << "\n== opcode classes ==\n";
+    for (size_t c = 0; c < NumClasses; ++c) {
+        if (!_classOps[c]) continue;
+        os << fmt::format("{:>14} {:6.2f}%  {:<8} {:8.1f} cycles/op\n", _classOps[c], share(_classOps[c]),
+                to_string(static_cast<Class>(c)), double(_classCycles[c]) / _classOps[c]);
+    }
+
+    os << "\n== hottest pairs ==\n";
+    for (auto p: hottest(_pairs, top)) {
+        os << fmt::format("{:>14} {:6.2f}%  {} {}\n", _pairs[p], share(_pairs[p]),
+                opName(p / NumOps), opName(p % NumOps));
+    }
+
+    os << "\n== hottest triples ==\n";
+    vector<pair<size_t, uint64_t>> triples(_triples.begin(), _triples.end());
+    auto ntriples = min(top, triples.size());
+    partial_sort(triples.begin(), triples.begin() + ntriples, triples.end(),
+            [](const auto& a, const auto& b) { return a.second > b.second; });
+    for (size_t i = 0; i < ntriples; ++i) {
+        auto [t, n] = triples[i];
+        os << fmt::format("{:>14} {:6.2f}%  {} {} {}\n", n, share(n),
+                opName(t / NumOps / NumOps), opName(t / NumOps % NumOps), opName(t % NumOps));
+    }
+
+    os << "\n== hottest instructions ==\n";
+    vector<pair<const Instr*, Counted>> instrs(_instrs.begin(), _instrs.end());
+    auto ninstrs = min(top, instrs.size());
+    partial_sort(instrs.begin(), instrs.begin() + ninstrs, instrs.end(),
+            [](const auto& a, const auto& b) { return a.second.count > b.second.count; });
+    for (size_t i = 0; i < ninstrs; ++i) {
+        auto [instr, counted] = instrs[i];
+        os << fmt::format("{:>14} {:6.2f}%  {}  {}\n", counted.count, share(counted.count),
+                static_cast<const void*>(instr), Instr::to_string(counted.op));
+    }
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "bytecode.h"
+
+#include <array>
+#include <cstdint>
+#include <ostream>
+#include <unordered_map>
+
+// execution counts of the VM, filled in by VirtualMachine::execute when it
+// is built with SCHEMER_PROFILE_OPS (cmake -DSCHEMER_PROFILE_OPS=ON)
+class OpProfile {
+public:
+    enum class Class { Load, Store, Stack, Arith, Control, Alloc, Box, Count };
+
+    static constexpr size_t NumOps      = static_cast<size_t>(Instr::Op::NEQ_FIX_BRANCH) + 1;
+    static constexpr size_t NumClasses  = static_cast<size_t>(Class::Count);
+
+    static Class classOf(Instr::Op op);
+    static std::string_view to_string(Class cls);
+
+    // cycle counter, rdtsc where available
+    static uint64_t now();
+
+    // `op` is the opcode before running, quickening may have changed it since
+    void record(const Instr& instr, Instr::Op op, uint64_t cycles) {
+        const auto o = static_cast<size_t>(op);
+        ++_ops[o];
+        auto& counted = _instrs[&instr];
+        counted.op = op;
+        ++counted.count;
+        if (_prev2 < NumOps) ++_triples[(_prev2 * NumOps + _prev) * NumOps + o];
+        if (_prev < NumOps) ++_pairs[_prev * NumOps + o];
+        _prev2  = _prev;
+        _prev   = o;
+
+        const auto c = static_cast<size_t>(classOf(op));
+        ++_classOps[c];
+        _classCycles[c] += cycles;
+    }
+
+    // the next instruction does not follow the last recorded one
+    void breakSequence() { _prev = _prev2 = NumOps; }
+
+    uint64_t countOf(const Instr* instr) const {
+        auto it = _instrs.find(instr);
+        return it != _instrs.end()? it->second.count: 0;
+    }
+
+    // opcode, class, pair/triple and instruction tables, `top` rows each
+    void report(std::ostream& os, size_t top = 10) const;
+
+private:
+    // the op is kept, instructions may be gone when the report is printed
+    struct Counted { Instr::Op op; uint64_t count{0}; };
+
+    std::array<uint64_t, NumOps>                    _ops{};
+    std::array<uint64_t, NumOps * NumOps>           _pairs{};
+    std::unordered_map<size_t, uint64_t>            _triples;
+    std::unordered_map<const Instr*, Counted>       _instrs;
+    std::array<uint64_t, NumClasses>                _classOps{}, _classCycles{};
+    size_t                                          _prev{NumOps}, _prev2{NumOps};
+};
@@ -0,0 +1,256 @@
+#include "verifier.h"
+
+#include "fmt/format.h"
+
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+using Op = Instr::Op;
+
+namespace {
+
+// abstract machine state before an instruction
+struct State {
+    int         depth{0}; // slots above bp
+    vector<int> frames; // depths at the frames whose call is still ahead
+
+    bool operator==(const State& s) const { return depth == s.depth && frames == s.frames; }
+};
+
+// a lambda body, or the top level expression
+struct Body {
+    const Instr*    entry;
+    int             arity; // from the closure instruction, -1 at top level
+    size_t          ncaps;
+};
+
+class Walker {
+public:
+    void run(const Instr* entry, int arity = -1, size_t ncaps = 0) {
+        _bodies.push_back(Body{entry, arity, ncaps});
+        while (!_bodies.empty()) {
+            auto body = _bodies.back();
+            _bodies.pop_back();
+            walk(body);
+        }
+    }
+
+private:
+    [[noreturn]] static void fail(const Instr& at, string_view what) {
+        throw runtime_error(fmt::format("{} at {} ({})", what, static_cast<const void*>(&at),
+                    Instr::to_string(at.getOpCode())));
+    }
+
+    // every closure over a body must agree on its shape
+    void addBody(const Instr& at, const Closure& clo) {
+        if (!clo.getCode()) fail(at, "missing closure body");
+        auto [it, added] = _shapes.emplace(clo.getCode().get(), make_pair(clo.getArity(), clo.getCaptures().size()));
+        if (!added) {
+            if (it->second != make_pair(clo.getArity(), clo.getCaptures().size())) {
+                fail(at, "closures of different shapes share a body");
+            }
+            return;
+        }
+        if (clo.getArity() < 0) fail(at, "negative arity");
+        _bodies.push_back(Body{clo.getCode().get(), clo.getArity(), clo.getCaptures().size()});
+    }
+
+    void walk(const Body& body) {
+        const bool top = body.arity < 0;
+        unordered_map<const Instr*, State> seen;
+        vector<pair<const Instr*, State>> work{{body.entry, State{}}};
+
+        while (!work.empty()) {
+            auto [instr, st] = std::move(work.back());
+            work.pop_back();
+
+            auto [it, added] = seen.emplace(instr, st);
+            if (!added) {
+                if (!(it->second == st)) {
+                    fail(*instr, fmt::format("reached with stack depths {} and {}", it->second.depth, st.depth));
+                }
+                continue;
+            }
+
+            auto next = [&](const Instr::Ptr& succ, State s) {
+                if (!succ) fail(*instr, "missing successor");
+                work.emplace_back(succ.get(), std::move(s));
+            };
+            // values above the innermost pending frame, or above bp
+            auto need = [&](int n) {
+                const int floor = st.frames.empty()? 0: st.frames.back();
+                if (st.depth - floor < n) fail(*instr, fmt::format("needs {} stack values, has {}", n, st.depth - floor));
+            };
+            auto slot = [&](int off) {
+                if (off >= st.depth || off < (top? 0: -body.arity)) {
+                    fail(*instr, fmt::format("slot {} outside the frame", off));
+                }
+            };
+
+            switch (instr->getOpCode()) {
+                case Op::Const:     next(static_cast<const Const&>(*instr).getNext(), st); break;
+                case Op::Ref: {
+                    const auto& ref = static_cast<const MemRef&>(*instr);
+                    slot(ref.getOffSet());
+                    next(ref.getNext(), st);
+                    break;
+                }
+                case Op::Set: {
+                    const auto& set = static_cast<const MemSet&>(*instr);
+                    slot(set.getOffSet());
+                    next(set.getNext(), st);
+                    break;
+                }
+                case Op::Push: {
+                    auto s = st;
+                    ++s.depth;
+                    next(static_cast<const Push&>(*instr).getNext(), std::move(s));
+                    break;
+                }
+                case Op::Pop: {
+                    const auto& pop = static_cast<const Pop&>(*instr);
+                    need(pop.getNum());
+                    auto s = st;
+                    s.depth -= pop.getNum();
+                    next(pop.getNext(), std::move(s));
+                    break;
+                }
+                case Op::Branch: {
+                    const auto& br = static_cast<const Branch&>(*instr);
+                    next(br.getTrue(), st);
+                    next(br.getFalse(), st);
+                    break;
+                }
+                case Op::Switch: {
+                    for (const auto& t: static_cast<const Switch&>(*instr).getTargets()) next(t, st);
+                    break;
+                }
+                case Op::Closure: {
+                    const auto& clo = static_cast<const Closure&>(*instr);
+                    for (const auto& cap: clo.getCaptures()) {
+                        if (cap.kind == CaptureSrc::Kind::Local) slot(cap.index);
+                        else if (cap.index < 0 || size_t(cap.index) >= body.ncaps) fail(*instr, "capture out of range");
+                    }
+                    addBody(*instr, clo);
+                    next(clo.getNext(), st);
+                    break;
+                }
+                case Op::ClosureRef: {
+                    const auto& ref = static_cast<const ClosureRef&>(*instr);
+                    if (ref.getIndex() < 0 || size_t(ref.getIndex()) >= body.ncaps) fail(*instr, "capture out of range");
+                    next(ref.getNext(), st);
+                    break;
+                }
+                case Op::MakeBox:
+                case Op::Unbox:     next(static_cast<const BoxOp&>(*instr).getNext(), st); break;
+                case Op::SetBox: {
+                    need(1);
+                    next(static_cast<const BoxOp&>(*instr).getNext(), st);
+                    break;
+                }
+                case Op::GlobalRef:
+                case Op::GlobalSet:
+                case Op::GlobalDef: next(static_cast<const GlobalOp&>(*instr).getNext(), st); break;
+                case Op::Loop:      next(static_cast<const Loop&>(*instr).getNext(), st); break;
+                case Op::Jump: {
+                    // back to a loop entered on the way here, at the depth it was entered with
+                    const auto& jmp = static_cast<const Jump&>(*instr);
+                    if (!jmp.getLoop() || !seen.count(jmp.getLoop())) fail(*instr, "jump to a loop not entered");
+                    if (jmp.getArgc() < 0 || jmp.getPop() < jmp.getArgc()) fail(*instr, "malformed jump");
+                    need(jmp.getPop());
+                    auto s = st;
+                    s.depth -= jmp.getPop();
+                    for (int i = 0; i < jmp.getArgc(); ++i) {
+                        if (jmp.getSlot() + i >= s.depth) fail(*instr, fmt::format("loop slot {} popped", jmp.getSlot() + i));
+                        slot(jmp.getSlot() + i);
+                    }
+                    work.emplace_back(jmp.getLoop(), std::move(s));
+                    break;
+                }
+                case Op::Frame: {
+                    // the return continues at this depth, the arguments go above it
+                    const auto& frm = static_cast<const Frame&>(*instr);
+                    next(frm.getRet(), st);
+                    auto s = st;
+                    s.frames.push_back(st.depth);
+                    next(frm.getNext(), std::move(s));
+                    break;
+                }
+                case Op::Call:
+                case Op::CallCC: {
+                    if (st.frames.empty()) fail(*instr, "call without a frame");
+                    const int argc = static_cast<const Call&>(*instr).getArgc();
+                    if (st.depth - st.frames.back() != argc) {
+                        fail(*instr, fmt::format("call of {} args with {} pushed", argc, st.depth - st.frames.back()));
+                    }
+                    break;
+                }
+                case Op::Ret: {
+                    if (top) fail(*instr, "return at top level");
+                    if (!st.frames.empty() || st.depth != 0) fail(*instr, "return with values left on the stack");
+                    if (static_cast<const Ret&>(*instr).getPop() != body.arity) fail(*instr, "return pops another arity");
+                    break;
+                }
+                case Op::Halt: {
+                    if (!top) fail(*instr, "halt inside a lambda");
+                    if (!st.frames.empty() || st.depth != 0) fail(*instr, "halt with values left on the stack");
+                    break;
+                }
+                case Op::Stub: {
+                    // the body continues in the same frame
+                    const auto& stub = static_cast<const Stub&>(*instr);
+                    if (stub.isCompiled()) next(stub.getBody(), st);
+                    break;
+                }
+                default: {
+                    const auto op = instr->getOpCode();
+                    if (op < Op::ADD || op > Op::NEQ_FIX_BRANCH) fail(*instr, "unknown opcode");
+                    const auto& prim = static_cast<const Prim&>(*instr);
+                    need(Instr::primArity(Instr::generic(op)));
+                    if (Instr::isQuickened(op)) {
+                        // the fast forms jump over the `pop 2` (and branch) they were quickened with
+                        const auto& nxt = prim.getNext();
+                        if (!nxt || nxt->getOpCode() != Op::Pop || static_cast<const Pop&>(*nxt).getNum() != 2) {
+                            fail(*instr, "quickened primitive without its pop");
+                        }
+                        const auto& after = static_cast<const Pop&>(*nxt).getNext();
+                        if (op >= Op::LT_FIX_BRANCH && (!after || after->getOpCode() != Op::Branch)) {
+                            fail(*instr, "quickened primitive without its branch");
+                        }
+                    }
+                    next(prim.getNext(), st);
+                }
+            }
+        }
+    }
+
+    vector<Body>                                                _bodies;
+    unordered_map<const Instr*, pair<int, size_t>>              _shapes; // arity and captures of every body
+};
+
+} // namespace
+
+optional<Verifier::Verified> Verifier::verify(Instr::Ptr entry, string* error) {
+    try {
+        if (!entry) throw runtime_error("no code");
+        Walker().run(entry.get());
+        return Verified(std::move(entry));
+    } catch (runtime_error& e) {
+        if (error) *error = e.what();
+        return nullopt;
+    }
+}
+
+bool Verifier::verifyBody(const Instr& body, int arity, size_t ncaps, string* error) {
+    try {
+        if (arity < 0) throw runtime_error("negative arity");
+        Walker().run(&body, arity, ncaps);
+        return true;
+    } catch (runtime_error& e) {
+        if (error) *error = e.what();
+        return false;
+    }
+}
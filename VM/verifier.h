@@ -0,0 +1,37 @@
+#pragma once
+
+#include "bytecode.h"
+
+#include <optional>
+#include <string>
+
+// Load time checks of a compiled program: every instruction is reached with
+// one stack depth, no pop, primitive or slot access goes below the frame it
+// runs in, frames are balanced by their calls and returns, and every
+// successor is a valid instruction. Verified code runs on the unchecked loop
+// of VirtualMachine, only the type checks of values stay.
+//
+// Lambda bodies not compiled yet (see Stub) are skipped here, the stub
+// verifies its body with verifyBody once compiled, before any call runs it.
+// Images never contain any.
+class Verifier {
+public:
+    // proof that `entry` passed, the only way to the unchecked loop
+    class Verified {
+    public:
+        Instr& entry() const { return *_entry; }
+        const Instr::Ptr& getEntry() const { return _entry; }
+
+    private:
+        friend class Verifier;
+        explicit Verified(Instr::Ptr entry): _entry(std::move(entry)) {}
+
+        Instr::Ptr  _entry;
+    };
+
+    // a top level expression, ending in halt. On failure `error` tells the
+    // first problem found
+    static std::optional<Verified> verify(Instr::Ptr entry, std::string* error = nullptr);
+    // a lambda body compiled later, for closures of `arity` with `ncaps` captures
+    static bool verifyBody(const Instr& body, int arity, size_t ncaps, std::string* error = nullptr);
+};
@@ -13,7 +13,7 @@ class VisitorE; //forward declaration of base visitor
 struct Expr {
     using Ptr = std::unique_ptr<Expr>;
 
-    enum class Type {Number, Boolean, Var, Quote, Define, SetBang, Begin, Let, If, Lambda, Apply} type_;
+    enum class Type {Number, Boolean, Var, Quote, Define, SetBang, Begin, Let, If, Lambda, Apply, Case} type_;
 
     Expr(Type t):type_(t){}
     virtual ~Expr()=default;
@@ -133,6 +133,21 @@ struct Quote: Expr {
 	std::shared_ptr<Parser::Datum> datum_;
 };
 
+// (case key ((datum ...) body) ... (else body)), the key is matched as by eqv?
+// and the first clause holding it wins. Without an else clause else_ is null
+// and a miss evaluates to void
+struct Case: Expr {
+    using Clause = std::pair<std::vector<std::shared_ptr<Parser::Datum>>, Expr::Ptr>;
+    Case(Expr::Ptr&& key, std::vector<Clause>&& clauses, Expr::Ptr&& els):
+        Expr(Expr::Type::Case), key_(std::move(key)), clauses_(std::move(clauses)), else_(std::move(els)) {}
+
+    void accept(VisitorE &v) const override;
+
+    Expr::Ptr key_;
+    std::vector<Clause> clauses_;
+    Expr::Ptr else_;
+};
+
 
 class VisitorE {
 public:
@@ -148,6 +163,7 @@ public:
 	virtual void forLetRec(const LetRec&)=0;
     virtual void forLambda(const Lambda&)=0;
     virtual void forApply(const Apply&)=0;
+    virtual void forCase(const Case&)=0;
     virtual ~VisitorE()=default;
 };
 
@@ -163,6 +179,7 @@ inline void LetRec::accept(VisitorE& v) const { v.forLetRec(*this); }
 inline void If::accept(VisitorE& v) const { v.forIf(*this); }
 inline void Lambda::accept(VisitorE& v) const { v.forLambda(*this); }
 inline void Apply::accept(VisitorE& v) const { v.forApply(*this); }
+inline void Case::accept(VisitorE& v) const { v.forCase(*this); }
 
 class ExprMapper: public VisitorE
 {
@@ -205,4 +222,9 @@ public:
 		}
 	}
 
+    virtual void forCase(const Case& cas) override {
+        cas.key_->accept(*this);
+        for(const auto& cl: cas.clauses_) cl.second->accept(*this);
+        if(cas.else_) cas.else_->accept(*this);
+    }
 };
@@ -25,6 +25,15 @@ public:
         }
     }
 
+    // nullptr instead of throwing when `var` is unbound
+    V* lookup(std::string_view var) {
+        auto it = _bindings.find(var);
+        if (it != _bindings.end()) {
+            return &it->second;
+        }
+        return _outer? _outer->lookup(var): nullptr;
+    }
+
     static Ptr extend(Ptr old) {
         auto ret    = std::make_shared<Environment<V>>();
         ret->_outer = old;
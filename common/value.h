@@ -1,7 +1,9 @@
 #pragma once
 
 #include "ast.h"
+#include <deque>
 #include <functional>
+#include <mutex>
 #include <unordered_set>
 #include "environment.h"
 
@@ -17,7 +19,7 @@ class VisitorV;
 // Appliable = LambdaV| Procedure
 struct Value {
     using Ptr = std::shared_ptr<Value>;
-    enum class Type {Number,  Boolean, Symbol, Closure, Procedure, Cons, Nil, Void} type_;
+    enum class Type {Number,  Boolean, Symbol, Closure, Procedure, Cons, Nil, Void, Box, Channel, Continuation} type_;
 
     Value(Type t):type_(t){}
     virtual ~Value()=default;
@@ -56,8 +58,11 @@ struct Symbol: public Value {
     bool operator<(const Symbol& s) const { return ptr_ < s.ptr_; }
     ~Symbol()=default;
 
+	// shared by all threads, nodes of the set never move
 	static const std::string* intern(const std::string& s) {
 		static std::unordered_set<std::string> string_intern;
+		static std::mutex mtx;
+		std::lock_guard<std::mutex> lock(mtx);
 		auto pos = string_intern.insert(s).first;
 		return &*pos;
 	}
@@ -106,12 +111,57 @@ class Instr;
 namespace VM
 {
 struct Closure: public Value {
-    Closure(std::shared_ptr<Instr> c): Value(Type::Closure), _code(std::move(c)) {}
+    Closure(std::shared_ptr<Instr> c, int arity): Value(Type::Closure), _code(std::move(c)), _arity(arity) {}
+    Closure(std::shared_ptr<Instr> c, int arity, std::vector<Value::Ptr> captured):
+        Value(Type::Closure), _code(std::move(c)), _arity(arity), _captured(std::move(captured)) {}
     
     void accept(Interp::VisitorV &v) const override {}
     void accept(VM::VisitorV &v) const override;
 
     std::shared_ptr<Instr>   _code;
+    int                      _arity;
+    std::vector<Value::Ptr>  _captured; // flat copies of the free variables
+};
+
+// cell for a captured variable which is also assigned, never escapes to user code
+struct Box: public Value {
+    Box(Value::Ptr v): Value(Type::Box), _value(std::move(v)) {}
+
+    void accept(Interp::VisitorV &v) const override {}
+    void accept(VM::VisitorV &v) const override {}
+
+    Value::Ptr              _value;
+};
+
+struct StackSegment; // see VirtualMachine
+
+// the stacks below a point: values below `stackTop` and frames below
+// `frames` (absolute positions), held by `segment` and the ones under it
+struct StackView {
+    std::shared_ptr<StackSegment>   segment;
+    size_t                          stackTop{0};
+    size_t                          frames{0};
+};
+
+// captured by call/cc, resumes the frame on top of the view
+struct Continuation: public Value {
+    Continuation(StackView view): Value(Type::Continuation), _view(std::move(view)) {}
+
+    void accept(Interp::VisitorV &v) const override {}
+    void accept(VM::VisitorV &v) const override {}
+
+    StackView               _view;
+};
+
+// unbounded queue between the green threads of one VirtualMachine
+struct Channel: public Value {
+    Channel(): Value(Type::Channel) {}
+
+    void accept(Interp::VisitorV &v) const override {}
+    void accept(VM::VisitorV &v) const override {}
+
+    std::deque<Value::Ptr>  _items;
+    std::deque<uint64_t>    _receivers; // threads blocked in recv, oldest first
 };
 
 } //namespace VM
@@ -128,10 +178,13 @@ struct Cons: public Value {
 
 class Nil: public Value {
 public:
-	static auto& getInstance() {
-		static std::shared_ptr<Nil> nil(new Nil);
+	// immutable, safe to share between threads
+	static const std::shared_ptr<Nil>& getInstance() {
+		static const std::shared_ptr<Nil> nil(new Nil);
 		return nil;
 	}
+	// one not shared with other threads, for a VM isolate
+	static std::shared_ptr<Nil> make() { return std::shared_ptr<Nil>(new Nil); }
     ~Nil()=default;
 private:
 	Nil():Value(Value::Type::Nil) {}
@@ -148,6 +201,8 @@ public:
 		std::shared_ptr<Void> void_{ new Void };
 		return void_;
 	}
+	// one not shared with other threads, for a VM isolate
+	static std::shared_ptr<Void> make() { return std::shared_ptr<Void>(new Void); }
     ~Void()=default;
 private:
 	Void():Value(Value::Type::Void) {}
@@ -220,6 +275,9 @@ inline const char* typeStr(Value::Type t)
 		case Value::Type::Procedure: return "procedure";
 		case Value::Type::Void: return "void";
 		case Value::Type::Nil: return "nil";
+		case Value::Type::Box: return "box";
+		case Value::Type::Channel: return "channel";
+		case Value::Type::Continuation: return "continuation";
 		default: return "#unknown#";
 	}
 }
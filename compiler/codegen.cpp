@@ -1,9 +1,15 @@
 #include "codegen.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Support/SourceMgr.h"
 #include "fmt/core.h"
 #include "value.h"
 #include "scheme.h"
 #include "runtime.h"
+#include <optional>
 #include <sstream>
 #include <unordered_set>
 
@@ -13,12 +19,14 @@ using namespace std;
 
 void ExprCodeGen::forNumber(const NumberE& n)
 {
-	value_ = getSchemeInt(n.value_);
+	value_ = llvmInt64(n.value_);
+	vty_ = VType::Fixnum;
 }
 
 void ExprCodeGen::forBoolean(const BooleanE& b)
 {
-	value_ = ConstantInt::getSigned(IntegerType::get(ctx_, 64), Scheme::toBoolReps(b.b_));
+	value_ = builder_.getInt1(b.b_);
+	vty_ = VType::Bool;
 }
 
 void ExprCodeGen::forVar(const Var& var)
@@ -28,32 +36,35 @@ void ExprCodeGen::forVar(const Var& var)
 		auto pGlob = module_.getNamedGlobal(var.v_);
 		if(pGlob) { 
 			value_ = builder_.CreateLoad(pGlob->getValueType(), pGlob, "deref_"+var.v_); 
+			vty_ = VType::Any;
 		} else { 
 			throw std::runtime_error("undefined variable " + var.v_); 
 		}
 	}else {
-		if(curCtx_.isAssigned(var.v_)) {
-			value_ = builder_.CreateLoad(it->second->getType()->getPointerElementType(), it->second, fmt::format("deref_{}", var.v_));
-		} else {
-			value_ = it->second;
-		}
+		// known more precisely here than in its slot, after a type test
+		const auto slot = varType(var.v_);
+		vty_ = types_->typeOf(var);
+		value_ = convert(builder_.CreateLoad(repType(slot), it->second, var.v_), slot, vty_);
 	}
 }
 
 void ExprCodeGen::forQuote(const Quote& qo)
 {
+	vty_ = VType::Any;
 	switch(qo.datum_->type_) {
 		case Parser::Datum::Type::Number:
 		{
 			const auto& n = static_cast<Parser::DatumNum&>(*qo.datum_);
-			value_ = ConstantInt::getSigned(IntegerType::get(ctx_, 64), Scheme::toFixnumReps(n.value_));
-			break;
+			value_ = llvmInt64(n.value_);
+			vty_ = VType::Fixnum;
+			return;
 		}
 		case Parser::Datum::Type::Boolean:
 		{
 			const auto& b =  static_cast<Parser::DatumBool&>(*qo.datum_);
-			value_ = ConstantInt::getSigned(IntegerType::get(ctx_, 1), Scheme::toBoolReps(b.value_));
-			break;
+			value_ = builder_.getInt1(b.value_);
+			vty_ = VType::Bool;
+			return;
 		}
 		case Parser::Datum::Type::Nil:
 		{
@@ -62,16 +73,7 @@ void ExprCodeGen::forQuote(const Quote& qo)
 		}
 		case Parser::Datum::Type::Symbol:
 		{
-			const auto& sym = static_cast<Parser::DatumSym&>(*qo.datum_);
-			auto strLit = ConstantDataArray::getString(ctx_, sym.value_);
-			auto glob = module_.getNamedGlobal(sym.value_);
-			if(!glob) {
-				glob = new GlobalVariable(module_, strLit->getType(), true, llvm::GlobalValue::PrivateLinkage, strLit, sym.value_);
-				glob->setUnnamedAddr(llvm::GlobalValue::UnnamedAddr::Global);
-			}
-
-			auto func = module_.getFunction("schemeInternSymbol");
-			value_ = builder_.CreateCall(func, {builder_.CreateConstGEP2_64(glob->getValueType(), glob, 0, 0, "c")}, "sym"); 
+			value_ = internSymbol(static_cast<Parser::DatumSym&>(*qo.datum_).value_);
 			break;
 		}
 		case Parser::Datum::Type::Pair:
@@ -81,10 +83,28 @@ void ExprCodeGen::forQuote(const Quote& qo)
 	}
 }
 
+const SymbolLit& ExprCodeGen::symbolLit(const std::string& name)
+{
+	auto it = symbols_.find(name);
+	if(it == symbols_.end()) {
+		auto strLit = ConstantDataArray::getString(ctx_, name);
+		auto glob = new GlobalVariable(module_, strLit->getType(), true, llvm::GlobalValue::PrivateLinkage, strLit, name);
+		glob->setUnnamedAddr(llvm::GlobalValue::UnnamedAddr::Global);
+		it = symbols_.emplace(name, SymbolLit{glob, static_cast<int64_t>(symbols_.size())}).first;
+	}
+	return it->second;
+}
+
+llvm::Value* ExprCodeGen::internSymbol(const std::string& name)
+{
+	auto glob = symbolLit(name).name;
+	auto func = module_.getFunction("schemeInternSymbol");
+	return builder_.CreateCall(func, {builder_.CreateConstGEP2_64(glob->getValueType(), glob, 0, 0, "c")}, "sym");
+}
 
 void ExprCodeGen::forSetBang(const SetBang& setBang)
 {
-	setBang.e_->accept(*this);
+	genValue(*setBang.e_);
 
     llvm::Value* var = nullptr;
 	auto it = table_.find(setBang.v_.v_);
@@ -94,199 +114,714 @@ void ExprCodeGen::forSetBang(const SetBang& setBang)
 		var = module_.getNamedGlobal(setBang.v_.v_);
 	}
 
-	builder_.CreateStore(value_, var);
+	builder_.CreateStore(convert(value_, vty_, VType::Any), var); // assigned variables are never unboxed
 	value_ = ConstantInt::getSigned(IntegerType::get(ctx_, 64), static_cast<int64_t>(Scheme::Tag::Void));
+	vty_ = VType::Any;
 }
 
 void ExprCodeGen::forBegin(const Begin& bgn)
 {
-	for(const auto& e: bgn.es_) {
-		e->accept(*this);
+	if(bgn.es_.empty()) {
+		value_ = ConstantInt::getSigned(IntegerType::get(ctx_, 64), static_cast<int64_t>(Scheme::Tag::Void));
+		vty_ = VType::Any;
+		return;
+	}
+	for(auto it = bgn.es_.begin(); it + 1 != bgn.es_.end(); ++it) {
+		genValue(**it);
 	}
+	bgn.es_.back()->accept(*this);
 }
 
 void ExprCodeGen::forIf(const If& ifExp)
 {
-	ifExp.pred_->accept(*this);
-
-    llvm::Value* condV = nullptr;
-	if(value_->getType()->getIntegerBitWidth() == 1) {
-		condV = value_;
-	}else { //assert schemeValType
-		condV = builder_.CreateICmpNE(value_, ConstantInt::getSigned(schemeValType, Scheme::toBoolReps(false)));
-	}
+	genValue(*ifExp.pred_);
+	auto condV = convert(value_, vty_, VType::Bool);
 
 	auto curFunc = builder_.GetInsertBlock()->getParent();
 	auto thnBB = BasicBlock::Create(ctx_, "thn", curFunc);
 	auto elsBB = BasicBlock::Create(ctx_, "els", curFunc);
-	auto contBB = BasicBlock::Create(ctx_, "ifCont", curFunc);
 	builder_.CreateCondBr(condV, thnBB, elsBB);
 
+	// in tail position each branch returns on its own
+	if(tail_) {
+		builder_.SetInsertPoint(thnBB);
+		ifExp.thn_->accept(*this);
+		returnValue();
+		builder_.SetInsertPoint(elsBB);
+		ifExp.els_->accept(*this);
+		returnValue();
+		return;
+	}
+
+	// both branches in the representation of the if
+	const auto ty = types_->typeOf(ifExp);
+	auto contBB = BasicBlock::Create(ctx_, "ifCont", curFunc);
 	builder_.SetInsertPoint(thnBB);
 	ifExp.thn_->accept(*this);
-	auto thnV = value_;
+	auto thnV = convert(value_, vty_, ty);
 	builder_.CreateBr(contBB);
 	thnBB = builder_.GetInsertBlock(); //update the current block for phi block
 
 	//curFunc->getBasicBlockList().push_back(elsBB);
 	builder_.SetInsertPoint(elsBB);
 	ifExp.els_->accept(*this);
-	auto elsV = value_;
+	auto elsV = convert(value_, vty_, ty);
 	builder_.CreateBr(contBB);
 	elsBB = builder_.GetInsertBlock();
 
 	//curFunc->getBasicBlockList().push_back(contBB);
 	builder_.SetInsertPoint(contBB);
-	auto phiV = builder_.CreatePHI(schemeValType, 2, "if-phi");
+	auto phiV = builder_.CreatePHI(repType(ty), 2, "if-phi");
 
 	phiV->addIncoming(thnV, thnBB);
 	phiV->addIncoming(elsV, elsBB);
 	
 	value_ = phiV;
+	vty_ = ty;
 }
 
+// fixnum, boolean and nil keys are constants of their tagged representation
+// and become the cases of a switch. Symbols are only interned at run time,
+// when the switch misses a second one dispatches on the id of a symbol key,
+// which is known at compile time (see SymbolLit)
+void ExprCodeGen::forCase(const Case& cas)
+{
+	genValue(*cas.key_);
+	auto key = convert(value_, vty_, VType::Any);
+	const auto ty = types_->typeOf(cas);
+
+	auto curFunc = builder_.GetInsertBlock()->getParent();
+	auto symBB = BasicBlock::Create(ctx_, "caseSym", curFunc);
+	auto contBB = BasicBlock::Create(ctx_, "caseCont", curFunc);
+	auto sw = builder_.CreateSwitch(key, symBB, cas.clauses_.size());
+
+	vector<pair<llvm::Value*, BasicBlock*>> incoming;
+	vector<pair<int64_t, BasicBlock*>> syms;
+	unordered_set<int64_t> cases; // a key twice is invalid IR, the first clause wins
+	for(const auto& [data, body]: cas.clauses_) {
+		auto clauseBB = BasicBlock::Create(ctx_, "clause", curFunc);
+		for(const auto& dat: data) {
+			optional<Scheme::ValueType> reps;
+			switch(dat->type_) {
+				case Parser::Datum::Type::Number:
+					reps = Scheme::toFixnumReps(static_cast<const Parser::DatumNum&>(*dat).value_); break;
+				case Parser::Datum::Type::Boolean:
+					reps = Scheme::toBoolReps(static_cast<const Parser::DatumBool&>(*dat).value_); break;
+				case Parser::Datum::Type::Nil:
+					reps = static_cast<Scheme::ValueType>(Scheme::Tag::Nil); break;
+				case Parser::Datum::Type::Symbol:
+					syms.emplace_back(symbolLit(static_cast<const Parser::DatumSym&>(*dat).value_).id, clauseBB); break;
+				case Parser::Datum::Type::Pair:
+					break; // never the same as the key
+			}
+			if(reps && cases.insert(*reps).second) {
+				sw->addCase(ConstantInt::getSigned(IntegerType::getInt64Ty(ctx_), *reps), clauseBB);
+			}
+		}
+
+		builder_.SetInsertPoint(clauseBB);
+		body->accept(*this);
+		if(tail_) {
+			returnValue();
+		}else {
+			incoming.emplace_back(convert(value_, vty_, ty), builder_.GetInsertBlock());
+			builder_.CreateBr(contBB);
+		}
+	}
+
+	builder_.SetInsertPoint(symBB);
+	auto elseBB = BasicBlock::Create(ctx_, "caseElse", curFunc);
+	if(syms.empty()) {
+		builder_.CreateBr(elseBB);
+	}else {
+		auto idBB = BasicBlock::Create(ctx_, "caseSymId", curFunc);
+		builder_.CreateCondBr(hasTag(key, Scheme::Tag::Symbol, Scheme::Mask::Symbol), idBB, elseBB);
+		builder_.SetInsertPoint(idBB);
+		auto idField = builder_.CreateConstInBoundsGEP1_64(schemeValType, payloadOf(key, Scheme::Tag::Symbol), SymIdWord);
+		auto symSw = builder_.CreateSwitch(builder_.CreateLoad(schemeValType, idField, "symId"), elseBB, syms.size());
+		unordered_set<int64_t> ids;
+		for(auto [id, clauseBB]: syms) {
+			if(ids.insert(id).second) symSw->addCase(ConstantInt::getSigned(IntegerType::getInt64Ty(ctx_), id), clauseBB);
+		}
+	}
+	builder_.SetInsertPoint(elseBB);
+	if(cas.else_) {
+		cas.else_->accept(*this);
+	}else {
+		value_ = ConstantInt::getSigned(IntegerType::get(ctx_, 64), static_cast<int64_t>(Scheme::Tag::Void));
+		vty_ = VType::Any;
+	}
+	if(tail_) {
+		returnValue();
+		contBB->eraseFromParent();
+		return;
+	}
+	incoming.emplace_back(convert(value_, vty_, ty), builder_.GetInsertBlock());
+	builder_.CreateBr(contBB);
+
+	builder_.SetInsertPoint(contBB);
+	auto phiV = builder_.CreatePHI(repType(ty), incoming.size(), "case-phi");
+	for(auto [v, bb]: incoming) phiV->addIncoming(v, bb);
+	value_ = phiV;
+	vty_ = ty;
+}
+
+// a variable bound to a lambda and never assigned is called directly. When
+// it is only ever called, in this function, it needs no closure either
 void ExprCodeGen::forLet(const Let& let)
 {
-	for(auto& kv: let.binds_) {
-		kv.second->accept(*this);
+	// the bindings shadow the outer ones in the body only
+	vector<pair<string, optional<KnownFn>>> outer;
+	for(const auto& kv: let.binds_) {
+		auto it = known_.find(kv.first.v_);
+		if(it == known_.end()) {
+			outer.emplace_back(kv.first.v_, nullopt);
+		}else {
+			outer.emplace_back(kv.first.v_, std::move(it->second));
+			known_.erase(it);
+		}
+	}
 
-		if(curCtx_.isAssigned(kv.first.v_)) {
-			auto varAddr = builder_.CreateAlloca(schemeValType, nullptr, fmt::format("alloc_{}", kv.first.v_));
-			builder_.CreateStore(value_, varAddr);
-			table_[kv.first] = varAddr;
+	for(auto it = let.binds_.begin(); it != let.binds_.end(); ++it) {
+		const auto& kv = *it;
+		if(kv.second->type_ == Expr::Type::Lambda && !curCtx_.isAssigned(kv.first.v_)) {
+			const auto& lam = static_cast<const Lambda&>(*kv.second);
+			EscapeScanner escape(kv.first.v_);
+			for(auto later = it + 1; later != let.binds_.end(); ++later) later->second->accept(escape);
+			let.body_->accept(escape);
+
+			if(!escape.escapes()) {
+				FreeVarScanner fvScanner(module_);
+				lam.accept(fvScanner);
+				vector<string> fvs(fvScanner.getFVs().begin(), fvScanner.getFVs().end());
+				auto fn = genLifted(lam, fvs, true);
+				known_[kv.first.v_] = KnownFn{fn, std::move(fvs), true};
+				continue;
+			}
+			forLambda(lam);
+			known_[kv.first.v_] = KnownFn{lifted_, {}, false};
 		}else {
-			table_[kv.first] = value_;
+			genValue(*kv.second);
 		}
+
+		// unboxed values aren't roots, the collector has nothing to do with them
+		const auto ty = types_->typeOfBinding(kv);
+		auto slot = ty == VType::Any? newRoot(kv.first.v_): newTemp(repType(ty), kv.first.v_);
+		builder_.CreateStore(convert(value_, vty_, ty), slot);
+		table_[kv.first] = slot;
+		varTypes_[kv.first.v_] = ty;
 	}
 	let.body_->accept(*this);
+
+	for(auto& [v, fn]: outer) {
+		if(fn) known_[v] = std::move(*fn);
+		else known_.erase(v);
+	}
 }
 
 void ExprCodeGen::forLambda(const Lambda& lam)
 {
 	FreeVarScanner fvScanner(module_);
 	lam.accept(fvScanner);
-	const auto& fvs = fvScanner.getFVs();
-	
-	//codegen for the lifted lambda function
+	const vector<string> fvs(fvScanner.getFVs().begin(), fvScanner.getFVs().end());
+	auto lambdaFn = genLifted(lam, fvs, false);
+	lifted_ = lambdaFn;
+
+	//codgen of closure, {code, arity, fvs...} in one object
+	vector<llvm::Value*> fvVals;
+	for(const auto& fv: fvs) {
+		fvVals.emplace_back(loadTagged(fv));
+	}
+	auto payload = allocate(Runtime::Gc::Kind::Closure, ClosureWords + fvs.size(), fvVals);
+	auto closPtr = builder_.CreateBitCast(payload, closureType_->getPointerTo());
+	builder_.CreateStore(builder_.CreateBitCast(lambdaFn, Type::getInt8PtrTy(ctx_), "lambdaPtr"), builder_.CreateStructGEP(closureType_, closPtr, 0));
+	builder_.CreateStore(llvmInt64(lam.arity()), builder_.CreateStructGEP(closureType_, closPtr, 1));
+	for(size_t i = 0; i < fvVals.size(); ++i) {
+		builder_.CreateStore(fvVals[i], builder_.CreateConstInBoundsGEP1_64(schemeValType, payload, ClosureWords + i));
+	}
+	value_ = tagPointer(payload, Scheme::Tag::Closure, "clos");
+	vty_ = VType::Any;
+}
+
+// the function of a lambda: (closure, param1 ... param_n) reading the free
+// variables out of the closure, or with `noClosure` (param1 ... param_n, fv1 ...
+// fv_m) for the ones called directly without a closure
+llvm::Function* ExprCodeGen::genLifted(const Lambda& lam, const vector<string>& fvs, bool noClosure)
+{
 	string liftFnName = FrontEndPass::gensym(fmt::format("{}_lambda", builder_.GetInsertBlock()->getParent()->getName()));
-	vector<Type*> paramTys{lam.arity()+1, schemeValType}; //closure, param1, param2 ... param_n
+	vector<Type*> paramTys{noClosure? lam.arity() + fvs.size(): lam.arity() + 1, schemeValType};
 	auto fnType = FunctionType::get(schemeValType, paramTys, false);
 	auto lambdaFn = Function::Create(fnType, llvm::GlobalValue::InternalLinkage, liftFnName, &module_);
-
-	const auto& params = *lam.params_;
-	SymTable lamTable;
-	int i = 0;
-	for(auto it = lambdaFn->args().begin()+1; it != lambdaFn->args().end(); ++it) {
-		lamTable[params[i++]] = it;
-	}
-	auto closArg = lambdaFn->args().begin();
+	lambdaFn->setGC("shadow-stack");
+	lambdaFn->setCallingConv(CallingConv::Tail);
 
 	auto entryBB = BasicBlock::Create(ctx_, "entry", lambdaFn);
 	IRBuilder<> lambdaBuilder(ctx_);
 	lambdaBuilder.SetInsertPoint(entryBB);
 
-	if(!fvs.empty()) {
-		auto closAddr = lambdaBuilder.CreateAnd(closArg, ~static_cast<uint64_t>(Scheme::Mask::Closure));
-		auto closPtr = lambdaBuilder.CreateIntToPtr(closAddr, closureType_->getPointerTo());
-		auto fvField = lambdaBuilder.CreateStructGEP(closureType_, closPtr, 2);
-		auto fvsPtr = lambdaBuilder.CreateLoad(fvField->getType()->getPointerElementType(), fvField, "fvPtr");
-		int i = 0;
+	const auto& params = *lam.params_;
+	SymTable lamTable;
+	auto arg = lambdaFn->arg_begin() + (noClosure? 0: 1);
+	for(const auto& p: params) {
+		auto root = ProgramCodeGen::createRoot(*lambdaFn, p.v_);
+		lambdaBuilder.CreateStore(arg++, root);
+		lamTable[p] = root;
+	}
+
+	if(noClosure) {
+		for(const auto& fv: fvs) {
+			auto root = ProgramCodeGen::createRoot(*lambdaFn, fv);
+			lambdaBuilder.CreateStore(arg++, root);
+			lamTable[fv] = root;
+		}
+	}else if(!fvs.empty()) {
+		auto closArg = lambdaFn->arg_begin();
+		auto closAddr = lambdaBuilder.CreateSub(closArg, llvmInt64(static_cast<int64_t>(Scheme::Tag::Closure)));
+		auto closPtr = lambdaBuilder.CreateIntToPtr(closAddr, schemeValType->getPointerTo(), "self");
+		size_t i = ClosureWords;
 		for(const auto& fv: fvs) { 
-			auto fvI = lambdaBuilder.CreateGEP(fvsPtr->getType()->getPointerElementType(), fvsPtr, llvmInt64(i), fmt::format("fv_{}", i));
-			lamTable[fv] = curCtx_.isAssigned(fv)? fvI: lambdaBuilder.CreateLoad(fvI->getType()->getPointerElementType(), fvI);
-			++i;
+			// copied out, the closure may move. Assigned variables are boxed by
+			// the front end before they are captured
+			auto fvI = lambdaBuilder.CreateConstInBoundsGEP1_64(schemeValType, closPtr, i++, "fv_" + fv);
+			auto root = ProgramCodeGen::createRoot(*lambdaFn, fv);
+			lambdaBuilder.CreateStore(lambdaBuilder.CreateLoad(schemeValType, fvI), root);
+			lamTable[fv] = root;
 		}
 	}
 
-	ExprCodeGen genforLambda(lambdaBuilder, module_, curCtx_, lamTable);
-	lam.body_->accept(genforLambda);
-	lambdaBuilder.CreateRet(genforLambda.getValue());
+	ExprCodeGen genforLambda(lambdaBuilder, module_, curCtx_, lamTable, symbols_, checked_);
+	genforLambda.genBody(*lam.body_, true);
+	return lambdaFn;
+}
 
-	//codgen of closure
-	auto allocCloFunc = module_.getFunction("schemeAllocateClosure");
-	vector<llvm::Value*> args;
-	args.emplace_back( builder_.CreateBitCast(lambdaFn, Type::getInt8PtrTy(ctx_), "lambdaPtr"));
-	args.emplace_back(ConstantInt::getSigned(IntegerType::get(ctx_, 32), lam.arity()));
-	args.emplace_back(ConstantInt::getSigned(IntegerType::get(ctx_, 32), fvs.size()));
-	for(const auto& fv: fvs) {
-		args.emplace_back(table_.at(fv));
+// evaluating it may call into the runtime or other code, which may collect
+static bool mayCollect(const Expr& e)
+{
+	switch(e.type_) {
+		case Expr::Type::Number:
+		case Expr::Type::Boolean:
+		case Expr::Type::Var:
+		case Expr::Type::Quote:	return false;
+		default:				return true;
 	}
-	value_ = builder_.CreateCall(allocCloFunc, args, "clos");
 }
 
 void ExprCodeGen::forApply(const Apply& app)
 {
+	// an argument is kept in a root while later ones (or the operator, which
+	// goes last) are evaluated, and read back from it before the call
+	// (unboxed ones need no root, only a slot)
+	const auto& rands = app.operands_;
 	vector<llvm::Value*> args;
-	for(const auto& a: app.operands_) {
-		a->accept(*this);
+	vector<VType> argTys;
+	vector<AllocaInst*> spilled(rands.size(), nullptr);
+	for(size_t i = 0; i < rands.size(); ++i) {
+		genValue(*rands[i]);
 		args.emplace_back(value_);
+		argTys.emplace_back(vty_);
+
+		const bool held = mayCollect(*app.operator_) ||
+			any_of(rands.begin() + i + 1, rands.end(), [](const Expr::Ptr& e) { return mayCollect(*e); });
+		if(held) {
+			spilled[i] = vty_ == VType::Any? newRoot("arg"): newTemp(repType(vty_), "arg");
+			builder_.CreateStore(value_, spilled[i]);
+		}
 	}
+	auto reload = [&]() {
+		for(size_t i = 0; i < args.size(); ++i) {
+			if(spilled[i]) args[i] = builder_.CreateLoad(repType(argTys[i]), std::exchange(spilled[i], nullptr));
+		}
+	};
+	// arithmetic works on unboxed fixnums, everything else on tagged values
+	auto convertArgs = [&](VType to) {
+		for(size_t i = 0; i < args.size(); ++i) args[i] = convert(args[i], std::exchange(argTys[i], to), to);
+	};
+	auto untagged = [&]() { convertArgs(VType::Fixnum); };
+	auto tagged = [&]() { convertArgs(VType::Any); };
+	vty_ = VType::Any;
 
 #define GenArith(INSTR) \
 	{\
 		checkArity(args.size(), 2);\
+		untagged();\
 		value_ = builder_.Create##INSTR(args[0], args[1]);\
+		vty_ = VType::Fixnum;\
 		return;\
 	}
 #define GenCmp(CMP) \
 	{\
 		checkArity(args.size(), 2);\
+		untagged();\
 		value_ = builder_.CreateCmp(CMP, args[0], args[1]);\
-		value_ = builder_.CreateZExt(value_, schemeValType, "boolExt");\
-		value_ = builder_.CreateShl(value_, 5);\
-		value_ = builder_.CreateOr(value_, llvmInt64(0b101), "scmBool");\
+		vty_ = VType::Bool;\
 		return;\
 	}
 		
 	if(app.operator_->type_ == Expr::Type::Var) {
 		const string& op = static_cast<const Var&>(*app.operator_).v_;
+		reload();
 
 		if(op == "+")				GenArith(Add)
 		else if(op == "-") 			GenArith(Sub)
-		else if(op == "*") {
-			checkArity(args.size(), 2);
-			auto n1 = builder_.CreateAShr(args[0], 3, "ft1");
-			auto n2 = builder_.CreateAShr(args[1], 3, "ft2");
-			auto mulTmp = builder_.CreateMul(n1, n2, "mulTmp");
-			value_ = builder_.CreateShl(mulTmp, 3, "mulAns");
-			return;
-		}
-		else if(op == "/") {
-			checkArity(args.size(), 2);
-			auto div = builder_.CreateSDiv(args[0], args[1], "divTmp");
-			value_ = builder_.CreateShl(div, 3, "divAns");
-			return;
-		}
+		else if(op == "*")			GenArith(Mul)
+		else if(op == "/")			GenArith(SDiv)
 		else if(op == ">") 			GenCmp(CmpInst::Predicate::ICMP_SGT)
 		else if(op == ">=") 		GenCmp(CmpInst::Predicate::ICMP_SGE)
 		else if(op == "<") 			GenCmp(CmpInst::Predicate::ICMP_SLT)
 		else if(op == "<=") 		GenCmp(CmpInst::Predicate::ICMP_SLE)
 		else if(op == "=")			GenCmp(CmpInst::Predicate::ICMP_EQ)
+
+		tagged();
+		if(op == "cons") {
+			checkArity(args.size(), 2);
+			auto payload = allocate(Runtime::Gc::Kind::Cons, 2, args);
+			builder_.CreateStore(args[0], payload);
+			builder_.CreateStore(args[1], builder_.CreateConstInBoundsGEP1_64(schemeValType, payload, 1));
+			value_ = tagPointer(payload, Scheme::Tag::Pair, "pair");
+			return;
+		}
+		else if(genInlinePrim(op, args)) return;
+		else if(op == "box") {
+			checkArity(args.size(), 1);
+			auto payload = allocate(Runtime::Gc::Kind::Box, 1, args);
+			builder_.CreateStore(args[0], payload);
+			value_ = tagPointer(payload, Scheme::Tag::Box, "box");
+			return;
+		}
+		else if(auto it = known_.find(op); it != known_.end()) {
+			const auto& known = it->second;
+			const size_t arity = known.fn->arg_size() - (known.noClosure? known.fvs.size(): 1);
+			checkArity(args.size(), arity);
+			if(known.noClosure) {
+				for(const auto& fv: known.fvs) args.emplace_back(loadTagged(fv));
+			}else {
+				args.insert(args.begin(), loadTagged(op));
+			}
+			genCall(builder_.CreateCall(known.fn, args));
+			return;
+		}
 		else {
 			auto func = module_.getFunction(ProgramCodeGen::simpleMangle(op));
 			if(func) {
 				checkArity(args.size(), func->arg_size());
-				value_ = builder_.CreateCall(func, args);
+				if(tail_ && func == self_.fn) {
+					for(size_t i = 0; i < args.size(); ++i) self_.params[i]->addIncoming(args[i], builder_.GetInsertBlock());
+					builder_.CreateBr(self_.header);
+					value_ = nullptr;
+					return;
+				}
+				genCall(builder_.CreateCall(func, args));
 				return;
 			}
 		}
 	}
 
 	//not a var
-	app.operator_->accept(*this);
+	genValue(*app.operator_);
 	//assert rator is closure value
-	auto rator = value_;
-	auto ratorAddr = builder_.CreateAnd(rator, ~static_cast<uint64_t>(Scheme::Mask::Closure));
-	auto closPtr = builder_.CreateIntToPtr(ratorAddr, closureType_->getPointerTo(), "rator");
-	auto code = builder_.CreateStructGEP(closureType_, closPtr, 1);
+	auto rator = convert(value_, vty_, VType::Any);
+	reload();
+	tagged();
+	checkType(hasTag(rator, Scheme::Tag::Closure, Scheme::Mask::Closure), "apply", "procedure", rator);
+	auto closPtr = builder_.CreateBitCast(payloadOf(rator, Scheme::Tag::Closure), closureType_->getPointerTo(), "rator");
+	auto code = builder_.CreateStructGEP(closureType_, closPtr, 0);
 	auto codeAddr = builder_.CreateLoad(code->getType()->getPointerElementType(), code, "codeAddr");
-	auto funcType = FunctionType::get(schemeValType, {schemeValType}, true);
+	if(checked_) {
+		// before the call: calling code of another arity is undefined. The
+		// arity is next to the code pointer, on the same cache line
+		auto arity = builder_.CreateLoad(schemeValType, builder_.CreateStructGEP(closureType_, closPtr, 1), "arity");
+		checkType(builder_.CreateICmpEQ(arity, llvmInt64(args.size())), "apply",
+				fmt::format("procedure of {} argument(s)", args.size()).c_str(), rator);
+	}
+	args.insert(args.begin(), rator);
+	// not varargs, a tail call has to know the arguments it passes
+	auto funcType = FunctionType::get(schemeValType, vector<Type*>(args.size(), schemeValType), false);
 	auto funcPtr = builder_.CreateBitCast(codeAddr, funcType->getPointerTo(), "codeFunc");
 
-	args.insert(args.begin(), rator);
-	value_ = builder_.CreateCall(funcType, funcPtr, args);
+	auto call = builder_.CreateCall(funcType, funcPtr, args);
+	call->setCallingConv(CallingConv::Tail);
+	genCall(call);
 }
 
+void ExprCodeGen::genCall(llvm::CallInst* call)
+{
+	vty_ = VType::Any;
+	if(auto callee = call->getCalledFunction()) call->setCallingConv(callee->getCallingConv());
+
+	if(tail_ && call->getCallingConv() == CallingConv::Tail) {
+		call->setTailCallKind(CallInst::TCK_MustTail);
+		builder_.CreateRet(call);
+		value_ = nullptr;
+	}else {
+		value_ = call;
+	}
+}
+
+void ExprCodeGen::genValue(const Expr& e)
+{
+	auto tail = std::exchange(tail_, false);
+	e.accept(*this);
+	tail_ = tail;
+}
+
+void ExprCodeGen::returnValue()
+{
+	if(value_) builder_.CreateRet(convert(value_, vty_, VType::Any));
+	value_ = nullptr;
+}
+
+void ExprCodeGen::genBody(const Expr& body, bool tail)
+{
+	types_ = make_unique<TypeInference>(curCtx_.assignedVars);
+	types_->run(body);
+	tail_ = tail;
+	body.accept(*this);
+	returnValue();
+}
+
+
+// the fast path is a compare and a store, see gc.h
+llvm::Value* ExprCodeGen::allocate(Runtime::Gc::Kind kind, size_t words, std::vector<llvm::Value*>& live)
+{
+	auto tlab = module_.getNamedGlobal("schemeTlab");
+	auto tlabTy = tlab->getValueType();
+	auto i8PtrTy = Type::getInt8PtrTy(ctx_);
+	auto header = ConstantInt::get(schemeValType, Runtime::Gc::makeHeader(kind, words));
+
+	auto freeField = builder_.CreateStructGEP(tlabTy, tlab, 0);
+	auto free = builder_.CreateLoad(i8PtrTy, freeField, "free");
+	auto limit = builder_.CreateLoad(i8PtrTy, builder_.CreateStructGEP(tlabTy, tlab, 1), "limit");
+	auto bumped = builder_.CreateConstInBoundsGEP1_64(Type::getInt8Ty(ctx_), free, (words + 1) * sizeof(Scheme::ValueType), "bumped");
+
+	auto curFunc = builder_.GetInsertBlock()->getParent();
+	auto fastBB = BasicBlock::Create(ctx_, "allocFast", curFunc);
+	auto slowBB = BasicBlock::Create(ctx_, "allocSlow", curFunc);
+	auto contBB = BasicBlock::Create(ctx_, "allocCont", curFunc);
+	builder_.CreateCondBr(builder_.CreateICmpUGT(bumped, limit), slowBB, fastBB, MDBuilder(ctx_).createBranchWeights(1, 1000));
+
+	builder_.SetInsertPoint(fastBB);
+	builder_.CreateStore(bumped, freeField);
+	auto hdr = builder_.CreateBitCast(free, schemeValType->getPointerTo());
+	builder_.CreateStore(header, hdr);
+	auto fastPayload = builder_.CreateConstInBoundsGEP1_64(schemeValType, hdr, 1, "payload");
+	builder_.CreateBr(contBB);
+
+	// constants don't move, the rest goes through memory the collector updates
+	builder_.SetInsertPoint(slowBB);
+	vector<size_t> held;
+	for(size_t i = 0; i < live.size(); ++i) {
+		if(!isa<Constant>(live[i])) held.push_back(i);
+	}
+	llvm::Value* liveArr = ConstantPointerNull::get(schemeValType->getPointerTo());
+	if(!held.empty()) {
+		auto& entry = curFunc->getEntryBlock();
+		liveArr = IRBuilder<>(&entry, entry.begin()).CreateAlloca(schemeValType, llvmInt64(held.size()), "live");
+		for(size_t i = 0; i < held.size(); ++i) {
+			builder_.CreateStore(live[held[i]], builder_.CreateConstInBoundsGEP1_64(schemeValType, liveArr, i));
+		}
+	}
+	auto refill = module_.getFunction("schemeGcRefill");
+	auto slowPayload = builder_.CreateCall(refill, {header, liveArr, llvmInt64(held.size())}, "payload");
+	vector<llvm::Value*> reloaded;
+	for(size_t i = 0; i < held.size(); ++i) {
+		reloaded.push_back(builder_.CreateLoad(schemeValType, builder_.CreateConstInBoundsGEP1_64(schemeValType, liveArr, i)));
+	}
+	builder_.CreateBr(contBB);
+
+	builder_.SetInsertPoint(contBB);
+	auto payload = builder_.CreatePHI(schemeValType->getPointerTo(), 2, "payload");
+	payload->addIncoming(fastPayload, fastBB);
+	payload->addIncoming(slowPayload, slowBB);
+	for(size_t i = 0; i < held.size(); ++i) {
+		auto phi = builder_.CreatePHI(schemeValType, 2);
+		phi->addIncoming(live[held[i]], fastBB);
+		phi->addIncoming(reloaded[i], slowBB);
+		live[held[i]] = phi;
+	}
+	return payload;
+}
+
+llvm::Value* ExprCodeGen::tagPointer(llvm::Value* payload, Scheme::Tag tag, const llvm::Twine& name)
+{
+	return builder_.CreateOr(builder_.CreatePtrToInt(payload, schemeValType), llvmInt64(static_cast<int64_t>(tag)), name);
+}
+
+llvm::Type* ExprCodeGen::repType(VType ty)
+{
+	return ty == VType::Bool? Type::getInt1Ty(ctx_): schemeValType;
+}
+
+// to the representation of `to`. Fixnums are tagged with their low bits zero.
+// The shifts carry no nsw or exact flag: unboxed arithmetic wraps and its
+// operands aren't checked, a flag would turn that into poison
+llvm::Value* ExprCodeGen::convert(llvm::Value* v, VType from, VType to)
+{
+	if(from == to) return v;
+	switch(to) {
+		case VType::Any:
+			return from == VType::Fixnum? builder_.CreateShl(v, 3, "tag"): toSchemeBool(v);
+		case VType::Fixnum:
+			if(from == VType::Bool) v = toSchemeBool(v); // not a fixnum, the program is wrong
+			return builder_.CreateAShr(v, 3, "untag");
+		case VType::Bool:
+			// as a condition: everything but #f is true
+			if(from == VType::Fixnum) return builder_.getTrue();
+			return builder_.CreateICmpNE(v, ConstantInt::getSigned(schemeValType, Scheme::toBoolReps(false)));
+	}
+	return v;
+}
+
+VType ExprCodeGen::varType(const std::string& v) const
+{
+	auto it = varTypes_.find(v);
+	return it != varTypes_.end()? it->second: VType::Any;
+}
+
+llvm::Value* ExprCodeGen::loadTagged(const std::string& v)
+{
+	const auto ty = varType(v);
+	return convert(builder_.CreateLoad(repType(ty), table_.at(v), v), ty, VType::Any);
+}
+
+llvm::AllocaInst* ExprCodeGen::newTemp(llvm::Type* ty, const llvm::Twine& name)
+{
+	auto& entry = builder_.GetInsertBlock()->getParent()->getEntryBlock();
+	return IRBuilder<>(&entry, entry.begin()).CreateAlloca(ty, nullptr, name);
+}
+
+llvm::Value* ExprCodeGen::payloadOf(llvm::Value* v, Scheme::Tag tag)
+{
+	// minus the tag rather than masked, it folds into the addressing of loads
+	auto addr = builder_.CreateSub(v, llvmInt64(static_cast<int64_t>(tag)));
+	return builder_.CreateIntToPtr(addr, schemeValType->getPointerTo());
+}
+
+llvm::Value* ExprCodeGen::hasTag(llvm::Value* v, Scheme::Tag tag, Scheme::Mask mask)
+{
+	auto bits = builder_.CreateAnd(v, llvmInt64(static_cast<int64_t>(mask)));
+	return builder_.CreateICmpEQ(bits, llvmInt64(static_cast<int64_t>(tag)));
+}
+
+llvm::Value* ExprCodeGen::toSchemeBool(llvm::Value* cond)
+{
+	auto ext = builder_.CreateZExt(cond, schemeValType, "boolExt");
+	return builder_.CreateOr(builder_.CreateShl(ext, 5), llvmInt64(0b101), "scmBool");
+}
+
+void ExprCodeGen::checkType(llvm::Value* ok, const std::string& prim, const char* expected, llvm::Value* v)
+{
+	if(!checked_) return;
+
+	auto curFunc = builder_.GetInsertBlock()->getParent();
+	auto errBB = BasicBlock::Create(ctx_, "typeError", curFunc);
+	auto okBB = BasicBlock::Create(ctx_, "typeOk", curFunc);
+	builder_.CreateCondBr(ok, okBB, errBB, MDBuilder(ctx_).createBranchWeights(1000, 1));
+
+	builder_.SetInsertPoint(errBB);
+	builder_.CreateCall(module_.getFunction("schemeTypeError"),
+			{builder_.CreateGlobalStringPtr(prim), builder_.CreateGlobalStringPtr(expected), v});
+	builder_.CreateUnreachable();
+
+	builder_.SetInsertPoint(okBB);
+}
+
+bool ExprCodeGen::genInlinePrim(const std::string& op, std::vector<llvm::Value*>& args)
+{
+	using Scheme::Tag;
+	using Scheme::Mask;
+
+	static const unordered_map<string, pair<Tag, Mask>> predicates {
+		{"null?", {Tag::Nil, Mask::Nil}},
+		{"pair?", {Tag::Pair, Mask::Pair}},
+		{"box?", {Tag::Box, Mask::Box}},
+		{"vector?", {Tag::Vector, Mask::Vector}},
+		{"symbol?", {Tag::Symbol, Mask::Symbol}},
+		{"number?", {Tag::Fixnum, Mask::Fixnum}},
+		{"boolean?", {Tag::Bool, Mask::Bool}},
+		{"void?", {Tag::Void, Mask::Void}},
+	};
+	auto voidV = llvmInt64(static_cast<int64_t>(Tag::Void));
+
+	if(auto it = predicates.find(op); it != predicates.end()) {
+		checkArity(args.size(), 1);
+		value_ = hasTag(args[0], it->second.first, it->second.second);
+		vty_ = VType::Bool;
+	}else if(op == "eq?") {
+		checkArity(args.size(), 2);
+		value_ = builder_.CreateICmpEQ(args[0], args[1]);
+		vty_ = VType::Bool;
+	}else if(op == "car" || op == "cdr") {
+		checkArity(args.size(), 1);
+		checkType(hasTag(args[0], Tag::Pair, Mask::Pair), op, "pair", args[0]);
+		auto field = builder_.CreateConstInBoundsGEP1_64(schemeValType, payloadOf(args[0], Tag::Pair), op == "car"? 0: 1);
+		value_ = builder_.CreateLoad(schemeValType, field, op);
+	}else if(op == "unbox") {
+		checkArity(args.size(), 1);
+		checkType(hasTag(args[0], Tag::Box, Mask::Box), op, "box", args[0]);
+		value_ = builder_.CreateLoad(schemeValType, payloadOf(args[0], Tag::Box), op);
+	}else if(op == "set-box!") {
+		checkArity(args.size(), 2);
+		checkType(hasTag(args[0], Tag::Box, Mask::Box), op, "box", args[0]);
+		builder_.CreateStore(args[1], payloadOf(args[0], Tag::Box));
+		value_ = voidV;
+	}else if(op == "vector-length") {
+		checkArity(args.size(), 1);
+		checkType(hasTag(args[0], Tag::Vector, Mask::Vector), op, "vector", args[0]);
+		value_ = builder_.CreateLoad(schemeValType, payloadOf(args[0], Tag::Vector), "len");
+		vty_ = VType::Fixnum;
+	}else if(op == "vector-ref" || op == "vector-set!") {
+		checkArity(args.size(), op == "vector-ref"? 2: 3);
+		auto vec = args[0], idx = args[1];
+		checkType(hasTag(vec, Tag::Vector, Mask::Vector), op, "vector", vec);
+		auto payload = payloadOf(vec, Tag::Vector);
+		auto i = convert(idx, VType::Any, VType::Fixnum);
+		if(checked_) {
+			checkType(hasTag(idx, Tag::Fixnum, Mask::Fixnum), op, "fixnum", idx);
+			auto len = builder_.CreateLoad(schemeValType, payload, "len");
+			checkType(builder_.CreateICmpULT(i, len), op, "index in range", idx);
+		}
+		// the elements follow the length and the pointer to them, see gc.h
+		auto elem = builder_.CreateInBoundsGEP(schemeValType, payload, builder_.CreateAdd(i, llvmInt64(2)));
+		if(op == "vector-ref") {
+			value_ = builder_.CreateLoad(schemeValType, elem, "elem");
+		}else {
+			builder_.CreateStore(args[2], elem);
+			value_ = voidV;
+		}
+	}else {
+		return false;
+	}
+	return true;
+}
+
+llvm::AllocaInst* ExprCodeGen::newRoot(const llvm::Twine& name)
+{
+	return ProgramCodeGen::createRoot(*builder_.GetInsertBlock()->getParent(), name);
+}
+
+// in the entry block, cleared there: the collector may run before the first
+// store to the slot. Slots hold tagged values, not pointers, llvm wants the
+// metadata of such roots to be non-null
+llvm::AllocaInst* ProgramCodeGen::createRoot(llvm::Function& func, const llvm::Twine& name)
+{
+	auto& ctx = func.getContext();
+	auto& md = *func.getParent();
+	auto& entry = func.getEntryBlock();
+	IRBuilder<> atEntry(&entry, entry.begin());
+
+	auto i8PtrTy = Type::getInt8PtrTy(ctx);
+	auto meta = md.getNamedGlobal("schemeValueRoot");
+	if(!meta) {
+		meta = new GlobalVariable(md, Type::getInt8Ty(ctx), true, llvm::GlobalValue::PrivateLinkage,
+				ConstantInt::get(Type::getInt8Ty(ctx), 0), "schemeValueRoot");
+	}
+
+	auto root = atEntry.CreateAlloca(Type::getInt64Ty(ctx), nullptr, name);
+	auto gcroot = Intrinsic::getDeclaration(&md, Intrinsic::gcroot);
+	atEntry.CreateCall(gcroot, {atEntry.CreateBitCast(root, i8PtrTy->getPointerTo()), ConstantExpr::getBitCast(meta, i8PtrTy)});
+	atEntry.CreateStore(ConstantInt::get(Type::getInt64Ty(ctx), 0), root);
+	return root;
+}
 
 void ProgramCodeGen::initializeGlobalDecls()
 {
@@ -298,26 +833,96 @@ void ProgramCodeGen::initializeGlobalDecls()
 	}
 
 	//struct Closure (see in runtime.h)
-	vector<Type*> elemts { Type::getInt32Ty(ctx_), Type::getInt8PtrTy(ctx_), Type::getInt64Ty(ctx_)->getPointerTo()};
+	vector<Type*> elemts { Type::getInt8PtrTy(ctx_), Type::getInt64Ty(ctx_)};
 	StructType::create(ctx_, elemts, "Closure");
 
 	auto llvmcharPtrTy = Type::getInt8PtrTy(ctx_);
-	auto llvmInt32Ty = Type::getInt32Ty(ctx_);
-	auto llvmInt8Ty = Type::getInt8Ty(ctx_);
 
-	//schemeAllocateClosure
+	//thread local allocation buffer, see gc.h
+	auto tlabTy = StructType::create(ctx_, {llvmcharPtrTy, llvmcharPtrTy}, "Tlab");
+	new GlobalVariable(module_, tlabTy, false, llvm::GlobalValue::ExternalLinkage, nullptr, "schemeTlab",
+			nullptr, llvm::GlobalValue::InitialExecTLSModel);
+
+	//schemeGcRefill
+	Function::Create(
+			FunctionType::get(schemeValType->getPointerTo(), {schemeValType, schemeValType->getPointerTo(), schemeValType}, false),
+			llvm::GlobalValue::ExternalLinkage,
+			"schemeGcRefill",
+			&module_);
+
+	//schemeGcInit
 	Function::Create(
-			FunctionType::get(schemeValType,{llvmcharPtrTy, llvmInt32Ty, llvmInt32Ty}, true), 
-			llvm::GlobalObject::ExternalLinkage, 
-			"schemeAllocateClosure", 
+			FunctionType::get(Type::getVoidTy(ctx_), {schemeValType->getPointerTo()->getPointerTo(), schemeValType}, false),
+			llvm::GlobalValue::ExternalLinkage,
+			"schemeGcInit",
 			&module_);
 
+	//schemeTypeError
+	auto typeError = Function::Create(
+			FunctionType::get(Type::getVoidTy(ctx_), {llvmcharPtrTy, llvmcharPtrTy, schemeValType}, false),
+			llvm::GlobalValue::ExternalLinkage,
+			"schemeTypeError",
+			&module_);
+	typeError->setDoesNotReturn();
+	typeError->addFnAttr(Attribute::Cold);
+
 	//schemeInternSymbol
 	Function::Create(
 			FunctionType::get(schemeValType, Type::getInt8PtrTy(ctx_), false), 
 			llvm::GlobalValue::ExternalLinkage, 
 			"schemeInternSymbol",
 			&module_);
+
+	//schemeInternSymbols
+	Function::Create(
+			FunctionType::get(Type::getVoidTy(ctx_), {llvmcharPtrTy->getPointerTo(), schemeValType}, false),
+			llvm::GlobalValue::ExternalLinkage,
+			"schemeInternSymbols",
+			&module_);
+
+	// what llvm may assume of the runtime (runtime.h, gc.h): nothing unwinds
+	// out of it, running out of memory exits like a type error. So only what
+	// never allocates (nor prints) surely returns. The predicates only look at
+	// the tag and the accessors only read
+	static const unordered_set<string> pure {
+		"null?", "pair?", "symbol?", "number?", "boolean?", "eq?", "box?", "vector?", "void?"
+	};
+	static const unordered_set<string> readers { "car", "cdr", "unbox", "vector-ref", "vector-length" };
+	static const unordered_set<string> writers { "set-box!", "vector-set!" };
+	for(auto& f: module_.functions()) f.setDoesNotThrow();
+	for(const auto& name: pure) module_.getFunction(simpleMangle(name))->setDoesNotAccessMemory();
+	for(const auto& name: readers) module_.getFunction(simpleMangle(name))->setOnlyReadsMemory();
+	for(const auto names: {&pure, &readers, &writers}) {
+		for(const auto& name: *names) module_.getFunction(simpleMangle(name))->addFnAttr(Attribute::WillReturn);
+	}
+}
+
+// Definitions of the runtime functions the program calls, from runtime.cpp
+// compiled to bitcode, so that llvm can inline them. They are made internal,
+// the collector (gc.cpp) and what they call of it stays in libruntime
+void ProgramCodeGen::linkRuntime(const std::string& path)
+{
+	SMDiagnostic err;
+	auto runtime = parseIRFile(path, err, ctx_);
+	if(!runtime) throw std::runtime_error(fmt::format("can't load runtime {}: {}", path, err.getMessage().str()));
+
+	if(module_.getTargetTriple().empty()) {
+		module_.setTargetTriple(runtime->getTargetTriple());
+		module_.setDataLayout(runtime->getDataLayout());
+	}
+
+	unordered_set<string> declared;
+	for(auto& f: module_.functions()) {
+		if(f.isDeclaration()) declared.insert(f.getName().str());
+	}
+
+	if(Linker::linkModules(module_, std::move(runtime), Linker::Flags::LinkOnlyNeeded)) {
+		throw std::runtime_error(fmt::format("can't link runtime {}", path));
+	}
+
+	for(auto& f: module_.functions()) {
+		if(!f.isDeclaration() && declared.count(f.getName().str())) f.setLinkage(GlobalValue::InternalLinkage);
+	}
 }
 
 
@@ -335,6 +940,8 @@ void ProgramCodeGen::gen(FrontEndPass::Program& prog)
 {
 	initializeGlobalDecls();
 
+	vector<Constant*> globalRoots;
+
 	for(auto& [def, passCtx]: prog) {
 		if(def.body_->type_ == Expr::Type::Lambda) {
 			const auto& lambda = static_cast<const Lambda&>(*def.body_);
@@ -342,6 +949,8 @@ void ProgramCodeGen::gen(FrontEndPass::Program& prog)
 			vector<Type*> paramTys{lambda.arity(), schemeValType};
 			auto funcTy = FunctionType::get(schemeValType, paramTys, false);
 			auto func = Function::Create(funcTy, llvm::GlobalValue::ExternalLinkage, simpleMangle(def.name_.v_), &module_);
+			func->setGC("shadow-stack");
+			if(def.name_.v_ != "main") func->setCallingConv(CallingConv::Tail); // main is called from C
 			//先全局扫一遍构造好top-level的绑定，再生成函数体
 
 		}else if(def.body_->type_ == Expr::Type::Number) {
@@ -350,12 +959,18 @@ void ProgramCodeGen::gen(FrontEndPass::Program& prog)
 			auto glob = module_.getNamedGlobal(def.name_.v_);
 			glob->setLinkage(llvm::GlobalValue::InternalLinkage);
 			glob->setInitializer(ConstantInt::getSigned(schemeValType, Scheme::toFixnumReps(static_cast<NumberE&>(*def.body_).value_)));
+			globalRoots.push_back(glob); // may be set! to a heap object later
 
 		}else {
 			throw std::runtime_error("unsupported complex global construct, maybe there's bug in racket frontend pass"); 
 		}
 	}
 
+	auto rootsTy = ArrayType::get(schemeValType->getPointerTo(), globalRoots.size());
+	auto rootsTable = new GlobalVariable(module_, rootsTy, true, llvm::GlobalValue::PrivateLinkage,
+			ConstantArray::get(rootsTy, globalRoots), "schemeGlobalRoots");
+
+	CallInst* gcInit = nullptr;
 	for(auto& [def, passCtx]: prog) {
 		if(def.body_->type_ == Expr::Type::Lambda) {
 			const auto& lambda = static_cast<const Lambda&>(*def.body_);
@@ -363,29 +978,54 @@ void ProgramCodeGen::gen(FrontEndPass::Program& prog)
 			auto func = module_.getFunction(simpleMangle(def.name_.v_));
 			auto entryBB = BasicBlock::Create(ctx_, "entry", func);
 			builder_.SetInsertPoint(entryBB);
+			if(def.name_.v_ == "main") {
+				gcInit = builder_.CreateCall(module_.getFunction("schemeGcInit"),
+						{builder_.CreateConstGEP2_64(rootsTy, rootsTable, 0, 0), ConstantInt::get(schemeValType, globalRoots.size())});
+			}
+
+			// a self call in tail position jumps back to the loop header with
+			// the new arguments, llvm sees the loop and its induction variables
+			const bool tail = func->getCallingConv() == CallingConv::Tail;
+			auto loopBB = BasicBlock::Create(ctx_, "selfLoop", func);
+			builder_.CreateBr(loopBB);
+			builder_.SetInsertPoint(loopBB);
 
 			SymTable table;
-			const auto& args = func->args();
+			vector<PHINode*> phis;
 			const auto& params = *lambda.params_;
 			int i = 0;
-			for(auto it = args.begin(); it != args.end(); ++it, ++i) {
-				if(passCtx.assignedVars.count(params[i]) == 0) { //如果一个变量会被赋值，则为其分配内存，后续llvm的mem2reg会处理为SSA
-					table[params[i]] = it;
-				}else {
-					auto alloc = builder_.CreateAlloca(schemeValType, nullptr, fmt::format("allca_{}" ,params[i].v_));
-					table[params[i]] = alloc;
-					builder_.CreateStore(it, alloc);
-				}
+			for(auto& arg: func->args()) {
+				auto root = createRoot(*func, params[i].v_);
+				table[params[i++]] = root;
+				auto phi = builder_.CreatePHI(schemeValType, 2, arg.getName());
+				phi->addIncoming(&arg, entryBB);
+				phis.push_back(phi);
+			}
+			for(size_t i = 0; i < phis.size(); ++i) {
+				builder_.CreateStore(phis[i], table.at(params[i]));
 			}
 
-			ExprCodeGen exprGen(builder_, module_, passCtx, table);
-			lambda.body_->accept(exprGen);
-			builder_.CreateRet(exprGen.getValue());
+			ExprCodeGen exprGen(builder_, module_, passCtx, table, symbols_, checked_);
+			if(tail) exprGen.setSelfLoop(func, loopBB, std::move(phis));
+			exprGen.genBody(*lambda.body_, tail);
 
 			verifyFunction(*func, &llvm::errs());
 
 		}
 	}
+
+	// every symbol is known by now, main gives them their ids before anything runs
+	if(gcInit && !symbols_.empty()) {
+		auto charPtrTy = Type::getInt8PtrTy(ctx_);
+		vector<Constant*> names(symbols_.size());
+		for(const auto& [name, sym]: symbols_) names[sym.id] = ConstantExpr::getBitCast(sym.name, charPtrTy);
+		auto namesTy = ArrayType::get(charPtrTy, names.size());
+		auto namesTable = new GlobalVariable(module_, namesTy, true, llvm::GlobalValue::PrivateLinkage,
+				ConstantArray::get(namesTy, names), "schemeSymbols");
+		IRBuilder<> mainBuilder(gcInit->getNextNode());
+		mainBuilder.CreateCall(module_.getFunction("schemeInternSymbols"),
+				{mainBuilder.CreateConstGEP2_64(namesTy, namesTable, 0, 0), ConstantInt::get(schemeValType, names.size())});
+	}
 	verifyModule(module_, &llvm::errs());
 
 }
@@ -4,7 +4,12 @@
 
 #include "llvm/IR/IRBuilder.h"
 #include "front-end-pass.h"
+#include "gc.h"
+#include "runtime.h"
 #include "scheme.h"
+#include "type-inference.h"
+#include <cstddef>
+#include <memory>
 
 /*
 class SymTable  //environment
@@ -41,13 +46,26 @@ private:
 */
 
 using SymTable = std::map<std::string, llvm::Value*>;
+using VType = TypeInference::Type;
+
+// a symbol the program mentions: its name as a C string and its id at run
+// time. main interns them all in the order of their ids first, see
+// Runtime::Sym
+struct SymbolLit
+{
+	llvm::GlobalVariable* name;
+	int64_t id;
+};
+using SymbolLits = std::map<std::string, SymbolLit>;
 
 class ExprCodeGen : public VisitorE
 {
 public:
 
-	ExprCodeGen(llvm::IRBuilder<>& bder, llvm::Module& md, FrontEndPass::PassContext& ctx, SymTable& tb): 
-		builder_(bder), module_(md), ctx_(bder.getContext()), curCtx_(ctx), table_(tb)
+	// with `checked`, primitives generated inline check the types of their
+	// operands, closure calls the arity of the closure
+	ExprCodeGen(llvm::IRBuilder<>& bder, llvm::Module& md, FrontEndPass::PassContext& ctx, SymTable& tb, SymbolLits& syms, bool checked): 
+		builder_(bder), module_(md), ctx_(bder.getContext()), curCtx_(ctx), table_(tb), symbols_(syms), checked_(checked)
 	{
 		schemeValType = llvm::Type::getInt64Ty(ctx_);
 		closureType_ = llvm::StructType::getTypeByName(ctx_, "Closure");
@@ -55,6 +73,14 @@ public:
 
 	llvm::Value* getValue() { return value_; }
 
+	// the body of a function, returning its value. With `tail`, calls in tail
+	// position to generated code are musttail calls, they run in constant stack
+	void genBody(const Expr& body, bool tail);
+	// tail calls to `fn`, the function of the body, jump to `header`
+	void setSelfLoop(llvm::Function* fn, llvm::BasicBlock* header, std::vector<llvm::PHINode*> params) {
+		self_ = SelfLoop{fn, header, std::move(params)};
+	}
+
 	~ExprCodeGen(){};
 private:
 
@@ -70,13 +96,51 @@ private:
 	void forLetRec(const LetRec&) override {} //TODO
     void forLambda(const Lambda&) override;
     void forApply(const Apply&) override;
+    void forCase(const Case&) override;
 
 	static void checkArity(size_t actual, size_t expect);
 
+	// `e` not in tail position
+	void genValue(const Expr& e);
+	// value_ is null once the code returned, after a tail call
+	void returnValue();
+	void genCall(llvm::CallInst* call);
+
+	llvm::Function* genLifted(const Lambda& lam, const std::vector<std::string>& fvs, bool noClosure);
+
 	auto llvmInt64(int64_t v) { 
 		return llvm::ConstantInt::getSigned(llvm::IntegerType::getInt64Ty(ctx_), v); 
 	}
 	
+	llvm::Value* internSymbol(const std::string& name); // interned at run time, not a constant
+	const SymbolLit& symbolLit(const std::string& name);
+	// a slot of the shadow stack, the collector updates the value it holds
+	llvm::AllocaInst* newRoot(const llvm::Twine& name);
+	// a plain slot in the entry block, for unboxed values
+	llvm::AllocaInst* newTemp(llvm::Type* ty, const llvm::Twine& name);
+
+	llvm::Type* repType(VType ty);
+	llvm::Value* convert(llvm::Value* v, VType from, VType to);
+	VType varType(const std::string& v) const; // of the slot of a variable
+	llvm::Value* loadTagged(const std::string& v);
+	// payload of a new object, bumped inline out of the thread's buffer. The
+	// values in `live` are held across a refill and updated in place
+	llvm::Value* allocate(Runtime::Gc::Kind kind, size_t words, std::vector<llvm::Value*>& live);
+	llvm::Value* tagPointer(llvm::Value* payload, Scheme::Tag tag, const llvm::Twine& name);
+	// the object `v` points at, as words
+	llvm::Value* payloadOf(llvm::Value* v, Scheme::Tag tag);
+
+	// accessors and predicates as IR, false for the other primitives
+	bool genInlinePrim(const std::string& op, std::vector<llvm::Value*>& args);
+	llvm::Value* hasTag(llvm::Value* v, Scheme::Tag tag, Scheme::Mask mask);
+	llvm::Value* toSchemeBool(llvm::Value* cond);
+	// unless `ok`, calls schemeTypeError on a cold path. Nothing when unchecked
+	void checkType(llvm::Value* ok, const std::string& prim, const char* expected, llvm::Value* v);
+
+	// words of a closure before its free variables
+	static constexpr size_t ClosureWords = sizeof(Runtime::Closure) / sizeof(Scheme::ValueType);
+	static constexpr size_t SymIdWord = offsetof(Runtime::Sym, id) / sizeof(Scheme::ValueType);
+
 	llvm::Value* getSchemeInt(int v) {
 		return llvm::ConstantInt::getSigned(llvm::IntegerType::get(ctx_, 64), Scheme::toFixnumReps(v)); //see scheme.h value tagging
 	}
@@ -86,25 +150,54 @@ private:
 	llvm::LLVMContext& ctx_;
 
 	llvm::Value* value_; //codegen result
+	VType vty_{VType::Any}; // how value_ is represented
 
 	FrontEndPass::PassContext curCtx_; //current function pass context info
 
 
 	//std::unique_ptr<SymTable> table_;
-	std::map<std::string, llvm::Value*> table_;
+	std::map<std::string, llvm::Value*> table_; // variables, by their shadow stack slot
+	SymbolLits& symbols_; // of the whole program
+
+	// let bound lambdas, called directly
+	struct KnownFn
+	{
+		llvm::Function* fn;
+		std::vector<std::string> fvs; // passed after the arguments when noClosure
+		bool noClosure; // without a closure, the variable has no slot
+	};
+	std::map<std::string, KnownFn> known_;
+	llvm::Function* lifted_{nullptr}; // by the last forLambda
+	bool tail_{false};
+
+	struct SelfLoop
+	{
+		llvm::Function* fn{nullptr};
+		llvm::BasicBlock* header{nullptr};
+		std::vector<llvm::PHINode*> params; // the arguments of an iteration
+	} self_;
+
+	std::unique_ptr<TypeInference> types_; // of the body, see genBody
+	std::map<std::string, VType> varTypes_; // unboxed let bound variables
 	llvm::Type *schemeValType;
 	llvm::Type *closureType_;
+	bool checked_;
 };
 
 class ProgramCodeGen
 {
 public:
-	ProgramCodeGen(): module_("schemeMain", ctx_), builder_(ctx_) { schemeValType = llvm::Type::getInt64Ty(ctx_); }
+	ProgramCodeGen(bool checked = true): module_("schemeMain", ctx_), builder_(ctx_), checked_(checked) { schemeValType = llvm::Type::getInt64Ty(ctx_); }
 
 	void gen(FrontEndPass::Program& prog);
+	// after gen, the bitcode of the runtime to link in, see CMakeLists.txt
+	void linkRuntime(const std::string& path);
 	void printIR();
 
 	static std::string simpleMangle(const std::string& s);
+	// a shadow stack slot of `func`, see gc.h. Values held across a call that
+	// may allocate must live in one, the collector moves what they point at
+	static llvm::AllocaInst* createRoot(llvm::Function& func, const llvm::Twine& name);
 private:
 	void initializeGlobalDecls();
 
@@ -112,7 +205,35 @@ private:
 	llvm::Module module_;
 	llvm::IRBuilder<> builder_;
 	llvm::Type *schemeValType;
+	SymbolLits symbols_;
+	bool checked_;
+};
+
+// whether a variable is used other than as the operator of a call outside
+// of any lambda, that is whether a closure for it must exist
+class EscapeScanner: public ExprMapper
+{
+public:
+	EscapeScanner(const std::string& v): v_(v) {}
+	bool escapes() const { return escapes_; }
+
+private:
+    virtual void forVar(const Var& v) override { if(v.v_ == v_) escapes_ = true; }
+    virtual void forLambda(const Lambda& lam) override { 
+		++depth_;
+		lam.body_->accept(*this);
+		--depth_;
+	}
+    virtual void forApply(const Apply& app) override {
+		const bool direct = depth_ == 0 && app.operator_->type_ == Expr::Type::Var &&
+			static_cast<const Var&>(*app.operator_).v_ == v_;
+		if(!direct) app.operator_->accept(*this);
+		for(const auto& arg: app.operands_) arg->accept(*this);
+	}
 
+	const std::string& v_;
+	bool escapes_{false};
+	int depth_{0};
 };
 
 class FreeVarScanner: public ExprMapper
@@ -1,8 +1,10 @@
 #!/bin/zsh
 output_path=../build/compiler
 compiler=$output_path/sch-c
+runtime=()
+[[ -f $output_path/runtime.bc ]] && runtime=(--runtime $output_path/runtime.bc)
 
 LD_LIBRARY_PATH=$output_path
 export LD_LIBRARY_PATH
 
-clang++ -L$output_path -lruntime -x assembler =(./transforms.rkt|$compiler|llc-14 --relocation-model=pic)
+clang++ -L$output_path -lruntime -x assembler =(./transforms.rkt|$compiler $runtime|llc-14 --relocation-model=pic)
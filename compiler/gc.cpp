@@ -0,0 +1,166 @@
+#include "gc.h"
+#include "runtime.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+using namespace std;
+using Scheme::ValueType;
+
+extern "C"
+{
+	// defined by programs with shadow stack frames, weak for the others
+	__attribute__((weak)) Runtime::Gc::StackEntry *llvm_gc_root_chain = nullptr;
+
+	thread_local Runtime::Gc::Tlab schemeTlab{nullptr, nullptr};
+}
+
+namespace Runtime::Gc
+{
+
+namespace
+{
+	constexpr size_t InitialSize = size_t(4) << 20; // bytes of a semispace
+	constexpr size_t TlabSize = size_t(32) << 10;
+
+	// payload words before the values of a vector or closure
+	constexpr size_t VecFields = sizeof(Runtime::Vec) / sizeof(ValueType);
+	constexpr size_t ClosureFields = sizeof(Runtime::Closure) / sizeof(ValueType);
+
+	struct Space
+	{
+		char *base{nullptr}, *free{nullptr}, *limit{nullptr};
+	};
+
+	Space heap;
+	size_t nextSize = InitialSize;
+	size_t count = 0;
+	vector<ValueType*> globals;
+
+	uint64_t& headerOf(ValueType *payload) { return reinterpret_cast<uint64_t*>(payload)[-1]; }
+	Kind kindOf(uint64_t hdr) { return static_cast<Kind>(hdr & 0xff); }
+	size_t wordsOf(uint64_t hdr) { return hdr >> 8; }
+
+	bool isHeapRef(ValueType v)
+	{
+		switch(static_cast<Scheme::Tag>(v & 0b111)) {
+			case Scheme::Tag::Pair:
+			case Scheme::Tag::Vector:
+			case Scheme::Tag::Closure:
+			case Scheme::Tag::Box: return true;
+			default: return false;
+		}
+	}
+
+	// the pointer of a vector into its own payload
+	void fixInterior(Kind kind, ValueType *payload)
+	{
+		if(kind == Kind::Vec) reinterpret_cast<Runtime::Vec*>(payload)->arr = payload + VecFields;
+	}
+
+	// copy the object `v` points at to tospace once, then point `v` at the copy
+	void forward(ValueType& v, char*& free)
+	{
+		if(!isHeapRef(v)) return;
+
+		const auto tag = v & 0b111;
+		auto obj = reinterpret_cast<ValueType*>(v & ~ValueType(0b111));
+		auto& hdr = headerOf(obj);
+		if(kindOf(hdr) != Kind::Forwarded) {
+			const auto bytes = (wordsOf(hdr) + 1) * sizeof(ValueType);
+			memcpy(free, &hdr, bytes);
+			auto copy = reinterpret_cast<ValueType*>(free) + 1;
+			free += bytes;
+			fixInterior(kindOf(hdr), copy);
+
+			hdr = makeHeader(Kind::Forwarded, 0);
+			obj[0] = reinterpret_cast<ValueType>(copy);
+		}
+		v = obj[0] | tag;
+	}
+
+	void collect(size_t need, ValueType *live, size_t nlive)
+	{
+		// everything in fromspace may be live, tospace has to hold it all
+		const size_t used = heap.free - heap.base;
+		const size_t size = max(nextSize, used + need);
+		auto to = static_cast<char*>(malloc(size));
+		if(!to) {
+			// generated code calls in here as nounwind, nothing may be thrown
+			fprintf(stderr, "out of memory: can't grow the heap to %zu bytes\n", size);
+			exit(1);
+		}
+
+		char *free = to;
+		for(auto entry = llvm_gc_root_chain; entry; entry = entry->next) {
+			auto roots = entry->roots();
+			for(int32_t i = 0; i < entry->map->numRoots; ++i) forward(roots[i], free);
+		}
+		for(auto g: globals) forward(*g, free);
+		for(size_t i = 0; i < nlive; ++i) forward(live[i], free);
+
+		// the copies between scan and free still point into fromspace
+		for(char *scan = to; scan < free; ) {
+			const auto hdr = *reinterpret_cast<uint64_t*>(scan);
+			auto payload = reinterpret_cast<ValueType*>(scan) + 1;
+			const auto words = wordsOf(hdr);
+			switch(kindOf(hdr)) {
+				case Kind::Cons:	forward(payload[0], free); forward(payload[1], free); break;
+				case Kind::Box:		forward(payload[0], free); break;
+				case Kind::Vec:		for(size_t i = VecFields; i < words; ++i) forward(payload[i], free); break;
+				case Kind::Closure:	for(size_t i = ClosureFields; i < words; ++i) forward(payload[i], free); break;
+				case Kind::Forwarded: break;
+			}
+			scan += (words + 1) * sizeof(ValueType);
+		}
+
+		::free(heap.base);
+		heap = Space{to, free, to + size};
+		++count;
+
+		// grow once the live data fills half of the space
+		if((free - to + need) * 2 > size) nextSize = size * 2;
+
+		// the old buffer is gone with fromspace
+		schemeTlab = Tlab{nullptr, nullptr};
+	}
+
+	// bump `hdr` with its payload out of the buffer, taking a new one when it
+	// is too small. Big objects get a buffer of their own
+	ValueType* bump(uint64_t hdr, ValueType *live, size_t nlive)
+	{
+		const size_t bytes = (wordsOf(hdr) + 1) * sizeof(ValueType);
+		if(size_t(schemeTlab.limit - schemeTlab.free) < bytes) {
+			const size_t size = max(TlabSize, bytes);
+			if(size_t(heap.limit - heap.free) < size) collect(size, live, nlive);
+			schemeTlab = Tlab{heap.free, heap.free + size};
+			heap.free += size;
+		}
+
+		auto p = reinterpret_cast<uint64_t*>(schemeTlab.free);
+		schemeTlab.free += bytes;
+		*p = hdr;
+		return reinterpret_cast<ValueType*>(p + 1);
+	}
+}
+
+ValueType* allocate(Kind kind, size_t words, ValueType *live, size_t nlive)
+{
+	return bump(makeHeader(kind, words), live, nlive);
+}
+
+size_t collections() { return count; }
+
+}
+
+ValueType* schemeGcRefill(uint64_t header, ValueType* live, int64_t nlive) noexcept
+{
+	return Runtime::Gc::bump(header, live, nlive);
+}
+
+void schemeGcInit(ValueType** globals, int64_t n) noexcept
+{
+	Runtime::Gc::globals.assign(globals, globals + n);
+}
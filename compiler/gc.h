@@ -0,0 +1,67 @@
+#pragma once
+
+#include "scheme.h"
+#include <cstddef>
+#include <cstdint>
+
+// Cheney copying collector for the heap of compiled programs.
+//
+// Every object is a header word followed by its payload, values point at the
+// payload and carry the tag of its type (see scheme.h): pairs, vectors,
+// closures and boxes live here, symbols are interned outside of it and never
+// move. Roots are the slots of the LLVM shadow stack (every function is
+// compiled with gc "shadow-stack", see ExprCodeGen::newRoot), the globals
+// registered by schemeGcInit, and the values a runtime function is holding
+// while it allocates.
+//
+// Objects are bumped out of a thread local allocation buffer carved from the
+// heap. Generated code does that inline (see ExprCodeGen::allocate) and only
+// calls schemeGcRefill when the buffer is used up. Collections still assume
+// a single mutator: the shadow stack is not per thread.
+namespace Runtime::Gc
+{
+	enum class Kind : uint8_t { Cons, Box, Vec, Closure, Forwarded };
+
+	// layout of the frames llvm links into llvm_gc_root_chain
+	struct FrameMap
+	{
+		int32_t numRoots;
+		int32_t numMeta;
+	};
+
+	struct StackEntry
+	{
+		StackEntry *next;
+		const FrameMap *map;
+		// followed by map->numRoots slots
+		Scheme::ValueType* roots() { return reinterpret_cast<Scheme::ValueType*>(this + 1); }
+	};
+
+	// the part of the heap the current thread allocates from
+	struct Tlab
+	{
+		char *free;
+		char *limit;
+	};
+
+	constexpr uint64_t makeHeader(Kind kind, std::size_t words) { return words << 8 | static_cast<uint64_t>(kind); }
+
+	// payload of a new object of `words` words. May collect first: values the
+	// caller still needs go in `live`, they are updated in place
+	Scheme::ValueType* allocate(Kind kind, std::size_t words, Scheme::ValueType* live = nullptr, std::size_t nlive = 0);
+
+	std::size_t collections();
+}
+
+extern "C"
+{
+	// initial-exec, generated code reaches it without calling into the runtime
+	extern __attribute__((tls_model("initial-exec"))) thread_local Runtime::Gc::Tlab schemeTlab;
+
+	// payload of a new object once the buffer can't hold it, with `header`
+	// written before it. Values in `live` are updated as by allocate
+	Scheme::ValueType* schemeGcRefill(uint64_t header, Scheme::ValueType* live, int64_t nlive) noexcept;
+
+	// the globals of the program, called by main before anything is allocated
+	void schemeGcInit(Scheme::ValueType** globals, int64_t n) noexcept;
+}
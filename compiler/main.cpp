@@ -9,8 +9,23 @@ using namespace Parser;
 
 
 
-int main()
+// --unchecked: no type checks in the primitives generated inline, no arity
+// checks of closure calls
+// --runtime <runtime.bc>: link the runtime bitcode into the program
+int main(int argc, char** argv)
 {
+	bool checked = true;
+	string runtime;
+	for(int i = 1; i < argc; ++i) {
+		string arg = argv[i];
+		if(arg == "--unchecked") checked = false;
+		else if(arg == "--runtime" && i + 1 < argc) runtime = argv[++i];
+		else {
+			cerr << "usage: " << argv[0] << " [--unchecked] [--runtime <runtime.bc>]" << endl;
+			return 1;
+		}
+	}
+
 	cin >> std::noskipws;
 
 	istream_iterator<char> inBegin{std::cin};
@@ -23,9 +38,10 @@ int main()
 	if(prog) {
 		auto& p = *prog.getValue();
 		FrontEndPass::runAllPass(p);
-		ProgramCodeGen gen;
+		ProgramCodeGen gen(checked);
 		try {
 			gen.gen(p);
+			if(!runtime.empty()) gen.linkRuntime(runtime);
 			gen.printIR();
 		}catch(exception& ex) {
 			cerr << "Codegen failed:" << ex.what() << endl;
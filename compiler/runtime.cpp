@@ -1,8 +1,9 @@
 #include "runtime.h"
+#include "gc.h"
 #include "scheme.h"
 #include <iostream>
 #include <sstream>
-#include <cstdarg>
+#include <cstdlib>
 #include <memory>
 
 using namespace std;
@@ -101,7 +102,7 @@ static ostream& ToString(ostream& os, SchemeValTy val)
 	return os;
 }
 
-SchemeValTy display(SchemeValTy val)
+SchemeValTy display(SchemeValTy val) noexcept
 { 
 	ostringstream oss;
 	ToString(oss, val);
@@ -109,9 +110,12 @@ SchemeValTy display(SchemeValTy val)
 	return static_cast<SchemeValTy>(Scheme::Tag::Void);
 }
 
+using Runtime::Gc::Kind;
+
 SchemeValTy cons(SchemeValTy v1, SchemeValTy v2)
 {
-	auto pr = new Runtime::Cons{v1, v2};
+	SchemeValTy live[] = {v1, v2};
+	auto pr = new (Runtime::Gc::allocate(Kind::Cons, 2, live, 2)) Runtime::Cons{live[0], live[1]};
 	return TagSchemeVal(pr, Pair);
 }
 
@@ -129,8 +133,7 @@ SchemeValTy cdr(SchemeValTy pr)
 
 SchemeValTy box(SchemeValTy val)
 {
-	auto b = new Runtime::Box;
-	b->val = val;
+	auto b = new (Runtime::Gc::allocate(Kind::Box, 1, &val, 1)) Runtime::Box{val};
 	return TagSchemeVal(b, Box);
 }
 
@@ -150,9 +153,10 @@ SchemeValTy set_45_box_33_(SchemeValTy b, SchemeValTy val)
 
 SchemeValTy  make_45_vector(SchemeValTy len, SchemeValTy val)
 {
-	auto v = new Runtime::Vec;
-	v->len = len >> 3;
-	v->arr = new SchemeValTy [v->len];
+	// the elements follow the vector in the same object
+	const size_t n = len >> 3;
+	auto payload = Runtime::Gc::allocate(Kind::Vec, sizeof(Runtime::Vec) / sizeof(SchemeValTy) + n, &val, 1);
+	auto v = new (payload) Runtime::Vec{n, payload + sizeof(Runtime::Vec) / sizeof(SchemeValTy)};
 	std::fill(v->arr, v->arr + v->len, val);
 	return TagSchemeVal(v, Vector);
 }
@@ -160,7 +164,7 @@ SchemeValTy  make_45_vector(SchemeValTy len, SchemeValTy val)
 SchemeValTy  vector_45_ref(SchemeValTy v, SchemeValTy idx)
 {
 	auto vp = ToVecPtr(v);
-	return vp->arr[idx];
+	return vp->arr[idx >> 3];
 }
 
 SchemeValTy vector_45_length(SchemeValTy v)
@@ -172,35 +176,19 @@ SchemeValTy vector_45_length(SchemeValTy v)
 SchemeValTy vector_45_set_33_(SchemeValTy v, SchemeValTy idx, SchemeValTy val)
 { 
 	auto vp = ToVecPtr(v);
-	vp->arr[idx] = val;
+	vp->arr[idx >> 3] = val;
 	return static_cast<SchemeValTy>(Scheme::Tag::Void);
 }
 
-SchemeValTy schemeAllocateClosure(char* code, int arity, int fvs, ...)
-{
-	auto clos = new Runtime::Closure;
-	clos->code = code;
-	clos->arity = arity;
-	clos->fvs = new SchemeValTy [fvs];
-
-	va_list vargs;
-	va_start(vargs, fvs);
-	for(int i = 0; i < fvs; ++i) {
-		clos->fvs[i] = va_arg(vargs, Scheme::ValueType);
-	}
-	va_end(vargs);
-
-	return TagSchemeVal(clos, Closure);
-}
-
-SchemeValTy schemeInternSymbol(const char* sym)
+SchemeValTy schemeInternSymbol(const char* sym) noexcept
 {
 	static unordered_map<string, unique_ptr<Runtime::Sym>> pool;
 
 	auto it = pool.find(sym);
 	Runtime::Sym* ret = nullptr;
 	if(it == pool.end()) {
-		auto it = pool.insert({sym, make_unique<Runtime::Sym>(sym)});
+		const auto id = static_cast<int64_t>(pool.size());
+		auto it = pool.insert({sym, make_unique<Runtime::Sym>(sym, id)});
 		ret = it.first->second.get();
 	}else {
 		ret = it->second.get();
@@ -208,6 +196,19 @@ SchemeValTy schemeInternSymbol(const char* sym)
 	return TagSchemeVal(ret, Symbol);
 }
 
+void schemeInternSymbols(const char* const* syms, int64_t n) noexcept
+{
+	for(int64_t i = 0; i < n; ++i) schemeInternSymbol(syms[i]);
+}
+
+void schemeTypeError(const char* prim, const char* expected, SchemeValTy val)
+{
+	ostringstream oss;
+	ToString(oss, val);
+	cerr << prim << ": expected " << expected << ", got " << oss.str() << endl;
+	exit(1);
+}
+
 SchemeValTy null_63_(SchemeValTy val)
 {
 	return Scheme::toBoolReps(IsSchemeType(val, Nil));
@@ -3,10 +3,13 @@
 #include "scheme.h"
 #include <unordered_map>
 
+// Generated code calls all of these as nounwind (see
+// ProgramCodeGen::initializeGlobalDecls): errors are reported and exit, the
+// ones that use the standard library are noexcept
 extern "C"
 {
 	using SchemeValTy = Scheme::ValueType;
-	SchemeValTy display(SchemeValTy);
+	SchemeValTy display(SchemeValTy) noexcept;
 	SchemeValTy cons(SchemeValTy, SchemeValTy);
 	SchemeValTy car(SchemeValTy);
 	SchemeValTy cdr(SchemeValTy);
@@ -32,14 +35,17 @@ extern "C"
 	SchemeValTy eq_63_(SchemeValTy, SchemeValTy);
 	SchemeValTy void_63_(SchemeValTy);
 
-	SchemeValTy schemeAllocateClosure(char* code, int arity, int fvs, ...);
-	SchemeValTy schemeInternSymbol(const char* sym); 
+	SchemeValTy schemeInternSymbol(const char* sym) noexcept;
+	// interned first, in order, the i-th one gets the id i (see Sym)
+	void schemeInternSymbols(const char* const* syms, int64_t n) noexcept;
+	// out of line error path of the primitives generated inline
+	[[noreturn]] void schemeTypeError(const char* prim, const char* expected, SchemeValTy val);
 }
 
 namespace Runtime
 {
 	//object allocate on heap should at least 8 bytes aligned
-	//because we use lower 3 bit for tagging
+	//because we use lower 3 bit for tagging, see gc.h
 	struct alignas(8) Cons
 	{
 		Scheme::ValueType car, cdr;
@@ -48,7 +54,7 @@ namespace Runtime
 	struct alignas(8) Vec
 	{
 		std::size_t len;
-		Scheme::ValueType   *arr;
+		Scheme::ValueType   *arr; // the elements right after the Vec
 	};
 
 	struct alignas(8) Box
@@ -58,15 +64,17 @@ namespace Runtime
 
 	struct alignas(8) Sym
 	{
-		Sym(const char* c): name(c) {}
+		Sym(const char* c, int64_t i): name(c), id(i) {}
 		const char *name;
+		int64_t id; // dense, in the order of interning. Generated case dispatches on it
 	};
 
+	// allocated by generated code, the free variables follow in the same object
 	struct alignas(8) Closure
 	{
-		int arity;
 		char* code;
-		Scheme::ValueType *fvs;
+		int64_t arity;
+		Scheme::ValueType* fvs() { return reinterpret_cast<Scheme::ValueType*>(this + 1); }
 	};
 
 	static const std::unordered_map<std::string, int> builtinFunc = 
@@ -0,0 +1,159 @@
+#include "type-inference.h"
+#include "parser.h"
+
+using namespace std;
+
+using Type = TypeInference::Type;
+
+TypeInference::Type TypeInference::typeOf(const Expr& e) const
+{
+	auto it = types_.find(&e);
+	return it != types_.end()? it->second: Type::Any;
+}
+
+TypeInference::Type TypeInference::typeOfBinding(const Let::Binding::value_type& bind) const
+{
+	auto it = binds_.find(&bind);
+	return it != binds_.end()? it->second: Type::Any;
+}
+
+TypeInference::Type TypeInference::infer(const Expr& e)
+{
+	type_ = Type::Any;
+	e.accept(*this);
+	types_[&e] = type_;
+	return type_;
+}
+
+void TypeInference::forNumber(const NumberE&) { type_ = Type::Fixnum; }
+
+void TypeInference::forBoolean(const BooleanE&) { type_ = Type::Bool; }
+
+void TypeInference::forVar(const Var& v)
+{
+	auto it = env_.find(v.v_);
+	type_ = it != env_.end()? it->second: Type::Any;
+}
+
+void TypeInference::forQuote(const Quote& qo)
+{
+	switch(qo.datum_->type_) {
+		case Parser::Datum::Type::Number:	type_ = Type::Fixnum; break;
+		case Parser::Datum::Type::Boolean:	type_ = Type::Bool; break;
+		default:							type_ = Type::Any;
+	}
+}
+
+void TypeInference::forDefine(const Define& def)
+{
+	infer(*def.body_);
+	type_ = Type::Any;
+}
+
+void TypeInference::forSetBang(const SetBang& setBang)
+{
+	infer(*setBang.e_);
+	type_ = Type::Any;
+}
+
+void TypeInference::forBegin(const Begin& bgn)
+{
+	Type last = Type::Any;
+	for(const auto& e: bgn.es_) last = infer(*e);
+	type_ = last;
+}
+
+void TypeInference::forIf(const If& ifExp)
+{
+	infer(*ifExp.pred_);
+
+	// (number? x) or (boolean? x) with x a variable
+	optional<pair<string, Type>> refined;
+	if(ifExp.pred_->type_ == Expr::Type::Apply) {
+		const auto& test = static_cast<const Apply&>(*ifExp.pred_);
+		if(test.operator_->type_ == Expr::Type::Var && test.operands_.size() == 1 &&
+				test.operands_[0]->type_ == Expr::Type::Var) {
+			const auto& pred = static_cast<const Var&>(*test.operator_).v_;
+			const auto& v = static_cast<const Var&>(*test.operands_[0]).v_;
+			if(pred == "number?") refined.emplace(v, Type::Fixnum);
+			else if(pred == "boolean?") refined.emplace(v, Type::Bool);
+		}
+	}
+
+	Type thn;
+	if(refined && !assigned_.count(refined->first)) {
+		auto saved = env_;
+		env_[refined->first] = refined->second;
+		thn = infer(*ifExp.thn_);
+		env_ = std::move(saved);
+	}else {
+		thn = infer(*ifExp.thn_);
+	}
+	type_ = join(thn, infer(*ifExp.els_));
+}
+
+void TypeInference::forLet(const Let& let)
+{
+	// the bindings shadow the outer ones in the body only
+	vector<pair<string, optional<Type>>> outer;
+	for(const auto& bind: let.binds_) {
+		auto it = env_.find(bind.first.v_);
+		outer.emplace_back(bind.first.v_, it != env_.end()? optional(it->second): nullopt);
+	}
+
+	for(const auto& bind: let.binds_) {
+		auto t = infer(*bind.second);
+		if(assigned_.count(bind.first.v_)) t = Type::Any;
+		binds_[&bind] = t;
+		env_[bind.first.v_] = t;
+	}
+	type_ = infer(*let.body_);
+
+	for(auto it = outer.rbegin(); it != outer.rend(); ++it) {
+		if(it->second) env_[it->first] = *it->second;
+		else env_.erase(it->first);
+	}
+}
+
+void TypeInference::forLetRec(const LetRec& letrec)
+{
+	forLet(letrec);
+}
+
+void TypeInference::forLambda(const Lambda&)
+{
+	type_ = Type::Any;
+}
+
+void TypeInference::forApply(const Apply& app)
+{
+	static const unordered_map<string, Type> results {
+		{"+", Type::Fixnum}, {"-", Type::Fixnum}, {"*", Type::Fixnum}, {"/", Type::Fixnum},
+		{"vector-length", Type::Fixnum},
+		{">", Type::Bool}, {">=", Type::Bool}, {"<", Type::Bool}, {"<=", Type::Bool}, {"=", Type::Bool},
+		{"null?", Type::Bool}, {"pair?", Type::Bool}, {"symbol?", Type::Bool}, {"number?", Type::Bool},
+		{"boolean?", Type::Bool}, {"eq?", Type::Bool}, {"void?", Type::Bool}, {"box?", Type::Bool},
+		{"vector?", Type::Bool},
+	};
+
+	for(const auto& e: app.operands_) infer(*e);
+	infer(*app.operator_);
+
+	type_ = Type::Any;
+	if(app.operator_->type_ == Expr::Type::Var) {
+		auto it = results.find(static_cast<const Var&>(*app.operator_).v_);
+		if(it != results.end()) type_ = it->second;
+	}
+}
+
+void TypeInference::forCase(const Case& cas)
+{
+	infer(*cas.key_);
+	optional<Type> t;
+	auto add = [&](const Expr& e) { auto te = infer(e); t = t? join(*t, te): te; };
+	for(const auto& cl: cas.clauses_) add(*cl.second);
+	if(cas.else_) add(*cas.else_);
+	else t = Type::Any; // void
+
+	type_ = t.value_or(Type::Any);
+}
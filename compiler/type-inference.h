@@ -0,0 +1,54 @@
+#pragma once
+
+#include "ast.h"
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+// What is known of the values in a function body before its codegen.
+// Fixnums and booleans proven as such are kept unboxed by ExprCodeGen (an
+// untagged i64, an i1) and tagged only where they escape.
+//
+// Arithmetic always yields fixnums and comparisons and predicates booleans.
+// Let bound variables that are never assigned have the type of their value.
+// Flow sensitive in the branches of an if: in the then branch of
+// (number? x) and (boolean? x), x is known. Lambdas in the body are
+// inferred on their own, their parameters and captures are unknown
+class TypeInference: public VisitorE
+{
+public:
+	enum class Type { Any, Fixnum, Bool };
+
+	TypeInference(const std::unordered_set<std::string>& assigned): assigned_(assigned) {}
+
+	void run(const Expr& body) { infer(body); }
+
+	Type typeOf(const Expr& e) const;
+	// of the variable one binding of a let binds
+	Type typeOfBinding(const Let::Binding::value_type& bind) const;
+
+	static Type join(Type a, Type b) { return a == b? a: Type::Any; }
+
+private:
+    void forNumber(const NumberE&) override;
+    void forBoolean(const BooleanE&) override;
+    void forVar(const Var&) override;
+    void forQuote(const Quote&) override;
+    void forDefine(const Define&) override;
+    void forSetBang(const SetBang&) override;
+    void forBegin(const Begin&) override;
+    void forIf(const If&) override;
+	void forLet(const Let&) override;
+	void forLetRec(const LetRec&) override;
+    void forLambda(const Lambda&) override;
+    void forApply(const Apply&) override;
+    void forCase(const Case&) override;
+
+	Type infer(const Expr& e);
+
+	const std::unordered_set<std::string>& assigned_;
+	std::unordered_map<std::string, Type> env_; // let bound and refined variables in scope
+	std::unordered_map<const Let::Binding::value_type*, Type> binds_; // names may be bound by several lets
+	std::unordered_map<const Expr*, Type> types_;
+	Type type_{Type::Any};
+};
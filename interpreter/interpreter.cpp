@@ -43,17 +43,15 @@ Value::Ptr convertDatum(const Datum& dat)
 
 void Evaluator::forQuote(const Quote& quo)
 {
-	static unordered_map<const Quote*, Value::Ptr> datums;
-
-	auto it = datums.find(&quo);
-	if(it != datums.end()) {
+	auto it = datums_.find(&quo);
+	if(it != datums_.end()) {
 		result_ = it->second;
 		return;
 	}
 
 	const auto& dat = *quo.datum_;
 	result_ = convertDatum(dat);
-	datums.insert({&quo, result_});
+	datums_.insert({&quo, result_});
 }
 
 void Evaluator::forDefine(const Define &def) {
@@ -79,6 +77,38 @@ void Evaluator::forIf(const If &if_expr) {
     }
 }
 
+// eqv? of a value and a case datum, pairs are never the same
+static bool matches(const Value& v, const Datum& dat)
+{
+	switch(dat.type_)
+	{
+		case Datum::Type::Number:
+			return v.type_ == Value::Type::Number && static_cast<const Number&>(v).value_ == static_cast<const DatumNum&>(dat).value_;
+		case Datum::Type::Boolean:
+			return v.type_ == Value::Type::Boolean && static_cast<const Boolean&>(v).value_ == static_cast<const DatumBool&>(dat).value_;
+		case Datum::Type::Symbol:
+			return v.type_ == Value::Type::Symbol && *static_cast<const Symbol&>(v).ptr_ == static_cast<const DatumSym&>(dat).value_;
+		case Datum::Type::Nil:
+			return v.type_ == Value::Type::Nil;
+		default:
+			return false;
+	}
+}
+
+void Evaluator::forCase(const Case& cas)
+{
+	cas.key_->accept(*this);
+	for(const auto& [data, body]: cas.clauses_) {
+		for(const auto& dat: data) {
+			if(matches(*result_, *dat)) {
+				body->accept(*this);
+				return;
+			}
+		}
+	}
+	if(cas.else_) cas.else_->accept(*this);
+	else result_ = Void::getInstance();
+}
 
 void Evaluator::forLet(const Let& let)
 {
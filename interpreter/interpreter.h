@@ -6,6 +6,7 @@
 #include "fmt/core.h"
 #include <numeric>
 #include <string_view>
+#include <unordered_map>
 
 namespace Interp {
 
@@ -61,9 +62,11 @@ private:
     void forLambda(const Lambda & lambda) override { result_ = std::make_shared<Closure>(std::make_unique<Lambda>(lambda), env_);
 	}
     void forApply(const Apply&) override;
+    void forCase(const Case&) override;
 
     Value::Ptr result_;
     Environment::Ptr env_;
+    std::unordered_map<const Quote*, Value::Ptr> datums_; // a quote evaluates to the same datum every time
 };
 
 class ValuePrinter: public VisitorV
@@ -3,9 +3,13 @@
 #include "bccompiler.h" 
 #include "bcdumper.h"
 #include "machine.h"
+#include "bcfile.h"
+#include "optimizer.h"
+#include "isolate.h"
+#include "verifier.h"
 #include <iostream>
 #include <fstream>
-//#include <optional>
+#include <optional>
 
 using namespace std;
 using namespace Interp;
@@ -13,12 +17,15 @@ using namespace Interp;
 class EvalShell {
 public:
     enum class EngineType { Tree, VM };
-    EvalShell(EngineType e): _engineTy(e) {
+    EvalShell(EngineType e, int optLevel = 1): _engineTy(e), _optimizer(optLevel) {
         if (e == EngineType::Tree) {
             _treeEvaluator = make_unique<Evaluator>(builtin::initTopEnv());
         } else {
             _compiler   = make_unique<ByteCodeCompiler>();
             _vm         = make_unique<VirtualMachine>();
+            _compileOpts.finish = [opt = _optimizer](Instr::Ptr code) { return opt.run(std::move(code)); };
+            _compileOpts.pool   = make_shared<ConstPool>();
+            _compileOpts.globals = make_shared<GlobalTable>();
         }
     }
 
@@ -54,9 +61,14 @@ public:
             auto expr   =  Parser::parseExp(Parser::Range{tokens.begin(), tokens.end()});
 
             if(expr) {
-                auto val = evalExpr(*expr.getValue());
-                val->accept(printer);
-                cout << endl;
+                try {
+                    auto val = evalExpr(*expr.getValue());
+                    val->accept(printer);
+                    cout << endl;
+                } catch(std::exception &e) {
+                    std::cout << e.what() << "\n" ;
+                    if (_vm) _vm->reset(); // definitions stay
+                }
             }else {
                 std::cerr << "ParseError: " <<  expr.getErr() << std::endl;
             }
@@ -65,6 +77,21 @@ public:
 
     
     void fromSource(const string& src, bool onlyCmpl = false) {
+        if (_engineTy == EngineType::VM && !onlyCmpl) {
+            try {
+                // cached after the run: writing the image compiles the lambda
+                // bodies still left lazy, the program should not wait for that
+                bool fresh;
+                if (auto entries = compileSource(src, &fresh)) {
+                    runEntries(*entries);
+                    if (fresh && _useCache) ByteCode::ImageCache(_optimizer.getLevel()).store(src, *entries);
+                }
+            } catch(std::exception &e) {
+                std::cout << e.what() << "\n" ;
+            }
+            return;
+        }
+
         auto tokens = Parser::tokenize(src.begin(), src.end());
         auto prog =  Parser::parseProgram(Parser::Range{tokens.begin(), tokens.end()});
 
@@ -81,7 +108,7 @@ public:
                 }
             } else {
                 for (auto& expr: prog.getValue()) {
-                    evalExpr(*expr);
+                    printResult(evalExpr(*expr));
                 }
             }
         } catch(std::exception &e) {
@@ -89,37 +116,194 @@ public:
         }
     }
 
+    void fromImage(const string& path) {
+        auto entries = ByteCode::ImageLoader::load(path, 0, _compileOpts.globals);
+        if (!entries) {
+            std::cerr << "cannot load bytecode image " << path << std::endl;
+            return;
+        }
+        try {
+            runEntries(*entries);
+        } catch(std::exception &e) {
+            std::cout << e.what() << "\n" ;
+        }
+    }
+
+    void compileToImage(const string& src, const string& path) {
+        _useCache = false;
+        try {
+            auto entries = compileSource(src);
+            if (entries && !ByteCode::ImageWriter::write(path, *entries, ByteCode::hashSource(src))) {
+                std::cerr << "cannot write bytecode image " << path << std::endl;
+            }
+        } catch(std::exception &e) {
+            std::cerr << e.what() << "\n" ;
+        }
+    }
+
+    // compile every file, then evaluate them in parallel on `threads` isolates
+    void batch(const vector<string>& paths, unsigned threads) {
+        // bodies compiled lazily while the isolates run come quickened as well
+        _compileOpts.finish = [opt = _optimizer](Instr::Ptr code) { return Optimizer::quickenAll(opt.run(std::move(code))); };
+
+        vector<IsolatePool::Program> programs;
+        vector<std::optional<string>> fresh; // sources of the programs not found in the cache
+        for (const auto& path: paths) {
+            ifstream ifs(path);
+            string src{std::istreambuf_iterator<char>(ifs), {}};
+            try {
+                bool isFresh;
+                auto entries = compileSource(src, &isFresh);
+                programs.push_back(entries? std::move(*entries): IsolatePool::Program{});
+                fresh.push_back(isFresh? std::optional(std::move(src)): std::nullopt);
+            } catch(std::exception &e) {
+                std::cerr << path << ": " << e.what() << "\n";
+                programs.emplace_back();
+                fresh.emplace_back();
+            }
+        }
+
+        auto results = IsolatePool(threads).evaluate(programs);
+        // after the run, as in fromSource: the isolates compiled the bodies they called
+        if (_useCache) {
+            ByteCode::ImageCache cache(_optimizer.getLevel());
+            for (size_t i = 0; i < programs.size(); ++i) {
+                if (fresh[i]) cache.store(*fresh[i], programs[i]);
+            }
+        }
+        ValuePrinter printer(cout);
+        for (size_t i = 0; i < paths.size(); ++i) {
+            cout << paths[i] << ": ";
+            if (results[i].value) {
+                results[i].value->accept(printer);
+            } else {
+                cout << results[i].error;
+            }
+            cout << "\n";
+        }
+    }
+
+    void disableCache() { _useCache = false; }
+    // print the value of every top level expression, as racket -e does
+    void printResults() { _printResults = true; }
+
+    void enableProfile() {
+        if (!VirtualMachine::CanProfile) {
+            std::cerr << "--profile-ops needs a build with -DSCHEMER_PROFILE_OPS=ON" << std::endl;
+            return;
+        }
+        if (_vm) _vm->setProfile(&_profile);
+        _profiling = true;
+    }
+
+    // opcode statistics, then the executed code annotated with counts
+    void reportProfile(std::ostream& os) {
+        if (!_profiling) return;
+        _profile.report(os);
+        InstrDumper dumper(os, &_profile);
+        for (const auto& entry: _profiled) {
+            os << "\n";
+            dumper.dump(*entry);
+        }
+    }
+
     Value::Ptr evalExpr(Expr& expr) {
         if (_engineTy == EngineType::Tree) {
             expr.accept(*_treeEvaluator);
             return _treeEvaluator->getResult();
         } else {
-            auto instrs = _compiler->Compile(expr);
-            return _vm->execute(*instrs);
+            auto instrs = _optimizer.run(_compiler->Compile(expr, _compileOpts));
+            return _vm->execute(verify(std::move(instrs)));
         }
     }
     void compileExpr(Expr& expr) {
         InstrDumper dumper(cout);
         try { //eval
-            auto instrs = _compiler->Compile(expr);
+            auto opts = _compileOpts;
+            opts.lazy = false; // show every body
+            auto instrs = _optimizer.run(_compiler->Compile(expr, opts));
             dumper.dump(*instrs);
         } catch(std::exception &e) {
             std::cerr << e.what() << "\n" ;
         }
     }
 private:
+    // bytecode of all top level expressions in src, from the image cache if possible.
+    // Fresh bytecode is not cached here: writing an image compiles the lambda
+    // bodies still left lazy, callers store it after the run (see `fresh`)
+    std::optional<ByteCode::Entries> compileSource(const string& src, bool* fresh = nullptr) {
+        ByteCode::ImageCache cache(_optimizer.getLevel());
+        if (fresh) *fresh = false;
+        if (_useCache) {
+            if (auto entries = cache.lookup(src, _compileOpts.globals)) return entries;
+        }
+
+        auto tokens = Parser::tokenize(src.begin(), src.end());
+        auto prog =  Parser::parseProgram(Parser::Range{tokens.begin(), tokens.end()});
+        if (!prog) {
+            std::cerr << "ParseError: " << prog.getErr() << std::endl;
+            return std::nullopt;
+        }
+
+        ByteCode::Entries entries;
+        for (auto& expr: prog.getValue()) {
+            entries.push_back(_optimizer.run(_compiler->Compile(*expr, _compileOpts)));
+        }
+        if (fresh) *fresh = true;
+        return entries;
+    }
+
+    static Verifier::Verified verify(Instr::Ptr code) {
+        string err;
+        auto verified = Verifier::verify(std::move(code), &err);
+        if (!verified) throw std::runtime_error("bytecode verification failed: " + err);
+        return std::move(*verified);
+    }
+
+    // nothing runs unless every entry verifies, images may come from anywhere
+    void runEntries(const ByteCode::Entries& entries) {
+        vector<Verifier::Verified> verified;
+        for (const auto& entry: entries) {
+            verified.push_back(verify(entry));
+        }
+        for (const auto& code: verified) {
+            if (_profiling) _profiled.push_back(code.getEntry());
+            printResult(_vm->execute(code));
+        }
+    }
+
+    void printResult(const Value::Ptr& val) {
+        if (!_printResults || val->getType() == Value::Type::Void) return;
+        ValuePrinter printer(cout);
+        val->accept(printer);
+        cout << "\n";
+    }
+
     EngineType                      _engineTy;
+    bool                            _useCache{true};
+    bool                            _printResults{false};
+    Optimizer                       _optimizer;
+    ByteCodeCompiler::Options       _compileOpts;
     unique_ptr<Evaluator>           _treeEvaluator;
     unique_ptr<ByteCodeCompiler>    _compiler;
     unique_ptr<VirtualMachine>      _vm;
+    bool                            _profiling{false};
+    OpProfile                       _profile;
+    ByteCode::Entries               _profiled; // kept alive for the annotated dump
 };
 
 void help() {
     cout << "schemer [OPTIONS]\n\n";
     cout << "\t[--engine vm|tree] (defalut:vm) change the engine of scheme interpreter" << endl
-         << "\t[-e expr] eval expr directly]" << endl
+         << "\t[-e expr] eval expr directly, printing the value of each expression]" << endl
          << "\t[-f filename] eval code from filename]" << endl
-         << "\t[-d filename] print the bytecode compiled from filename" << endl;
+         << "\t[-d filename] print the bytecode compiled from filename" << endl
+         << "\t[-o image.scbc] with -f, write the compiled bytecode image instead of running it" << endl
+         << "\t[--no-cache] always recompile, skip the on-disk bytecode cache" << endl
+         << "\t[-O0|-O1] (default:-O1) optimization level of the bytecode" << endl
+         << "\t[--batch files... [-j N]] evaluate the files in parallel on N threads (default: all cores)" << endl
+         << "\t[--stats] print the number of compiled lambda bodies and quickened prims to stderr at exit" << endl
+         << "\t[--profile-ops] print opcode statistics and annotated bytecode to stderr (needs SCHEMER_PROFILE_OPS)" << endl;
 }
 
 
@@ -139,18 +323,40 @@ int main(int argc, char *argv[])
     auto engineTy   = tyOpt? ("vm"sv == tyOpt? EvalShell::EngineType::VM: EvalShell::EngineType::Tree):
                       EvalShell::EngineType::VM;
 
-    engineTy        = hasOpt("-d")? EvalShell::EngineType::VM: engineTy;
+    auto isImage    = [](string_view path) { return path.size() > 5 && path.substr(path.size() - 5) == ".scbc"; };
+    auto srcPath    = hasOpt("-f", true);
+    engineTy        = hasOpt("-d") || hasOpt("-o") || hasOpt("--batch") || (srcPath && isImage(srcPath))? EvalShell::EngineType::VM: engineTy;
 
-    EvalShell   shell(engineTy);
+    EvalShell   shell(engineTy, hasOpt("-O0")? 0: 1);
+    if (hasOpt("--no-cache")) shell.disableCache();
+    if (hasOpt("--profile-ops")) shell.enableProfile();
 
-    if (hasOpt("-e")) { //read code from stdin
+    if (hasOpt("--batch")) {
+        vector<string> paths;
+        for (auto it = std::find(argBegin, argEnd, "--batch"sv) + 1; it != argEnd; ++it) {
+            if (*it == "-j"sv) ++it;
+            else if (**it != '-') paths.emplace_back(*it);
+        }
+        auto jobs = hasOpt("-j", true);
+        shell.batch(paths, jobs? std::stoul(jobs): std::thread::hardware_concurrency());
+    }
+    else if (hasOpt("-e")) { //read code from stdin
         string src{std::istreambuf_iterator<char>(cin), {}};
+        shell.printResults();
         shell.fromSource(src);
     }
-    else if (auto filepath = hasOpt("-f", true)) {
-        ifstream ifs(filepath);
-        string src{std::istreambuf_iterator<char>(ifs), {}};
-        shell.fromSource(src);
+    else if (auto filepath = srcPath) {
+        if (isImage(filepath)) {
+            shell.fromImage(filepath);
+        } else {
+            ifstream ifs(filepath);
+            string src{std::istreambuf_iterator<char>(ifs), {}};
+            if (auto out = hasOpt("-o", true)) {
+                shell.compileToImage(src, out);
+            } else {
+                shell.fromSource(src);
+            }
+        }
     } 
     else if (auto filepath = hasOpt("-d", true)) {
         ifstream ifs(filepath);
@@ -163,4 +369,10 @@ int main(int argc, char *argv[])
     else { // enter read-eval-print-loop
         shell.loop();
     }
+    shell.reportProfile(cerr);
+    if (hasOpt("--stats")) {
+        cerr << "lambdas compiled: " << ByteCodeCompiler::compiledLambdas() << endl;
+        cerr << "prims quickened: " << VirtualMachine::quickenedPrims()
+             << ", deopted: " << VirtualMachine::deoptedPrims() << endl;
+    }
 }
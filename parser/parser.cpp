@@ -52,7 +52,11 @@ Result<Expr::Ptr> parseExp(const Range& rg)
                         parseDef, 
                         parseQuote, 
                         parseLet, 
+                        parseNamedLet,
                         parseLetRec, 
+                        parseDo,
+                        parseCond,
+                        parseCase,
                         parseLambda, 
                         parseIf, 
                         parseSetBang,
@@ -218,6 +222,137 @@ Result<std::unique_ptr<LetRec>>  parseLetRec(const Range& rg) {
     return parseLetLike<LetRec>(rg, "letrec");
 }
 
+// (let name ((v e)...) body)  =>  ((letrec ((name (lambda (v...) body))) name) e...)
+static unique_ptr<Apply> namedLet(Var name, vector<pair<Var, Expr::Ptr>>&& binds, Expr::Ptr&& body)
+{
+	vector<Var> params;
+	vector<Expr::Ptr> inits;
+	for(auto& [v, e]: binds) {
+		params.push_back(v);
+		inits.push_back(std::move(e));
+	}
+
+	Let::Binding rec;
+	rec.emplace_back(name, make_unique<Lambda>(params, std::move(body)));
+	auto loop = make_unique<LetRec>(std::move(rec), make_unique<Var>(name));
+	return make_unique<Apply>(std::move(loop), std::move(inits));
+}
+
+Result<std::unique_ptr<Apply>>  parseNamedLet(const Range& rg)
+{
+	static auto let = Lit("let");
+	static auto bindPair = All(Common::lP, parseVar, parseExp, Common::rP);
+	static auto binds = MaybeMany(bindPair);
+
+	static auto P = All(Common::lP, let, parseVar, Common::lP, binds, Common::rP, parseExp, Common::rP) >>
+		[](unique_ptr<Var>&& name, vector<tuple<unique_ptr<Var>,Expr::Ptr>>&& binds, Expr::Ptr&& body)
+		{
+			vector<pair<Var, Expr::Ptr>> kvs;
+			for(auto& kv: binds) kvs.emplace_back(std::move(*get<0>(kv)), std::move(get<1>(kv)));
+			return namedLet(std::move(*name), std::move(kvs), std::move(body));
+		};
+	return P(rg);
+}
+
+// (do ((v init step)...) (test res...) cmd...)  =>
+//     (let <loop> ((v init)...) (if test (begin res...) (begin cmd... (<loop> step...))))
+// a variable without a step keeps its value. No token has a space in it, so
+// the loop name can't clash with a user's
+Result<std::unique_ptr<Apply>>  parseDo(const Range& rg)
+{
+	static auto doKw = Lit("do");
+	static auto maybeExp = Maybe(parseExp);
+	static auto manyExp = MaybeMany(parseExp);
+	static auto varSpec = All(Common::lP, parseVar, parseExp, maybeExp, Common::rP);
+	static auto varSpecs = MaybeMany(varSpec);
+	static auto exit = All(Common::lP, parseExp, manyExp, Common::rP);
+
+	static auto P = All(Common::lP, doKw, Common::lP, varSpecs, Common::rP, exit, manyExp, Common::rP) >>
+		[](vector<tuple<unique_ptr<Var>, Expr::Ptr, vector<Expr::Ptr>>>&& specs,
+				tuple<Expr::Ptr, vector<Expr::Ptr>>&& exit, vector<Expr::Ptr>&& cmds)
+		{
+			const Var loop("do loop");
+			vector<pair<Var, Expr::Ptr>> binds;
+			vector<Expr::Ptr> steps;
+			for(auto& [v, init, step]: specs) {
+				steps.push_back(step.empty()? make_unique<Var>(*v): std::move(step.front()));
+				binds.emplace_back(std::move(*v), std::move(init));
+			}
+
+			cmds.push_back(make_unique<Apply>(make_unique<Var>(loop), std::move(steps)));
+			auto body = make_unique<If>(std::move(get<0>(exit)),
+					make_unique<Begin>(std::move(get<1>(exit))),
+					make_unique<Begin>(std::move(cmds)));
+			return namedLet(loop, std::move(binds), std::move(body));
+		};
+	return P(rg);
+}
+
+// the body of a clause, several expressions run in sequence
+static Expr::Ptr clauseBody(vector<Expr::Ptr>&& es)
+{
+	if(es.size() == 1) return std::move(es.front());
+	return make_unique<Begin>(std::move(es));
+}
+
+// (cond (test e...)... (else e...))  =>  nested ifs, a clause without a
+// body gives the value of its test:
+//     (test)  =>  (let ((<test> test)) (if <test> <test> rest))
+// and falling through all tests is void
+Result<Expr::Ptr>  parseCond(const Range& rg)
+{
+	static auto condKw = Lit("cond");
+	static auto manyExp = MaybeMany(parseExp);
+	static auto clause = All(Common::lP, parseExp, manyExp, Common::rP);
+	static auto clauses = MaybeMany(clause);
+
+	static auto P = All(Common::lP, condKw, clauses, Common::rP) >>
+		[](vector<tuple<Expr::Ptr, vector<Expr::Ptr>>>&& clauses) -> Expr::Ptr
+		{
+			const Var test("cond test");
+			Expr::Ptr rest = make_unique<Begin>(vector<Expr::Ptr>{});
+			for(auto it = clauses.rbegin(); it != clauses.rend(); ++it) {
+				auto& [pred, body] = *it;
+				const auto isElse = pred->type_ == Expr::Type::Var && static_cast<const Var&>(*pred).v_ == "else";
+				if(isElse && it == clauses.rbegin() && !body.empty()) {
+					rest = clauseBody(std::move(body));
+				}else if(body.empty()) {
+					Let::Binding bind;
+					bind.emplace_back(test, std::move(pred));
+					rest = make_unique<Let>(std::move(bind),
+							make_unique<If>(make_unique<Var>(test), make_unique<Var>(test), std::move(rest)));
+				}else {
+					rest = make_unique<If>(std::move(pred), clauseBody(std::move(body)), std::move(rest));
+				}
+			}
+			return rest;
+		};
+	return P(rg);
+}
+
+// (case key ((datum...) e...)... (else e...))
+Result<std::unique_ptr<Case>>  parseCase(const Range& rg)
+{
+	static auto caseKw = Lit("case"), elseKw = Lit("else");
+	static auto manyExp = Many(parseExp);
+	static auto data = MaybeMany(parseDatum);
+	static auto clause = All(Common::lP, Common::lP, data, Common::rP, manyExp, Common::rP);
+	static auto clauses = MaybeMany(clause);
+	static auto elseClause = All(Common::lP, elseKw, manyExp, Common::rP);
+	static auto maybeElse = Maybe(elseClause);
+
+	static auto P = All(Common::lP, caseKw, parseExp, clauses, maybeElse, Common::rP) >>
+		[](Expr::Ptr&& key, vector<tuple<vector<Datum::Ptr>, vector<Expr::Ptr>>>&& clauses,
+				vector<tuple<vector<Expr::Ptr>>>&& els)
+		{
+			vector<Case::Clause> cls;
+			for(auto& [data, body]: clauses) cls.emplace_back(std::move(data), clauseBody(std::move(body)));
+			return make_unique<Case>(std::move(key), std::move(cls),
+					els.empty()? nullptr: clauseBody(std::move(get<0>(els.front()))));
+		};
+	return P(rg);
+}
+
 Result<std::unique_ptr<Apply>>  parseApply(const Range& rg)
 {
 	static auto manyExp = Many(parseExp);
@@ -238,6 +373,10 @@ Result<Datum::Ptr> parseDatum(const Range& rg)
 {
 	static auto num = parseNumber >> [](unique_ptr<NumberE>&& n) { return make_shared<DatumNum>(n->value_); };
 	static auto sym = parseVar >> [](unique_ptr<Var>&& v) { return make_shared<DatumSym>(std::move(v->v_)); };
+	static auto boolean = [](const Range& rg) -> Result<Datum::Ptr> {
+		if(rg.eof() || (rg.cur() != "#t" && rg.cur() != "#f")) return {};
+		return {make_shared<DatumBool>(rg.cur() == "#t"), rg+1};
+	};
 	static auto datums = Many(parseDatum);
 
 	static auto tail = All(Common::Dot, parseDatum) >> [](Datum::Ptr&& d) { return d; };
@@ -261,7 +400,7 @@ Result<Datum::Ptr> parseDatum(const Range& rg)
 			return head.cdr_;
 		};
 	static auto nil = All(Common::lP, Common::rP) >> []() { return DatumNil::getInstance(); };
-	static auto P = Choose<Datum::Ptr>::OneOf(num, sym, cons, nil);
+	static auto P = Choose<Datum::Ptr>::OneOf(num, boolean, sym, cons, nil);
 	return P(rg);
 }
 
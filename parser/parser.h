@@ -260,6 +260,10 @@ Result<std::unique_ptr<Begin>>  parseBegin(const Range&);
 Result<std::unique_ptr<If>>  parseIf(const Range&);
 Result<std::unique_ptr<Let>>  parseLet(const Range&);
 Result<std::unique_ptr<LetRec>>  parseLetRec(const Range&);
+Result<std::unique_ptr<Apply>>  parseNamedLet(const Range&);
+Result<std::unique_ptr<Apply>>  parseDo(const Range&);
+Result<Expr::Ptr>  parseCond(const Range&);
+Result<std::unique_ptr<Case>>  parseCase(const Range&);
 Result<std::unique_ptr<Lambda>>  parseLambda(const Range&);
 Result<std::unique_ptr<Apply>>  parseApply(const Range&);
 
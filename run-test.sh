@@ -8,24 +8,49 @@ COMPILER_OUT_PATH=./build/compiler
 FRONTPASS=./compiler/transforms.rkt
 COMPILER=$COMPILER_OUT_PATH/sch-c
 TESTS_FILE_DIR=./tests
+# VM only: forms the racket front end of the compiler doesn't have, and
+# checks of the VM itself. NAME.args replaces -e on the command line of
+# NAME.scm, NAME.out is the expected output (stderr included) where racket
+# has no answer. Subdirectories hold files the tests refer to
+VM_TESTS_DIR=$TESTS_FILE_DIR/vm
+# compiler only: primitives the VM doesn't have, and checks of the generated
+# code. NAME.out is the expected output (stderr included) where racket has no
+# answer
+COMPILER_TESTS_DIR=$TESTS_FILE_DIR/compiler
+# bytecode the VM compiles NAME.scm to (-d), NAME.out has the instruction
+# addresses replaced by @
+DUMP_TESTS_DIR=$TESTS_FILE_DIR/dump
 
 LD_LIBRARY_PATH=$COMPILER_OUT_PATH
 export LD_LIBRARY_PATH
 
+function expected_output() {
+    if [ -f ${1%.scm}.out ]; then
+        cat ${1%.scm}.out
+    else
+        racket -e "$(<$1)"
+    fi
+}
+
+# arguments go to the compiler, e.g. --runtime to link runtime.bc in
 function compiler_test() {
     total=0
     succ=0
-    for testFile in $TESTS_FILE_DIR/*.scm; do 
+    for testFile in $TESTS_FILE_DIR/*.scm $COMPILER_TESTS_DIR/*.scm; do 
         ((total=total+1))
         prog=`basename $testFile`.out
-        clang++ -L$COMPILER_OUT_PATH -lruntime -x assembler -o $prog <($FRONTPASS < $testFile|$COMPILER|llc-14 --relocation-model=pic)
-        myoutput=$(./$prog)
-        stdoutput=`racket -e "$(<$testFile)"`
-        if [ $myoutput = $stdoutput ]; then
+        clang++ -L$COMPILER_OUT_PATH -lruntime -x assembler -o $prog <($FRONTPASS < $testFile|$COMPILER "$@"|llc-14 --relocation-model=pic)
+        if [ -f ${testFile%.scm}.out ]; then
+            myoutput=$(./$prog 2>&1)
+        else
+            myoutput=$(./$prog)
+        fi
+        stdoutput=$(expected_output $testFile)
+        if [ "$myoutput" = "$stdoutput" ]; then
             printf "test %s pass\n" $testFile
             ((succ=succ+1))
         else
-            printf "test %s failed, expect %s got %s\n" $testFile $stdoutput $myoutput
+            printf "test %s failed, expect %s got %s\n" $testFile "$stdoutput" "$myoutput"
         fi;
     done
     printf "Finished total %d compiler test run, %d passed\n" $total $succ
@@ -35,23 +60,119 @@ function interpreter_test() {
     total=0
     succ=0
 
-    for testFile in $TESTS_FILE_DIR/*.scm; do 
+    for testFile in $TESTS_FILE_DIR/*.scm $VM_TESTS_DIR/*.scm; do 
         ((total=total+1))
-        myoutput=$($INTERPRETER -e < $testFile)
-        stdoutput=`racket -e "$(<$testFile)"`
-        if [ $myoutput = $stdoutput ]; then
+        args=(-e)
+        [ -f ${testFile%.scm}.args ] && args=($(<${testFile%.scm}.args))
+        if [ -f ${testFile%.scm}.out ]; then
+            myoutput=$($INTERPRETER "${args[@]}" < $testFile 2>&1)
+        else
+            myoutput=$($INTERPRETER "${args[@]}" < $testFile)
+        fi
+        stdoutput=$(expected_output $testFile)
+        if [ "$myoutput" = "$stdoutput" ]; then
             printf "test %s pass\n" $testFile
             ((succ=succ+1))
         else
-            printf "test %s failed, expect %s got %s\n" $testFile $stdoutput $myoutput
+            printf "test %s failed, expect %s got %s\n" $testFile "$stdoutput" "$myoutput"
         fi;
     done
     printf "Finished total %d interpreter test run, %d passed\n" $total $succ
 }
 
+function dump_test() {
+    total=0
+    succ=0
+
+    for testFile in $DUMP_TESTS_DIR/*.scm; do
+        ((total=total+1))
+        myoutput=$($INTERPRETER -d < $testFile | sed 's/0x[0-9a-f]*/@/g')
+        if [ "$myoutput" = "$(<${testFile%.scm}.out)" ]; then
+            printf "test %s pass\n" $testFile
+            ((succ=succ+1))
+        else
+            printf "test %s failed, got\n%s\n" $testFile "$myoutput"
+        fi;
+    done
+    printf "Finished total %d bytecode dump test run, %d passed\n" $total $succ
+}
+
+# --profile-ops counts: 11 calls of loop, the first one runs the generic
+# add, the others its quickened form. Needs a -DSCHEMER_PROFILE_OPS=ON build
+function profile_test() {
+    prog='(define (loop i acc) (if (= i 0) acc (loop (- i 1) (+ acc i)))) (loop 10 0)'
+    profile=$($INTERPRETER --no-cache --profile-ops -e <<< $prog 2>&1)
+
+    if grep -q "needs a build" <<< $profile; then
+        printf "test opcode profile skipped, not a profiling build\n"
+    elif grep -q "== opcodes (233 executed) ==" <<< $profile &&
+         grep -Eq "^ +9 +[0-9.]+%  add.fix$" <<< $profile &&
+         grep -Eq "^ +1 +[0-9.]+%  add$" <<< $profile &&
+         grep -Eq "^ +41 +[0-9.]+%  mread push$" <<< $profile; then
+        printf "test opcode profile pass\n"
+    else
+        printf "test opcode profile failed, got\n%s\n" "$profile"
+    fi
+}
+
+# images may come from anywhere, the verifier has to turn down a corrupt
+# one before it runs. The image of prog has the body of f as records 1 to 9:
+# record 3 is the pop after the add, record 8 reads the argument x. Each
+# corruption overwrites the low byte of the record's first operand
+function verify_test() {
+    prog='(define (f x) (+ x 1)) (f 41)'
+    image=$(mktemp --suffix=.scbc)
+    $INTERPRETER -f <(echo $prog) -o $image
+    instrOff=$(od -An -tu4 -j28 -N4 $image)
+    bad=${image%.scbc}-bad.scbc
+
+    for corruption in "3 \x09 needs 9 stack values, has 2" "8 \xf9 slot -7 outside the frame"; do
+        read -r record byte message <<< $corruption
+        cp $image $bad
+        printf $byte | dd of=$bad bs=1 seek=$((instrOff + record * 16 + 4)) conv=notrunc status=none
+        myoutput=$($INTERPRETER -f $bad 2>&1)
+        if [[ $myoutput == "bytecode verification failed: $message"* ]]; then
+            printf "test verifier record %s pass\n" $record
+        else
+            printf "test verifier record %s failed, expect %s got %s\n" $record "$message" "$myoutput"
+        fi
+    done
+    rm $image $bad
+}
+
+# an image in the cache is only used for the very source it was compiled
+# from: B's image replaced by A's, as if their hashes collided, must not
+# make B print A's result
+function cache_test() {
+    cacheDir=$(mktemp -d)
+    progA='(define (f x) (* x 2)) (f 21)'
+    progB='(define (f x) (+ x 2)) (f 21)'
+
+    SCHEMER_CACHE_DIR=$cacheDir $INTERPRETER -e <<< $progA > /dev/null
+    imageA=$(ls $cacheDir/*.scbc)
+    SCHEMER_CACHE_DIR=$cacheDir $INTERPRETER -e <<< $progB > /dev/null
+    imageB=$(ls $cacheDir/*.scbc | grep -v $imageA)
+    # keep B's header hash (bytes 8 to 15)
+    dd if=$imageB of=$imageA bs=1 skip=8 seek=8 count=8 conv=notrunc status=none
+    cp $imageA $imageB
+    myoutput=$(SCHEMER_CACHE_DIR=$cacheDir $INTERPRETER -e <<< $progB)
+    rm -r $cacheDir
+
+    if [ "$myoutput" = "23" ]; then
+        printf "test image cache pass\n"
+    else
+        printf "test image cache failed, expect 23 got %s\n" "$myoutput"
+    fi
+}
+
 function main() {
     interpreter_test
+    dump_test
+    profile_test
+    verify_test
+    cache_test
     compiler_test
+    [ -f $COMPILER_OUT_PATH/runtime.bc ] && compiler_test --runtime $COMPILER_OUT_PATH/runtime.bc
 }
 
 
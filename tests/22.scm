@@ -0,0 +1,19 @@
+(define (classify x)
+  (case x
+	[(a e i o u) 1]
+	[(1 2 3) 2]
+	[(#t) 3]
+	[(#f) 4]
+	[else 0]))
+
+(define (sign n)
+  (cond
+	[(< n 0) -1]
+	[(= n 0) 0]
+	[else 1]))
+
+(define (classify-all l tail)
+  (if (null? l) tail (cons (classify (car l)) (classify-all (cdr l) tail))))
+
+(classify-all '(a x 2 7 #t #f u)
+			  (cons (sign -5) (cons (sign 0) (cons (sign 9) '()))))
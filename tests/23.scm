@@ -0,0 +1,11 @@
+(define (range l h acc)
+  (if (< l h) (range l (- h 1) (cons (- h 1) acc)) acc))
+
+(define (sum l acc)
+  (if (null? l) acc (sum (cdr l) (+ acc (car l)))))
+
+(define (churn n acc)
+  (if (= n 0) acc (churn (- n 1) (+ acc (sum (range 0 1000 '()) 0)))))
+
+(let ([keep (range 0 100000 '())])
+  (cons (churn 2000 0) (sum keep 0)))
@@ -0,0 +1,12 @@
+(define (ev? n) (if (= n 0) #t (od? (- n 1))))
+(define (od? n) (if (= n 0) #f (ev? (- n 1))))
+
+(define (count-down n acc)
+  (if (= n 0) acc (count-down (- n 1) (+ acc 1))))
+
+(define (apply-n f n x)
+  (if (= n 0) x (apply-n f (- n 1) (f x))))
+
+(cons (ev? 1000001)
+	  (cons (count-down 1000000 0)
+			(cons (apply-n (lambda (x) (+ x 2)) 1000000 0) '())))
@@ -0,0 +1,5 @@
+(define (f a)
+  (cons (let ([x (cons a 2)]) (car x))
+		(let ([x 5]) (+ x a))))
+
+(f 3)
@@ -0,0 +1,18 @@
+(define (make-counter start)
+  (let ([n start])
+    (lambda (step)
+      (begin (set! n (+ n step)) n))))
+
+(define (adder a b c)
+  (lambda (x)
+    (lambda (y) (+ a (+ b (+ c (+ x y)))))))
+
+(define (go)
+  (let ([c1 (make-counter 10)]
+        [c2 (make-counter 100)])
+    (let ([r1 (c1 1)])
+      (let ([r2 (c2 5)])
+        (let ([r3 (c1 2)])
+          (cons r1 (cons r2 (cons r3 (cons (c2 0) (cons (((adder 1 2 3) 4) 5) '()))))))))))
+
+(go)
@@ -0,0 +1,5 @@
+(define (f) '(1 (2 3) 4))
+(define (g) '(1 (2 3) 4))
+(define (h) 'sym)
+(let ([a (f)] [b (g)])
+  (cons (eq? a (f)) (cons (eq? (h) 'sym) (cons (car (cdr (cdr a))) (cons (car (car (cdr b))) '())))))
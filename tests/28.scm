@@ -0,0 +1,12 @@
+(define (make-acc n) (lambda (d) (begin (set! n (+ n d)) n)))
+
+(define (build k acc) (if (= k 0) acc (build (- k 1) (cons (make-acc k) acc))))
+
+(define (bump-all l d s) (if (null? l) s (bump-all (cdr l) d (+ s ((car l) d)))))
+
+(define (churn n) (if (= n 0) 0 (begin (build 1000 '()) (churn (- n 1)))))
+
+(let ([accs (build 10000 '())])
+  (let ([a (bump-all accs 1 0)])
+    (begin (churn 500)
+           (cons a (bump-all accs 1 0)))))
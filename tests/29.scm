@@ -0,0 +1,16 @@
+(define (make-k a b c d e f)
+  (lambda (x) (+ a (+ b (+ c (+ (car d) (+ (e x) (f x))))))))
+
+(define (make-many n acc)
+  (if (= n 0)
+      acc
+      (make-many (- n 1) (cons (make-k n 1 2 (cons n '()) (lambda (y) (* y 2)) (lambda (y) (+ y n))) acc))))
+
+(define (call-all l x s) (if (null? l) s (call-all (cdr l) x (+ s ((car l) x)))))
+
+(define (churn n) (if (= n 0) 0 (begin (make-many 1000 '()) (churn (- n 1)))))
+
+(let ([ks (make-many 5000 '())])
+  (let ([before (call-all ks 10 0)])
+    (begin (churn 300)
+           (cons before (call-all ks 10 0)))))
@@ -0,0 +1,14 @@
+(define (go n)
+  (let ([sq (lambda (x) (* x x))]
+        [inc (lambda (x) (+ x 1))])
+    (let ([f (lambda (x) (sq (inc x)))])
+      (let ([r1 (f n)])
+        (let ([sq (lambda (x) (- 0 x))])
+          (cons r1 (cons (sq n) (cons (f n) (cons ((lambda (h) (h 5)) inc) '())))))))))
+
+(define (swap n)
+  (let ([g (lambda (x) (+ x 1))])
+    (begin (set! g (lambda (x) (* x 10)))
+           (g n))))
+
+(cons (swap 4) (go 3))
@@ -0,0 +1,10 @@
+(define (fib-iter a b n) (if (= n 0) a (fib-iter b (+ a b) (- n 1))))
+
+(define (swap-n a b n) (if (= n 0) (- a b) (swap-n b a (- n 1))))
+
+(define (count-up i n acc) (if (= i n) acc (count-up (+ i 1) n (+ acc (- n i)))))
+
+(cons (fib-iter 0 1 50)
+      (cons (swap-n 1 2 1000001)
+            (cons (swap-n 1 2 1000000)
+                  (cons (count-up 0 100 0) '()))))
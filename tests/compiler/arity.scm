@@ -0,0 +1,2 @@
+(define (call-with-two f) (f 1 2))
+(cons (call-with-two (lambda (a b) (+ a b))) (call-with-two (lambda (x) x)))
@@ -0,0 +1,10 @@
+(define (kinds v tail)
+  (cons (null? v) (cons (pair? v) (cons (symbol? v) (cons (number? v)
+    (cons (boolean? v) (cons (box? v) (cons (vector? v) tail))))))))
+
+(define (fill v i n) (if (= i n) v (begin (vector-set! v i (* i i)) (fill v (+ i 1) n))))
+
+(let ([v (fill (make-vector 5 0) 0 5)] [p (cons 1 (cons 2 '()))] [b (box 7)])
+  (kinds 1 (kinds '() (kinds p (kinds 'a (kinds #f (kinds b (kinds v (kinds (lambda (x) x)
+    (cons (car p) (cons (car (cdr p)) (cons (null? (cdr (cdr p))) (cons (unbox b)
+      (cons (vector-ref v 3) (cons (vector-length v) (cons (eq? 'a 'a) (cons (eq? p (cdr p)) '()))))))))))))))))))
@@ -0,0 +1,3 @@
+(define (adder a b c)
+  (lambda (x)
+    (lambda (y) (+ a (+ b (+ c (+ x y)))))))
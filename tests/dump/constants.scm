@@ -0,0 +1,2 @@
+(define (f) '(1 (2 3)))
+(define (g) (cons '(1 (2 3)) 7))
@@ -0,0 +1,3 @@
+(if (< 1 2) (+ 3 4) (* 5 6))
+(define (f x) (if (if x #f #t) 1 2))
+(define (g x) (begin 1 2 x))
@@ -0,0 +1,21 @@
+(define (search l x)
+  (call/cc
+	(lambda (return)
+	  (letrec ([loop (lambda (l)
+					   (if (null? l)
+						   #f
+						   (if (= (car l) x) (return l) (loop (cdr l)))))])
+		(loop l)))))
+
+(define saved #f)
+(define count 0)
+
+(define (run)
+  (let ([v (call/cc (lambda (k) (begin (set! saved k) 0)))])
+	(begin
+	  (set! count (+ count 1))
+	  (if (< v 3)
+		  (saved (+ v 1))
+		  (cons count (search '(1 2 3 4) 3))))))
+
+(run)
@@ -0,0 +1,5 @@
+(define (add a b) (+ a b))
+(add 1 2)
+(add 1 #t)
+(add 3 4)
+(add 5 6)
@@ -0,0 +1,15 @@
+(define counter 0)
+(define (bump!) (set! counter (+ counter 1)))
+(define (parity n)
+  (begin
+    (define (ev? k) (if (= k 0) #t (od? (- k 1))))
+    (define (od? k) (if (= k 0) #f (ev? (- k 1))))
+    (cons (ev? n) (od? n))))
+(define (apply2 f a b) (f a b))
+(begin (bump!) (bump!) counter)
+(+ 1 2 3 4 5)
+(- 10 1 2)
+(apply2 + 3 4)
+(apply2 cons 1 2)
+(letrec ([fact (lambda (n) (if (= n 0) 1 (* n (fact (- n 1)))))]) (fact 10))
+(parity 7)
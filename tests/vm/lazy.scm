@@ -0,0 +1,5 @@
+(define (used x) (+ x 1))
+(define (unused-a x) (* x 2))
+(define (unused-b x) (lambda (y) (- x y)))
+(define (outer x) (lambda (y) (+ x y)))
+((outer 1) (used 2))
@@ -0,0 +1,19 @@
+(define (sum-to n)
+  (let loop ([i 0] [acc 0])
+	(if (> i n) acc (loop (+ i 1) (+ acc i)))))
+
+(define (call-all fs tail)
+  (if (null? fs) tail (cons ((car fs)) (call-all (cdr fs) tail))))
+
+(define (closures n)
+  (do ([i 0 (+ i 1)]
+	   [fs '() (cons (lambda () i) fs)])
+	  ((= i n) fs)))
+
+(define (doubled n)
+  (let loop ([i 0] [fs '()])
+	(if (= i n)
+		fs
+		(loop (+ i 1) (cons (lambda () (begin (set! i (* i 2)) i)) fs)))))
+
+(cons (sum-to 100) (call-all (closures 4) (call-all (doubled 3) '())))
@@ -0,0 +1,52 @@
+(define (nested acc)
+  (let l0 ([i 0] [acc acc])
+    (if (= i 1) acc (l0 (+ i 1)
+      (let l1 ([i 0] [acc acc])
+        (if (= i 1) acc (l1 (+ i 1)
+          (let l2 ([i 0] [acc acc])
+            (if (= i 1) acc (l2 (+ i 1)
+              (let l3 ([i 0] [acc acc])
+                (if (= i 1) acc (l3 (+ i 1)
+                  (let l4 ([i 0] [acc acc])
+                    (if (= i 1) acc (l4 (+ i 1)
+                      (let l5 ([i 0] [acc acc])
+                        (if (= i 1) acc (l5 (+ i 1)
+                          (let l6 ([i 0] [acc acc])
+                            (if (= i 1) acc (l6 (+ i 1)
+                              (let l7 ([i 0] [acc acc])
+                                (if (= i 1) acc (l7 (+ i 1)
+                                  (let l8 ([i 0] [acc acc])
+                                    (if (= i 1) acc (l8 (+ i 1)
+                                      (let l9 ([i 0] [acc acc])
+                                        (if (= i 1) acc (l9 (+ i 1)
+                                          (let l10 ([i 0] [acc acc])
+                                            (if (= i 1) acc (l10 (+ i 1)
+                                              (let l11 ([i 0] [acc acc])
+                                                (if (= i 1) acc (l11 (+ i 1)
+                                                  (let l12 ([i 0] [acc acc])
+                                                    (if (= i 1) acc (l12 (+ i 1)
+                                                      (let l13 ([i 0] [acc acc])
+                                                        (if (= i 1) acc (l13 (+ i 1)
+                                                          (let l14 ([i 0] [acc acc])
+                                                            (if (= i 1) acc (l14 (+ i 1)
+                                                              (let l15 ([i 0] [acc acc])
+                                                                (if (= i 1) acc (l15 (+ i 1)
+                                                                  (let l16 ([i 0] [acc acc])
+                                                                    (if (= i 1) acc (l16 (+ i 1)
+                                                                      (let l17 ([i 0] [acc acc])
+                                                                        (if (= i 1) acc (l17 (+ i 1)
+                                                                          (let l18 ([i 0] [acc acc])
+                                                                            (if (= i 1) acc (l18 (+ i 1)
+                                                                              (let l19 ([i 0] [acc acc])
+                                                                                (if (= i 1) acc (l19 (+ i 1)
+                                                                                  (let l20 ([i 0] [acc acc])
+                                                                                    (if (= i 1) acc (l20 (+ i 1)
+                                                                                      (let l21 ([i 0] [acc acc])
+                                                                                        (if (= i 1) acc (l21 (+ i 1)
+                                                                                          (let l22 ([i 0] [acc acc])
+                                                                                            (if (= i 1) acc (l22 (+ i 1)
+                                                                                              (let l23 ([i 0] [acc acc])
+                                                                                                (if (= i 1) acc (l23 (+ i 1)
+                                                                                                  (+ acc 1))))))))))))))))))))))))))))))))))))))))))))))))))))))))))))))))))))))))))
+
+(nested 41)
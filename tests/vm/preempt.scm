@@ -0,0 +1,12 @@
+(define ch (make-channel))
+(define (count-to n) (let loop ([i 0]) (if (= i n) n (loop (+ i 1)))))
+(define (sum-to n) (if (= n 0) 0 (+ n (sum-to (- n 1)))))
+(define (race)
+  (begin
+    (spawn (lambda () (channel-send ch (count-to 100000))))
+    (spawn (lambda () (channel-send ch (sum-to 3000))))
+    (spawn (lambda () (channel-send ch (count-to 10))))
+    (let ([a (channel-recv ch)])
+      (let ([b (channel-recv ch)])
+        (cons a (cons b (cons (channel-recv ch) '())))))))
+(race)
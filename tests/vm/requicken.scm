@@ -0,0 +1,5 @@
+(define (add a b) (+ a b))
+(add 1 2)
+(add 1 #t)
+(define (loop n acc) (if (= n 0) acc (loop (- n 1) (add acc 1))))
+(loop 100 0)